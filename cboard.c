@@ -91,6 +91,80 @@
 #define HISTORY_HEIGHT		((MEGA_BOARD) ? HISTORY_HEIGHT_MB : LINES - BOARD_HEIGHT)
 #define HISTORY_WIDTH		((MEGA_BOARD) ? HISTORY_WIDTH_MB : COLS - STATUS_WIDTH)
 #define MAX_VALUE_WIDTH	        (COLS - 8)
+/*
+ * Size of the fixed per-engine read buffer. Lines are clamped to
+ * ENGINE_LINE_MAX characters before being passed to parse_engine_output()
+ * which copies each line into a 255 byte buffer.
+ */
+#define ENGINE_IOBUF_SIZE	8192
+#define ENGINE_LINE_MAX		254
+/*
+ * Default number of lines kept for the engine IO window (-l).
+ */
+#define ENGINE_SCROLLBACK	256
+/*
+ * Number of principal variations requested from the engine and shown in the
+ * analysis window.
+ */
+#define ANALYSIS_MULTIPV	3
+/*
+ * Default number of engine processes shared by all games (-P).
+ */
+#define ENGINE_POOL_SIZE	2
+
+/*
+ * Default maximum number of screen updates per second (-F). update_all()
+ * and the clock only mark windows dirty and game_loop() flushes them.
+ */
+#define FRAME_RATE		30
+
+/*
+ * IDs of the interned tag names that are looked up directly. The seven tag
+ * roster comes first in PGN order.
+ */
+#define TAG_EVENT		0
+#define TAG_SITE		1
+#define TAG_DATE		2
+#define TAG_ROUND		3
+#define TAG_WHITE		4
+#define TAG_BLACK		5
+#define TAG_RESULT		6
+#define TAG_FEN			7
+#define TAG_KNOWN		8
+#define FRAME_BOARD		0x01
+#define FRAME_STATUS		0x02
+#define FRAME_HISTORY		0x04
+#define FRAME_TAGS		0x08
+#define FRAME_ENGINE		0x10
+#define FRAME_ANALYSIS		0x20
+#define FRAME_ALL		0x3f
+/*
+ * Batch annotation (-A). A move losing at least this many centipawns
+ * compared to the engines evaluation of the previous position gets a NAG.
+ * Mate scores count as ANNOTATE_MATE_CP.
+ */
+#define ANNOTATE_DUBIOUS	50
+#define ANNOTATE_MISTAKE	100
+#define ANNOTATE_BLUNDER	300
+#define ANNOTATE_MATE_CP	1000
+#define ANNOTATE_PV_MOVES	8
+
+/*
+ * An annotating engine that hasn't finished a position ANNOTATE_MARGIN_MS
+ * after its time budget is restarted and the position left unannotated. A
+ * search limited only by depth is given ANNOTATE_DEPTH_SECS.
+ */
+#define ANNOTATE_MARGIN_MS	5000
+#define ANNOTATE_DEPTH_SECS	60
+
+/*
+ * Tournament adjudication: a game is decided when both engines agree that
+ * one side is ahead by TOURNEY_ADJUDICATE_CP for TOURNEY_ADJUDICATE_PLIES
+ * plies and drawn after TOURNEY_MAX_PLIES.
+ */
+#define TOURNEY_ADJUDICATE_CP		800
+#define TOURNEY_ADJUDICATE_PLIES	8
+#define TOURNEY_MAX_PLIES		400
 
 enum {
     UP, DOWN, LEFT, RIGHT
@@ -108,16 +182,70 @@ static WINDOW *loadingw;
 static PANEL *loadingp;
 static WINDOW *enginew;
 static PANEL *enginep;
+static WINDOW *analysisw;
+static PANEL *analysisp;
 
 static char gameexp[255];
 static char moveexp[255];
 static struct itimerval clock_timer;
 static int delete_count = 0;
+static int delete_marked;	/* Games with CF_DELETE set. */
 static int markstart = -1, markend = -1;
 static int keycount;
 static char loadfile[FILENAME_MAX];
 static int quit;
 static wint_t input_c;
+static volatile sig_atomic_t frame_dirty;
+static int frame_rate = FRAME_RATE;
+static long frame_last;
+static int engine_scrollback = ENGINE_SCROLLBACK;
+static int engine_pool_size = ENGINE_POOL_SIZE;
+static int engine_window_redraw;
+static int engine_window_offset;
+
+/*
+ * The lines of the engine IO window, one per engine. Each is allocated in
+ * one block: a ring of 'size' fixed width lines starting at 'head'. 'seq'
+ * counts every line ever appended so the window knows how many lines are new
+ * since the last update. The enginebuf member of struct engine_s is not used.
+ */
+struct enginebuf_s {
+    struct engine_s *e;
+    struct enginebuf_s *next;
+    int size;
+    int head;
+    int count;
+    unsigned long seq;
+    char line[][ENGINE_LINE_MAX + 1];
+};
+
+static struct enginebuf_s *enginebufs;
+
+/*
+ * A parsed line of engine thinking output. 'seq' is bumped whenever the line
+ * changes so the analysis window only redraws changed rows.
+ */
+struct analysis_line_s {
+    int depth;
+    int score;
+    int mate;
+    unsigned long long nodes;
+    unsigned long nps;
+    char pv[ENGINE_LINE_MAX + 1];
+    unsigned long seq;
+};
+
+/*
+ * The game being analyzed (NULL when not analyzing) and the position that
+ * was sent to the engine.
+ */
+static struct {
+    GAME g;
+    HISTORY **hp;
+    int hindex;
+    int redraw;
+    struct analysis_line_s line[ANALYSIS_MULTIPV];
+} analysis;
 
 // Loaded filename from the command line or from the file input dialog.
 static int filetype;
@@ -206,6 +334,12 @@ static const bool cb[8][8] = {
 };
 
 static void free_userdata_once(GAME g);
+static GAME use_game(int n);
+static void tags_changed(int n);
+static void moves_changed(GAME g);
+static void parse_analysis_line(GAME g, char *str);
+static int lease_engine(GAME g);
+static void release_engine(GAME g);
 static void do_more_help(WIN *);
 
 void coordofmove(GAME g, char *move, char *prow, char *pcol)
@@ -238,6 +372,236 @@ void rotate_position(char *prow, char *pcol)
   *pcol = INV_INT(*pcol);
 }
 
+/*
+ * Returns entry 'n' of history 'h' which has 'total' entries or NULL if out of
+ * range. Unlike pgn_history_by_n() this doesn't walk the array so callers
+ * needing several entries only count the history once.
+ */
+static HISTORY *history_at(HISTORY **h, int total, int n)
+{
+    return (h && n >= 0 && n < total) ? h[n] : NULL;
+}
+
+/*
+ * Decoded boards of recently visited history positions. pgn_board_update()
+ * parses the FEN of the previous move, validates the next move and parses
+ * the FEN again for every step so stepping through a game keeps the result
+ * here, keyed by game, history pointer and ply, and reuses the least
+ * recently used entry when full.
+ */
+#define POSITION_CACHE_SIZE	1024
+
+struct position_cache_s {
+    GAME g;
+    HISTORY **hp;
+    int n;
+    char *base;		/* FEN the board at ply 0 starts from. */
+    HISTORY *h;		/* The move 'n' follows. */
+    struct game_s state;
+    BOARD b;
+    int hnext;		/* Next entry in the same hash bucket. */
+    int prev, next;	/* Least recently used order. */
+};
+
+static struct position_cache_s *position_cache;
+static int position_bucket[POSITION_CACHE_SIZE];
+static int position_lru, position_mru, position_used;
+
+static void reset_position_cache()
+{
+    free(position_cache);
+    position_cache = NULL;
+    position_used = 0;
+}
+
+static unsigned position_hash(GAME g, HISTORY **hp, int n)
+{
+    unsigned long v = (unsigned long)g ^ ((unsigned long)hp >> 3)
+	^ ((unsigned long)n * 2654435761UL);
+
+    return (v ^ (v >> 16)) % POSITION_CACHE_SIZE;
+}
+
+static void position_unlink(int i)
+{
+    struct position_cache_s *e = &position_cache[i];
+
+    if (e->prev != -1)
+	position_cache[e->prev].next = e->next;
+    else
+	position_lru = e->next;
+
+    if (e->next != -1)
+	position_cache[e->next].prev = e->prev;
+    else
+	position_mru = e->prev;
+}
+
+static void position_touch(int i)
+{
+    struct position_cache_s *e = &position_cache[i];
+
+    e->prev = position_mru;
+    e->next = -1;
+
+    if (position_mru != -1)
+	position_cache[position_mru].next = i;
+    else
+	position_lru = i;
+
+    position_mru = i;
+}
+
+/*
+ * Removes every cached position of game 'g'. Called when its history is
+ * changed or freed.
+ */
+static void forget_positions(GAME g)
+{
+    int i, *p;
+
+    for (i = 0; i < position_used; i++) {
+	struct position_cache_s *e = &position_cache[i];
+
+	if (e->g != g)
+	    continue;
+
+	for (p = &position_bucket[position_hash(e->g, e->hp, e->n)]; *p != i;
+		p = &position_cache[*p].hnext);
+
+	*p = e->hnext;
+	e->g = NULL;
+	position_unlink(i);
+	e->prev = -1;
+	e->next = position_lru;
+
+	if (position_lru != -1)
+	    position_cache[position_lru].prev = i;
+	else
+	    position_mru = i;
+
+	position_lru = i;
+    }
+}
+
+static char *position_base(GAME g)
+{
+    int n;
+
+    if (g->ravlevel)
+	return g->rav[g->ravlevel - 1].fen;
+
+    n = pgn_tag_find(g->tag, "FEN");
+    return (n == -1) ? NULL : g->tag[n]->value;
+}
+
+/*
+ * Same as pgn_board_update() but takes the board and game state from the
+ * position cache when ply 'n' of the current history was decoded before.
+ */
+static pgn_error_t history_board_update(GAME g, BOARD b, int n)
+{
+    struct position_cache_s *e;
+    struct game_s keep;
+    unsigned bucket = position_hash(g, g->hp, n);
+    char *base = (n) ? NULL : position_base(g);
+    HISTORY *h = (n && g->hp) ? g->hp[n - 1] : NULL;
+    pgn_error_t ret;
+    int i;
+
+    if (!position_cache) {
+	position_cache = Malloc(POSITION_CACHE_SIZE
+		* sizeof(struct position_cache_s));
+	position_lru = position_mru = -1;
+
+	for (i = 0; i < POSITION_CACHE_SIZE; i++)
+	    position_bucket[i] = -1;
+    }
+
+    for (i = position_bucket[bucket]; i != -1; i = position_cache[i].hnext) {
+	e = &position_cache[i];
+
+	if (e->g != g || e->hp != g->hp || e->n != n || e->base != base
+		|| e->h != h)
+	    continue;
+
+	keep = *g;
+	*g = e->state;
+	g->tag = keep.tag;
+	g->history = keep.history;
+	g->hp = keep.hp;
+	g->rav = keep.rav;
+	g->ravlevel = keep.ravlevel;
+	g->hindex = keep.hindex;
+	g->side = keep.side;
+	g->data = keep.data;
+	memcpy(b, e->b, sizeof(BOARD));
+	position_unlink(i);
+	position_touch(i);
+	return E_PGN_OK;
+    }
+
+    if ((ret = pgn_board_update(g, b, n)) != E_PGN_OK)
+	return ret;
+
+    if (position_used < POSITION_CACHE_SIZE)
+	i = position_used++;
+    else {
+	int *p;
+
+	i = position_lru;
+	e = &position_cache[i];
+
+	if (e->g) {
+	    for (p = &position_bucket[position_hash(e->g, e->hp, e->n)];
+		    *p != i; p = &position_cache[*p].hnext);
+
+	    *p = e->hnext;
+	}
+
+	position_unlink(i);
+    }
+
+    e = &position_cache[i];
+    e->g = g;
+    e->hp = g->hp;
+    e->n = n;
+    e->base = base;
+    e->h = h;
+    e->state = *g;
+    memcpy(e->b, b, sizeof(BOARD));
+    e->hnext = position_bucket[bucket];
+    position_bucket[bucket] = i;
+    position_touch(i);
+    return ret;
+}
+
+/*
+ * Like pgn_history_next() and pgn_history_prev() but using the position
+ * cache.
+ */
+static void history_next(GAME g, BOARD b, int n)
+{
+    int total = pgn_history_total(g->hp);
+
+    if (g->hindex + n > total)
+	g->hindex = (n <= 2) ? 0 : total;
+    else
+	g->hindex += n;
+
+    history_board_update(g, b, g->hindex);
+}
+
+static void history_prev(GAME g, BOARD b, int n)
+{
+    if (g->hindex - n < 0)
+	g->hindex = (n <= 2) ? pgn_history_total(g->hp) : 0;
+    else
+	g->hindex -= n;
+
+    history_board_update(g, b, g->hindex);
+}
+
 void update_cursor(GAME g, int idx)
 {
     int t = pgn_history_total(g->hp);
@@ -476,7 +840,9 @@ int do_game_write(char *filename, char *mode, int start, int end)
     for (i = (start == -1) ? 0 : start; i < end; i++) {
 	d = game[i]->data;
 	pgn_write(pgn, game[i]);
-	CLEAR_FLAG(d->flags, CF_MODIFIED);
+
+	if (d)
+	    CLEAR_FLAG(d->flags, CF_MODIFIED);
     }
 
     if (pgn_close(pgn) != E_PGN_OK)
@@ -843,6 +1209,164 @@ void print_piece(WINDOW *w, int l, int c, char p)
         mvwprintw(w, l + y, c, f_pieces[0]);
 }
 
+/*
+ * Longest FEN board_to_fen() can write including the terminating NUL.
+ */
+#define FEN_MAX			96
+
+/*
+ * Writes the FEN of board 'b' of game 'g' to 'buf' which must hold FEN_MAX
+ * bytes and returns 'buf'. The result is the same as pgn_game_to_fen() but
+ * nothing is allocated, the side to move is taken from the parity of the
+ * moves after the current one rather than switching turns once per move and
+ * en passant squares of 'b' are left alone.
+ */
+static char *board_to_fen(GAME g, BOARD b, char *buf)
+{
+    static const char *castle = "KQkq";
+    static const int rook_col[4] = { 7, 0, 7, 0 };
+    static const unsigned short castle_flag[4] = {
+	GF_WK_CASTLE, GF_WQ_CASTLE, GF_BK_CASTLE, GF_BQ_CASTLE
+    };
+    char *p = buf, *e = NULL;
+    char ep[2];
+    int row, col, i;
+    int turn = ((pgn_history_total(g->hp) - g->hindex) % 2) ? !g->turn :
+	g->turn;
+
+    for (row = 0; row < 8; row++) {
+	int count = 0;
+
+	for (col = 0; col < 8; col++) {
+	    int c = b[row][col].icon;
+
+	    if (b[row][col].enpassant) {
+		ep[0] = 'a' + col;
+		ep[1] = '8' - row;
+		e = ep;
+		c = '.';
+	    }
+
+	    if (pgn_piece_to_int(c) == OPEN_SQUARE) {
+		count++;
+		continue;
+	    }
+
+	    if (count)
+		*p++ = '0' + count;
+
+	    count = 0;
+	    *p++ = c;
+	}
+
+	if (count)
+	    *p++ = '0' + count;
+
+	*p++ = (row < 7) ? '/' : ' ';
+    }
+
+    *p++ = (turn == WHITE) ? 'w' : 'b';
+    *p++ = ' ';
+
+    for (i = 0; i < 4; i++) {
+	int r = (i < 2) ? 7 : 0;
+	int k = b[r][4].icon, c = b[r][rook_col[i]].icon;
+
+	if (TEST_FLAG(g->flags, castle_flag[i])
+		&& pgn_piece_to_int(c) == ROOK && pgn_piece_to_int(k) == KING
+		&& ((i < 2) ? isupper(c) && isupper(k) :
+		    islower(c) && islower(k)))
+	    *p++ = castle[i];
+    }
+
+    if (p[-1] == ' ')
+	*p++ = '-';
+
+    *p++ = ' ';
+
+    if (e) {
+	*p++ = e[0];
+	*p++ = e[1];
+    }
+    else
+	*p++ = '-';
+
+    snprintf(p, FEN_MAX - (p - buf), " %i %i", g->ply,
+	    (g->hindex / 2) + (g->hindex % 2));
+    return buf;
+}
+
+/*
+ * Sets the pieces of board 'b' from the piece placement field of 'fen'.
+ * Unlike pgn_board_init_fen() the game state isn't touched. Returns
+ * E_PGN_PARSE if the placement is invalid.
+ */
+static pgn_error_t fen_to_board(const char *fen, BOARD b)
+{
+    int row = 0, col = 0;
+
+    memset(b, 0, sizeof(BOARD));
+
+    for (; *fen && *fen != ' '; fen++) {
+	if (*fen == '/') {
+	    if (col != 8 || ++row > 7)
+		return E_PGN_PARSE;
+
+	    col = 0;
+	}
+	else if (*fen >= '1' && *fen <= '8') {
+	    int n = *fen - '0';
+
+	    if (col + n > 8)
+		return E_PGN_PARSE;
+
+	    while (n--)
+		b[row][col++].icon = '.';
+	}
+	else {
+	    if (col > 7 || pgn_piece_to_int(*fen) == E_PGN_ERR)
+		return E_PGN_PARSE;
+
+	    b[row][col++].icon = *fen;
+	}
+    }
+
+    return (row == 7 && col == 8) ? E_PGN_OK : E_PGN_PARSE;
+}
+
+/*
+ * Initializes game 'g' and board 'b' from 'fen' like pgn_board_init_fen().
+ * libchess rejects a FEN with an en passant target square so the square is
+ * removed before parsing and set here afterwards.
+ */
+static pgn_error_t game_init_fen(GAME g, BOARD b, const char *fen)
+{
+    char buf[FEN_MAX], *p = buf;
+    int i, col = 0, row = 0, enpassant = 0;
+    pgn_error_t ret;
+
+    strncpy(buf, fen, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+
+    for (i = 0; i < 3 && (p = strchr(p, ' ')); i++)
+	p++;
+
+    if (p && VALIDCOL(p[0]) && VALIDROW(p[1])) {
+	col = p[0] - 'a';
+	row = RANKTOBOARD(RANKTOINT(p[1]));
+	p[0] = '-';
+	memmove(p + 1, p + 2, strlen(p + 2) + 1);
+	enpassant = 1;
+    }
+
+    if ((ret = pgn_board_init_fen(g, b, buf)) != E_PGN_OK || !enpassant)
+	return ret;
+
+    b[row][col].enpassant = 1;
+    SET_FLAG(g->flags, GF_ENPASSANT);
+    return E_PGN_OK;
+}
+
 void board_prev_move_play (GAME g)
 {
   struct userdata_s *d = g->data;
@@ -896,10 +1420,8 @@ void board_prev_move_history (GAME g)
 
           if (g->hindex > 1) {
               HISTORY *h = pgn_history_by_n(g->hp, g->hindex - 2);
-              if (h) {
-                  pgn_board_init_fen(g, ob, h->fen);
-                  pgn_switch_turn(g);
-              }
+              if (h && fen_to_board(h->fen, ob) != E_PGN_OK)
+                  pgn_board_init(ob);
           }
 
           for (f = 0; f < 8; f++) {
@@ -930,37 +1452,199 @@ void board_prev_move_history (GAME g)
   }
 }
 
-static int is_the_square (int brow, int bcol, int row, int col,
-			int prow, int pcol)
+/*
+ * Screen layout of the board for the current window size, rotation and
+ * coordinate placement. board_geometry() computes it once so the renderer
+ * can work per square rather than per screen cell.
+ */
+struct board_square_geom_s {
+    int y, x;		/* Top left cell of the square. */
+    int br, bc;		/* Index into the BOARD. */
+    int light;
+};
+
+static struct board_geom_s {
+    int height, width;
+    int rowr, colr;	/* Grid line spacing. */
+    int rotate;
+    int left;		/* config.coordsyleft */
+    struct board_square_geom_s sq[8][8];	/* By screen row and column. */
+    chtype *grid;	/* Line graphic or 0 for each cell. */
+} board_geom;
+
+/*
+ * What was last drawn in each board square. update_board_window() only
+ * redraws squares whose piece or attributes changed and draws the grid and
+ * coordinates when 'board_redraw' is set.
+ */
+struct board_cell_s {
+    unsigned char p;
+    chtype attrs;
+    chtype bg;
+};
+
+static struct board_cell_s board_cells[8][8];
+static int board_redraw = 1;
+
+static void board_geometry(int rotate)
+{
+    struct board_geom_s *bg = &board_geom;
+    int maxy = BOARD_HEIGHT, maxx = BOARD_WIDTH;
+    int row, col, r, c;
+
+    bg->height = maxy;
+    bg->width = maxx;
+    bg->rowr = (MEGA_BOARD) ? 6 : (BIG_BOARD) ? 4 : 2;
+    bg->colr = (MEGA_BOARD) ? 12 : (BIG_BOARD) ? 8 : 4;
+    bg->rotate = rotate;
+    bg->left = config.coordsyleft;
+
+    for (r = 0; r < 8; r++) {
+	for (c = 0; c < 8; c++) {
+	    struct board_square_geom_s *s = &bg->sq[r][c];
+
+	    s->y = 1 + r * bg->rowr;
+	    s->x = 1 + c * bg->colr;
+	    s->br = (rotate) ? INV_INT0(r) : r;
+	    s->bc = (rotate) ? INV_INT0(c) : c;
+	    s->light = cb[r][c];
+	}
+    }
+
+    free(bg->grid);
+    bg->grid = Calloc(maxy * maxx, sizeof(chtype));
+
+    for (row = 0; row < maxy - 1; row++) {
+	for (col = 0; col < maxx - 1; col++) {
+	    chtype *g = &bg->grid[row * maxx + col];
+
+	    if (row == 0 || row == maxy - 2) {
+		if (col == 0)
+		    *g = (row) ? ACS_LLCORNER : ACS_ULCORNER;
+		else if (col == maxx - 2)
+		    *g = (row) ? ACS_LRCORNER : ACS_URCORNER;
+		else if (!(col % bg->colr))
+		    *g = (row) ? ACS_BTEE : ACS_TTEE;
+		else
+		    *g = ACS_HLINE;
+	    }
+	    else if (col == 0 || col == maxx - 2) {
+		if (!(row % bg->rowr))
+		    *g = (col) ? ACS_RTEE : ACS_LTEE;
+		else
+		    *g = ACS_VLINE;
+	    }
+	    else if (!(col % bg->colr))
+		*g = (row % bg->rowr) ? ACS_VLINE : ACS_PLUS;
+	    else if (!(row % bg->rowr))
+		*g = ACS_HLINE;
+	}
+    }
+
+    board_redraw = 1;
+}
+
+static int board_cell_changed(int full, int r, int c, unsigned char p,
+	chtype attrs, chtype bg)
 {
-    if ((!BIG_BOARD && row == ROWTOMATRIX(prow) && col == COLTOMATRIX(pcol))
-        || (BIG_BOARD && brow + 1 == INV_INT(prow) && bcol + 1 == pcol))
-	return 1;
+    struct board_cell_s *b = &board_cells[r][c];
 
-    return 0;
+    if (!full && b->p == p && b->attrs == attrs && b->bg == bg)
+	return 0;
+
+    b->p = p;
+    b->attrs = attrs;
+    b->bg = bg;
+    return 1;
 }
 
-static int is_prev_move (struct userdata_s *d, int brow, int bcol,
-			 int row, int col)
+/*
+ * Whether screen square 'r' and 'c' is at 'prow' and 'pcol' in the
+ * (possibly rotated) coordinates used for the cursor and move marks.
+ */
+static int is_the_square(int r, int c, int prow, int pcol)
 {
-    if (is_the_square (brow, bcol, row, col, d->pm_row, d->pm_col))
-        return 1;
+    return (r == 8 - prow && c == pcol - 1);
+}
 
-    return 0;
+/*
+ * Draws the grid and the rank and file coordinates.
+ */
+static void draw_board_grid()
+{
+    struct board_geom_s *bg = &board_geom;
+    int l = bg->left;
+    int row, col, n;
+
+    for (row = 0; row < bg->height; row++) {
+	for (col = 0; col < bg->width; col++) {
+	    chtype g = bg->grid[row * bg->width + col];
+
+	    if (g)
+		mvwaddch(boardw, row, col + l,
+			LINE_GRAPHIC(g | CP_BOARD_GRAPHICS));
+	}
+    }
+
+    wattron(boardw, CP_BOARD_COORDS);
+
+    for (n = 0; n < 8; n++)
+	mvwprintw(boardw, bg->sq[n][0].y + (bg->rowr - 1) / 2,
+		(l) ? 0 : bg->width - 1, "%d",
+		(bg->rotate) ? n + 1 : 8 - n);
+
+    wattroff(boardw, CP_BOARD_COORDS);
+
+    for (n = 0; n < 8; n++) {
+	int x = bg->sq[0][n].x + (bg->colr - 1) / 2 + l;
+	char c = (bg->rotate) ? "hgfedcba"[n] : "abcdefgh"[n];
+
+	if (!BIG_BOARD)
+	    mvwprintw(boardw, bg->height - 1, x - 1, "   ");
+
+	mvwaddch(boardw, bg->height - 1, x, c | CP_BOARD_COORDS);
+    }
+}
+
+/*
+ * Draws the piece 'p' with attributes 'attrs' in square 's'. 'bg' is the
+ * attribute of the square padding on the small board.
+ */
+static void draw_board_square(struct board_square_geom_s *s, unsigned char p,
+	chtype attrs, chtype bg)
+{
+    int l = board_geom.left;
+    int pi = pgn_piece_to_int(p);
+    int i;
+
+    if (!BIG_BOARD) {
+	mvwaddch(boardw, s->y, s->x + l, ' ' | bg);
+	wattron (boardw, attrs);
+	waddwstr (boardw, piece_to_wchar (pi != OPEN_SQUARE ? p : 0));
+	wattroff (boardw, attrs);
+	waddch(boardw, ' ' | bg);
+	return;
+    }
+
+    wattron (boardw, attrs);
+
+    if (MEGA_BOARD) {
+	for (i = 0; i < 5; i++)
+	    mvwprintw(boardw, s->y + i, s->x + l, "           ");
+
+	if (pi != OPEN_SQUARE)
+	    print_piece(boardw, s->y + 1, s->x + 2 + l, p);
+    }
+    else
+	print_piece(boardw, s->y, s->x + l, (pi != OPEN_SQUARE) ? p : 0);
+
+    wattroff (boardw, attrs);
 }
 
 void update_board_window(GAME g)
 {
-    int row, col;
-    int bcol = 0, brow = 0;
-    int l = config.coordsyleft;
-    int maxy = BOARD_HEIGHT, maxx = BOARD_WIDTH;
-    int ncols = 0, offset = 1;
-    int rowr = (MEGA_BOARD) ? 6 : (BIG_BOARD) ? 4 : 2;
-    int colr = (MEGA_BOARD) ? 12 : (BIG_BOARD) ? 8 : 4;
-    unsigned coords_y = 8, cxgc = 0;
-    unsigned i, cpd = 0;
     struct userdata_s *d = g->data;
+    int r, c, full;
 
     if (config.bprevmove && d->mode != MODE_EDIT) {
         if (!d->pm_undo && d->mode == MODE_PLAY)
@@ -978,332 +1662,103 @@ void update_board_window(GAME g)
     if (d->mode != MODE_PLAY && d->mode != MODE_EDIT)
 	update_cursor(g, g->hindex);
 
-    if (BIG_BOARD) {
-	if (d->rotate) {
-	    brow = 7;
-	    coords_y = 1;
-	}
-    }
-    else {
-        if (d->rotate) {
-	    brow = 1;
-	    coords_y = 1;
-	}
-	else
-	    brow = 8;
-    }
+    if (!board_geom.grid || board_geom.rotate != d->rotate
+	    || board_geom.left != config.coordsyleft
+	    || board_geom.height != BOARD_HEIGHT
+	    || board_geom.width != BOARD_WIDTH)
+	board_geometry(d->rotate);
 
-    for (row = 0; row < maxy; row++) {
-        if (BIG_BOARD) {
-	    if (d->rotate)
-	        bcol = 7;
-	    else
-	        bcol = 0;
-	}
-	else {
-	    if (d->rotate)
-	        bcol = 8;
-	    else
-	        bcol = 1;
-	}
+    full = board_redraw;
+
+    if (full)
+	draw_board_grid();
 
-	for (col = 0; col < maxx; col++) {
-	    int attrwhich = -1;
-	    chtype attrs = 0, old_attrs = 0;
-	    unsigned char p;
+    for (r = 0; r < 8; r++) {
+	for (c = 0; c < 8; c++) {
+	    struct board_square_geom_s *s = &board_geom.sq[r][c];
+	    int attrwhich = (s->light) ? WHITE : BLACK;
+	    chtype attrs = 0, old_attrs = 0, bg;
+	    unsigned char p = d->b[s->br][s->bc].icon;
+	    int pi = pgn_piece_to_int(p);
 	    int can_attack = 0;
 	    int valid = 0;
 
-	    if (row == 0 || row == maxy - 2) {
-		if (col == 0)
-		    mvwaddch(boardw, row, col + l,
-			     LINE_GRAPHIC((row)
-					  ? ACS_LLCORNER | CP_BOARD_GRAPHICS
-					  : ACS_ULCORNER | CP_BOARD_GRAPHICS));
-		else if (col == maxx - 2)
-		    mvwaddch(boardw, row, col + l,
-			     LINE_GRAPHIC((row)
-					  ? ACS_LRCORNER | CP_BOARD_GRAPHICS
-					  : ACS_URCORNER | CP_BOARD_GRAPHICS));
-		else if (!(col % colr))
-		    mvwaddch(boardw, row, col + l,
-			     LINE_GRAPHIC((row)
-					  ? ACS_BTEE | CP_BOARD_GRAPHICS
-					  : ACS_TTEE | CP_BOARD_GRAPHICS));
-		else {
-		    if (col != maxx - 1)
-			mvwaddch(boardw, row, col + l,
-				LINE_GRAPHIC(ACS_HLINE | CP_BOARD_GRAPHICS));
-		}
-
-		continue;
+	    if (config.details && d->b[s->br][s->bc].enpassant) {
+		p = pi = 'x';
+		attrs = mix_cp(CP_BOARD_ENPASSANT,
+			(attrwhich == WHITE) ? CP_BOARD_WHITE : CP_BOARD_BLACK,
+			ATTRS(CP_BOARD_ENPASSANT), A_FG_B_BG);
 	    }
 
-	    if ((row % 2) && col == maxx - 1 &&
-		(coords_y > 0 && coords_y < 9)) {
-		wattron(boardw, CP_BOARD_COORDS);
-			mvwprintw(boardw,
-				  (BIG_BOARD) ? row * ((MEGA_BOARD) ? 3 : 2)
-				  : row, (l) ? 0 : col, "%d",
-				  (d->rotate) ? coords_y++ : coords_y--);
-		wattroff(boardw, CP_BOARD_COORDS);
-		continue;
+	    if (config.showattacks && config.details
+		    && piece_can_attack(g, 8 - s->br, s->bc + 1)) {
+		attrs = CP_BOARD_ATTACK;
+		old_attrs = attrs;
+		can_attack = 1;
 	    }
 
-	    if ((col == 0 || col == maxx - 2) && row != maxy - 1) {
-		if (!(row % rowr))
-		    mvwaddch(boardw, row, col + l,
-			    LINE_GRAPHIC((col) ?
-				ACS_RTEE | CP_BOARD_GRAPHICS :
-				ACS_LTEE | CP_BOARD_GRAPHICS));
-		else
-		    mvwaddch(boardw, row, col + l,
-			    LINE_GRAPHIC(ACS_VLINE | CP_BOARD_GRAPHICS));
+	    if (config.validmoves && d->b[s->br][s->bc].valid) {
+		old_attrs = -1;
+		valid = 1;
 
-		continue;
+		if (attrwhich == WHITE)
+		    attrs = mix_cp(CP_BOARD_MOVES_WHITE, IS_ENPASSANT(p),
+			    ATTRS(CP_BOARD_MOVES_WHITE), B_FG_A_BG);
+		else
+		    attrs = mix_cp(CP_BOARD_MOVES_BLACK, IS_ENPASSANT(p),
+			    ATTRS(CP_BOARD_MOVES_BLACK), B_FG_A_BG);
 	    }
+	    else if (p != 'x' && !can_attack)
+		attrs = (attrwhich == WHITE) ? CP_BOARD_WHITE : CP_BOARD_BLACK;
 
-	    if ((row % rowr) && !(col % colr) && row != maxy - 1) {
-		mvwaddch(boardw, row, col + l,
-			LINE_GRAPHIC(ACS_VLINE | CP_BOARD_GRAPHICS));
-		continue;
+	    if (is_the_square(r, c, d->c_row, d->c_col)) {
+		attrs = mix_cp(CP_BOARD_CURSOR, IS_ENPASSANT(p),
+			ATTRS(CP_BOARD_CURSOR), B_FG_A_BG);
+		old_attrs = -1;
 	    }
-
-	    if (!(col % colr) && row != maxy - 1) {
-		mvwaddch(boardw, row, col + l,
-			LINE_GRAPHIC(ACS_PLUS | CP_BOARD_GRAPHICS));
-		continue;
+	    else if (is_the_square(r, c, d->sp.srow, d->sp.scol)) {
+		attrs = mix_cp(CP_BOARD_SELECTED, IS_ENPASSANT(p),
+			ATTRS(CP_BOARD_SELECTED), B_FG_A_BG);
+		old_attrs = -1;
+	    }
+	    else if ((is_the_square(r, c, d->pm_row, d->pm_col) && !valid)
+		    || is_the_square(r, c, d->ospm_row, d->ospm_col)) {
+		attrs = mix_cp(CP_BOARD_PREVMOVE, IS_ENPASSANT(p),
+			ATTRS(CP_BOARD_PREVMOVE), B_FG_A_BG);
+		old_attrs = -1;
 	    }
 
-	    if ((row % rowr)) {
-		if ((col % colr)) {
-		    if (BIG_BOARD)
-		        attrwhich = (cb[brow][bcol]) ? WHITE : BLACK;
-		    else {
-		        if (ncols++ == 8) {
-			  offset++;
-			  ncols = 1;
-			}
-
-			if (((ncols % 2) && !(offset % 2))
-			    || (!(ncols % 2) && (offset % 2)))
-			    attrwhich = BLACK;
-			else
-			    attrwhich = WHITE;
-		    }
-
-		    if (BIG_BOARD && d->rotate) {
-		        brow = INV_INT0(brow);
-			bcol = INV_INT0(bcol);
-		    }
-
-		    if (BIG_BOARD)
-		        p = d->b[brow][bcol].icon;
-		    else
-		        p = d->b[RANKTOBOARD (brow)][FILETOBOARD (bcol)].icon;
-
-		    int pi = pgn_piece_to_int(p);
-
-		    if (config.details &&
-			((!BIG_BOARD && d->b[RANKTOBOARD (brow)][FILETOBOARD (bcol)].enpassant)
-			 || (BIG_BOARD && d->b[brow][bcol].enpassant))) {
-		        p = pi = 'x';
-			attrs = mix_cp(CP_BOARD_ENPASSANT,
-				       (attrwhich == WHITE) ? CP_BOARD_WHITE : CP_BOARD_BLACK,
-				       ATTRS(CP_BOARD_ENPASSANT), A_FG_B_BG);
-		    }
-
-		    if (config.showattacks && config.details
-			&& piece_can_attack (g,
-					     BIG_BOARD ? INV_INT0(brow)+1 : brow,
-					     BIG_BOARD ? bcol+1 : bcol)) {
-			    attrs = CP_BOARD_ATTACK;
-			    old_attrs = attrs;
-			    can_attack = 1;
-		    }
-
-		    if (config.validmoves &&
-			((!BIG_BOARD && d->b[RANKTOBOARD (brow)][FILETOBOARD (bcol)].valid)
-			 || (BIG_BOARD && d->b[brow][bcol].valid))) {
-		        old_attrs = -1;
-			valid = 1;
-
-			if (attrwhich == WHITE)
-			    attrs = mix_cp(CP_BOARD_MOVES_WHITE,
-					   IS_ENPASSANT(p),
-					   ATTRS(CP_BOARD_MOVES_WHITE),
-					   B_FG_A_BG);
-			else
-			    attrs = mix_cp(CP_BOARD_MOVES_BLACK,
-					   IS_ENPASSANT(p),
-					   ATTRS(CP_BOARD_MOVES_BLACK),
-					   B_FG_A_BG);
-		    }
-		    else if (p != 'x' && !can_attack)
-			attrs = (attrwhich == WHITE) ? CP_BOARD_WHITE : CP_BOARD_BLACK;
-
-                    if (BIG_BOARD && d->rotate) {
-                        brow = INV_INT0(brow);
-                        bcol = INV_INT0(bcol);
-                    }
-
-                    if (is_the_square (brow, bcol, row, col, d->c_row,
-                                       d->c_col)) {
-                        attrs = mix_cp(CP_BOARD_CURSOR, IS_ENPASSANT(p),
-                                       ATTRS(CP_BOARD_CURSOR), B_FG_A_BG);
-                        old_attrs = -1;
-                    }
-                    else if (is_the_square (brow, bcol, row, col,
-                                            d->sp.srow, d->sp.scol)) {
-                        attrs = mix_cp(CP_BOARD_SELECTED, IS_ENPASSANT(p),
-                                       ATTRS(CP_BOARD_SELECTED), B_FG_A_BG);
-                        old_attrs = -1;
-                    }
-		    else if ((is_prev_move (d, brow, bcol, row, col) && !valid)
-                             || (is_the_square (brow, bcol, row, col,
-                                                d->ospm_row, d->ospm_col))) {
-			attrs = mix_cp(CP_BOARD_PREVMOVE, IS_ENPASSANT(p),
-				       ATTRS(CP_BOARD_PREVMOVE), B_FG_A_BG);
-			old_attrs = -1;
-		    }
-
-		    if (row == maxy - 1)
-			attrs = 0;
-
-		    if (can_attack) {
-			int n = is_prev_move (d, brow, bcol, row, col);
-			chtype a = n && !valid
-			    ? CP_BOARD_PREVMOVE : attrwhich == WHITE ? valid ? CP_BOARD_MOVES_WHITE : CP_BOARD_WHITE : valid ? CP_BOARD_MOVES_BLACK : CP_BOARD_BLACK;
-			attrs = mix_cp(CP_BOARD_ATTACK, a,
-				       ATTRS (CP_BOARD_ATTACK), A_FG_B_BG);
-			old_attrs = -1;
-		    }
-
-		    if (BIG_BOARD)
-		        wmove(boardw, row, col + ((MEGA_BOARD) ? 5 : 3) + l);
-		    else
-		        mvwaddch(boardw, row, col + l, ' ' | attrs);
-
-		    if (row == maxy - 1 && cxgc < 8) {
-		        waddch(boardw, "abcdefgh"[(BIG_BOARD) ? bcol : bcol - 1] | CP_BOARD_COORDS);
-			cxgc++;
-		    }
-		    else {
-			if (old_attrs == -1) {
-			    old_attrs = attrs;
-			    goto printc;
-			}
-
-			old_attrs = attrs;
-
-			if (pi != OPEN_SQUARE && p != 'x' && !can_attack) {
-			    if (attrwhich == WHITE) {
-				if (isupper(p))
-				    attrs = CP_BOARD_W_W;
-				else
-				    attrs = CP_BOARD_W_B;
-			    }
-			    else {
-				if (isupper(p))
-				    attrs = CP_BOARD_B_W;
-				else
-				    attrs = CP_BOARD_B_B;
-			    }
-			}
-
-printc:
-			if (BIG_BOARD) {
-			    if (config.details && !can_attack
-				&& castling_state(g, d->b,
-				(d->rotate) ? INV_INT(brow + 1) - 1: brow,
-				(d->rotate) ? INV_INT(bcol + 1) - 1: bcol, p, 0))
-			        attrs = mix_cp(CP_BOARD_CASTLING, attrs,
-					       ATTRS(CP_BOARD_CASTLING),
-					       A_FG_B_BG);
-			}
-			else {
-			    if (config.details && !can_attack
-				&& castling_state(g, d->b, RANKTOBOARD (brow),
-						  FILETOBOARD (bcol), p, 0)) {
-			         attrs = mix_cp(CP_BOARD_CASTLING, attrs,
-						ATTRS(CP_BOARD_CASTLING),
-						A_FG_B_BG);
-			    }
-			}
-
-			if (BIG_BOARD) {
-			  // FIXME: Reimpresión de piezas(+4).
-			    if (cpd < 67) {
-				wattron (boardw, attrs);
-				if (MEGA_BOARD){
-				    for (i = 0; i < 5; i++)
-				        mvwprintw(boardw, i + brow * 6 + 1,
-						  bcol * 12 + 1 + l,
-						  "           ");
-				    if (pi != OPEN_SQUARE)
-				        print_piece(boardw, brow * 6 + 2,
-						    bcol * 12 + 3 + l, p);
-				}
-				else {
-				    print_piece(boardw, brow * 4 + 1,
-						bcol * 8 + 1 + l,
-						(pi != OPEN_SQUARE) ? p : 0);
-				}
-
-				wattroff (boardw, attrs);
-				cpd++;
-			    }
-			}
-			else {
-			    wattron (boardw, attrs);
-			    waddwstr (boardw, piece_to_wchar (pi != OPEN_SQUARE ? p : 0));
-			    wattroff (boardw, attrs);
-			}
-
-			attrs = old_attrs;
-		    }
-
-		    if (BIG_BOARD)
-		        col += (MEGA_BOARD) ? 10 : 6;
-		    else {
-		        waddch(boardw, ' ' | attrs);
-			col += 2;
-		    }
+	    if (can_attack) {
+		int n = is_the_square(r, c, d->pm_row, d->pm_col);
+		chtype a = n && !valid
+		    ? CP_BOARD_PREVMOVE : attrwhich == WHITE ? valid ? CP_BOARD_MOVES_WHITE : CP_BOARD_WHITE : valid ? CP_BOARD_MOVES_BLACK : CP_BOARD_BLACK;
+		attrs = mix_cp(CP_BOARD_ATTACK, a, ATTRS (CP_BOARD_ATTACK),
+			A_FG_B_BG);
+		old_attrs = -1;
+	    }
 
-		    if (d->rotate)
-			bcol--;
-		    else
-			bcol++;
+	    bg = attrs;
 
-		    if (BIG_BOARD) {
-		        if (bcol > 7)
-			    bcol = 0;
-			if (bcol < 0)
-			    bcol = 7;
-		    }
-		}
-	    }
-	    else {
-		if (col != maxx - 1)
-		    mvwaddch(boardw, row, col + l,
-			    LINE_GRAPHIC(ACS_HLINE | CP_BOARD_GRAPHICS));
+	    /* Color the piece unless the square is marked. */
+	    if (old_attrs != -1 && pi != OPEN_SQUARE && p != 'x'
+		    && !can_attack) {
+		if (attrwhich == WHITE)
+		    attrs = (isupper(p)) ? CP_BOARD_W_W : CP_BOARD_W_B;
+		else
+		    attrs = (isupper(p)) ? CP_BOARD_B_W : CP_BOARD_B_B;
 	    }
-	}
 
-	if (row % rowr) {
-	    if (d->rotate)
-		brow++;
-	    else
-		brow--;
-	}
+	    if (config.details && !can_attack
+		    && castling_state(g, d->b, s->br, s->bc, p, 0))
+		attrs = mix_cp(CP_BOARD_CASTLING, attrs,
+			ATTRS(CP_BOARD_CASTLING), A_FG_B_BG);
 
-	if (BIG_BOARD) {
-	    if (brow > 7)
-	        brow = 0;
-	    if (brow < 0)
-	        brow = 7;
+	    if (board_cell_changed(full, r, c, p, attrs, bg))
+		draw_board_square(s, p, attrs, bg);
 	}
     }
+
+    board_redraw = 0;
 }
 
 void invalid_move(int n, int e, const char *m)
@@ -1325,8 +1780,9 @@ void gameover(GAME g)
     stop_engine(g);
 }
 
-static void update_clock(GAME g, struct itimerval it)
+static void update_clock(int n, struct itimerval it)
 {
+    GAME g = game[n];
     struct userdata_s *d = g->data;
 
     if (TEST_FLAG(d->flags, CF_CLOCK) && g->turn == WHITE) {
@@ -1341,6 +1797,7 @@ static void update_clock(GAME g, struct itimerval it)
 	if (d->wclock.tc[d->wclock.tcn][1] &&
 		d->wclock.elapsed.tv_sec >= d->wclock.tc[d->wclock.tcn][1]) {
 	    pgn_tag_add(&g->tag, "Result", "0-1");
+	    tags_changed(n);
 	    gameover(g);
 	}
     }
@@ -1356,6 +1813,7 @@ static void update_clock(GAME g, struct itimerval it)
 	if (d->bclock.tc[d->bclock.tcn][1] &&
 		d->bclock.elapsed.tv_sec >= d->bclock.tc[d->bclock.tcn][1]) {
 	    pgn_tag_add(&g->tag, "Result", "1-0");
+	    tags_changed(n);
 	    gameover(g);
 	}
     }
@@ -1414,7 +1872,7 @@ void update_history_window(GAME g)
     mvwprintw(historyw, 2, 1, "%*s %-*s", 10, _("Move:"),
 	    HISTORY_WIDTH - 14, buf);
 
-    h = pgn_history_by_n(g->hp, g->hindex);
+    h = history_at(g->hp, t, g->hindex);
     snprintf(buf, sizeof(buf), "%s",
 	     (h && h->move) ? h->move
 	     : (LINES < 24) ? _("empty") : _("not available"));
@@ -1442,7 +1900,7 @@ void update_history_window(GAME g)
 	      (LINES < 24) ? _("Next:") :_("Next move:"),
 	      HISTORY_WIDTH - ((LINES < 24) ? 26 : 14), buf);
 
-    h = pgn_history_by_n(g->hp, g->hindex - 1);
+    h = history_at(g->hp, t, g->hindex - 1);
     snprintf(buf, sizeof(buf), "%s",
 	     (h && h->move) ? h->move
 	     : (LINES < 24) ? _("empty") : _("not available"));
@@ -1485,6 +1943,8 @@ void do_validate_move(char **move)
 
 	strcpy(d->pm_frfr, frfr);
 	update_time_control(gp);
+	forget_positions(gp);
+	moves_changed(gp);
 	pgn_history_add(gp, d->b, *move);
 	pgn_switch_turn(gp);
     }
@@ -1494,6 +1954,9 @@ void do_validate_move(char **move)
 	    return;
 	}
 
+	if (lease_engine(gp))
+	    return;
+
 	add_engine_command(gp, ENGINE_THINKING, "%s\n",
 			   (config.engine_protocol == 1) ? frfr : *move);
     }
@@ -1781,3290 +2244,7327 @@ void update_status_window(GAME g)
     wattroff(stdscr, CP_STATUS_NOTIFY);
 }
 
-wchar_t *translate_tag_name(const char *tag)
+/*
+ * A pool of interned strings. Each distinct string gets a small integer ID
+ * so tags can be compared, grouped and matched once per distinct string
+ * rather than once per game. Strings are never removed but the pools are
+ * freed with the games they were interned for.
+ */
+struct strpool_s {
+    char **str;
+    int total;
+    int *bucket;	/* Open addressed hash table of IDs, -1 is empty. */
+    int nbuckets;
+    int icase;		/* Tag names compare without case like libchess. */
+};
+
+static struct strpool_s tag_names = { .icase = 1 };
+static struct strpool_s tag_values;
+
+/*
+ * The tags of a game by ID. Kept in an array parallel to game[] and rebuilt
+ * when game_tags() finds the game or its tags were replaced.
+ */
+struct tag_index_s {
+    GAME g;
+    TAG **t;
+    int total;
+    TAG **tag;		/* The TAG and value pointers the index was built */
+    char **value;	/* from. */
+    int *name;		/* Name and value IDs of each tag. */
+    int *id;
+    int known[TAG_KNOWN];	/* Tag number of each TAG_* name or -1. */
+};
+
+static struct tag_index_s *tag_index;
+static int tag_index_total;
+static unsigned tag_index_gen;	/* Changes when any tag index changes. */
+static unsigned tag_generation;	/* Changes when tags are changed here. */
+
+/*
+ * Called after changing the tags of game 'n'. A freed tag value may be
+ * reused for the next so the pointers the caches compare aren't enough.
+ */
+static void tags_changed(int n)
 {
-    if (!strcmp (tag, "Event"))
-        return str_to_wchar (translatable_tag_names[0]);
-    else if (!strcmp (tag, "Site"))
-        return str_to_wchar (translatable_tag_names[1]);
-    else if (!strcmp (tag, "Date"))
-        return str_to_wchar (translatable_tag_names[2]);
-    else if (!strcmp (tag, "Round"))
-        return str_to_wchar (translatable_tag_names[3]);
-    else if (!strcmp (tag, "White"))
-        return str_to_wchar (translatable_tag_names[4]);
-    else if (!strcmp (tag, "Black"))
-        return str_to_wchar (translatable_tag_names[5]);
-    else if (!strcmp (tag, "Result"))
-        return str_to_wchar (translatable_tag_names[6]);
+    tag_generation++;
 
-    return str_to_wchar (tag);
+    if (n >= 0 && n < tag_index_total)
+	tag_index[n].g = NULL;
 }
 
-void update_tag_window(TAG **t)
+static unsigned strpool_hash(struct strpool_s *p, const char *s)
 {
-    int i, l, w;
-    int namel = 0;
+    unsigned h = 5381;
 
-    for (i = 0; t[i]; i++) {
-        wchar_t *namewc = translate_tag_name(t[i]->name);
+    for (; *s; s++)
+	h = h * 33 + (unsigned char)(p->icase ? tolower(*s) : *s);
 
-	l = wcslen(namewc);
-	free (namewc);
-	if (l > namel)
-	    namel = l;
-    }
+    return h;
+}
 
-    w = TAG_WIDTH - namel - 4;
+static int *strpool_bucket(struct strpool_s *p, const char *s)
+{
+    int *b = NULL;
+    unsigned n;
+
+    if (!p->nbuckets)
+	return NULL;
 
-    for (i = 0; t[i] && i < TAG_HEIGHT - 3; i++) {
-        wchar_t *namewc = translate_tag_name(t[i]->name);
-	wchar_t *valuewc = str_etc(t[i]->value, w, 0);
+    for (n = strpool_hash(p, s) % p->nbuckets; ; n = (n + 1) % p->nbuckets) {
+	b = &p->bucket[n];
 
-	mvwprintw(tagw, (i + 2), 1, "%*ls: %-*ls", namel, namewc, w, valuewc);
-	free (namewc);
-	free (valuewc);
+	if (*b == -1 || !(p->icase ? strcasecmp : strcmp)(p->str[*b], s))
+	    return b;
     }
+}
 
-    for (; i < TAG_HEIGHT - 3; i++)
-	mvwprintw(tagw, (i + 2), 1, "%*s", namel + w + 2, " ");
+/*
+ * Returns the ID of 's' in pool 'p' or -1 if it was never added.
+ */
+static int strpool_find(struct strpool_s *p, const char *s)
+{
+    int *b = strpool_bucket(p, s);
+
+    return b ? *b : -1;
 }
 
-void append_enginebuf(GAME g, char *line)
+static int strpool_add(struct strpool_s *p, const char *s)
 {
-    int i = 0;
-    struct userdata_s *d = g->data;
+    int *b;
+    int i;
+
+    if (p->total * 2 >= p->nbuckets) {
+	int *old = p->bucket;
+	int n = p->nbuckets;
 
-    if (d->engine->enginebuf)
-	for (i = 0; d->engine->enginebuf[i]; i++);
+	p->nbuckets = (n) ? n * 2 : 256;
+	p->bucket = Malloc(p->nbuckets * sizeof(int));
 
-    if (i >= LINES - 3) {
-	free(d->engine->enginebuf[0]);
+	for (i = 0; i < p->nbuckets; i++)
+	    p->bucket[i] = -1;
 
-	for (i = 0; d->engine->enginebuf[i+1]; i++)
-	    d->engine->enginebuf[i] = d->engine->enginebuf[i+1];
+	for (i = 0; i < p->total; i++)
+	    *strpool_bucket(p, p->str[i]) = i;
 
-	d->engine->enginebuf[i] = strdup(line);
+	free(old);
+	p->str = Realloc(p->str, p->nbuckets / 2 * sizeof(char *));
     }
-    else {
-	d->engine->enginebuf = Realloc(d->engine->enginebuf, (i + 2) * sizeof(char *));
-	d->engine->enginebuf[i++] = strdup(line);
-	d->engine->enginebuf[i] = NULL;
+
+    b = strpool_bucket(p, s);
+
+    if (*b == -1) {
+	p->str[p->total] = strdup(s);
+	*b = p->total++;
     }
+
+    return *b;
 }
 
-void update_engine_window(GAME g)
+static void strpool_free(struct strpool_s *p)
 {
     int i;
-    struct userdata_s *d = g->data;
-
-    wmove(enginew, 0, 0);
-    wclrtobot(enginew);
 
-    if (d->engine && d->engine->enginebuf) {
-	for (i = 0; d->engine->enginebuf[i]; i++)
-	    mvwprintw(enginew, i + 2, 1, "%s", d->engine->enginebuf[i]);
-    }
+    for (i = 0; i < p->total; i++)
+	free(p->str[i]);
 
-    window_draw_title(enginew, _("Engine IO Window"), COLS, CP_MESSAGE_TITLE,
-	    CP_MESSAGE_BORDER);
+    free(p->str);
+    free(p->bucket);
+    p->str = NULL;
+    p->bucket = NULL;
+    p->total = p->nbuckets = 0;
 }
 
-void update_all(GAME g)
+/*
+ * Adds the names with a TAG_* ID. The order must match the defines.
+ */
+static void init_tag_names()
 {
-    struct userdata_s *d = g->data;
+    static const char *names[TAG_KNOWN] = {
+	"Event", "Site", "Date", "Round", "White", "Black", "Result", "FEN"
+    };
+    int i;
 
-    /*
-     * In the middle of a macro. Don't update the screen.
-     */
-    if (macro_match != -1)
-	return;
+    for (i = 0; i < TAG_KNOWN; i++)
+	strpool_add(&tag_names, names[i]);
+}
 
-    wmove(boardw, ROWTOMATRIX(d->c_row), COLTOMATRIX(d->c_col));
-    update_board_window(g);
-    update_status_window(g);
-    update_history_window(g);
-    update_tag_window(g->tag);
-    update_engine_window(g);
-    update_panels();
-    doupdate();
+static void free_tag_index_entry(struct tag_index_s *x)
+{
+    free(x->tag);
+    free(x->value);
+    free(x->name);
+    free(x->id);
+    memset(x, 0, sizeof(struct tag_index_s));
 }
 
-static void game_next_prev(GAME g, int n, int count)
+/*
+ * Returns the tag index of game 'n', building it if the game or its tags
+ * changed. Tag values are replaced rather than edited by libchess so
+ * comparing the pointers notices a change made elsewhere. tags_changed()
+ * drops the entry for the changes made here.
+ */
+static struct tag_index_s *game_tags(int n)
 {
-    if (gtotal < 2)
-	return;
+    struct tag_index_s *x;
+    TAG **t = game[n]->tag;
+    int i;
 
-    if (n == 1) {
-	if (gindex + count > gtotal - 1) {
-	    if (count != 1)
-		gindex = gtotal - 1;
-	    else
-		gindex = 0;
-	}
-	else
-	    gindex += count;
-    }
-    else {
-	if (gindex - count < 0) {
-	    if (count != 1)
-		gindex = 0;
-	    else
-		gindex = gtotal - 1;
-	}
-	else
-	    gindex -= count;
+    if (n >= tag_index_total) {
+	tag_index = Realloc(tag_index, gtotal * sizeof(struct tag_index_s));
+	memset(&tag_index[tag_index_total], 0,
+		(gtotal - tag_index_total) * sizeof(struct tag_index_s));
+	tag_index_total = gtotal;
     }
 
-    gp = game[gindex];
-}
+    x = &tag_index[n];
 
-static void delete_game(int which)
-{
-    int i, w = which;
-    struct userdata_s *d;
+    if (x->g == game[n] && x->t == t) {
+	for (i = 0; t[i]; i++) {
+	    if (i == x->total || t[i] != x->tag[i] || t[i]->value != x->value[i])
+		break;
+	}
 
-    for (i = 0; i < gtotal; i++) {
-	d = game[i]->data;
+	if (!t[i] && i == x->total)
+	    return x;
+    }
 
-	if (i == w || TEST_FLAG(d->flags, CF_DELETE)) {
-	    int n;
+    if (!tag_names.total)
+	init_tag_names();
 
-	    free_userdata_once(game[i]);
-	    pgn_free(game[i]);
+    free_tag_index_entry(x);
+    tag_index_gen++;
+    for (i = 0; t[i]; i++);
+    x->g = game[n];
+    x->t = t;
+    x->total = i;
+    x->tag = Malloc((i + 1) * sizeof(TAG *));
+    x->value = Malloc((i + 1) * sizeof(char *));
+    x->name = Malloc((i + 1) * sizeof(int));
+    x->id = Malloc((i + 1) * sizeof(int));
 
-	    for (n = i; n+1 < gtotal; n++)
-		game[n] = game[n+1];
+    for (i = 0; i < TAG_KNOWN; i++)
+	x->known[i] = -1;
 
-	    gtotal--;
-	    i--;
-	    w = -1;
-	}
-    }
+    for (i = 0; t[i]; i++) {
+	x->tag[i] = t[i];
+	x->value[i] = t[i]->value;
+	x->name[i] = strpool_add(&tag_names, t[i]->name);
+	x->id[i] = strpool_add(&tag_values, t[i]->value ? t[i]->value : "");
 
-    if (which != -1) {
-	if (which + 1 >= gtotal)
-	    gindex = gtotal - 1;
-	else
-	    gindex = which;
+	if (x->name[i] < TAG_KNOWN && x->known[x->name[i]] == -1)
+	    x->known[x->name[i]] = i;
     }
-    else
-	gindex = gtotal - 1;
 
-    gp = game[gindex];
-    gp->hp = gp->history;
+    return x;
 }
 
 /*
- * FIXME find across multiple games.
+ * Returns the value of the tag with name ID 'name' in game 'n' or NULL.
  */
-static int find_move_exp(GAME g, regex_t r, int which, int count)
+static const char *game_tag_value(int n, int name)
 {
+    struct tag_index_s *x = game_tags(n);
     int i;
-    int ret;
-    char errbuf[255];
-    int incr;
-    int found;
 
-    incr = (which == 0) ? -1 : 1;
+    if (name < TAG_KNOWN)
+	i = x->known[name];
+    else {
+	for (i = 0; i < x->total && x->name[i] != name; i++);
 
-    for (i = g->hindex + incr - 1, found = 0; ; i += incr) {
-	if (i == g->hindex - 1)
-	    break;
+	if (i == x->total)
+	    i = -1;
+    }
 
-	if (i >= pgn_history_total(g->hp))
-	    i = 0;
-	else if (i < 0)
-	    i = pgn_history_total(g->hp) - 1;
+    return (i == -1) ? NULL : game[n]->tag[i]->value;
+}
 
-	// FIXME RAV
-	ret = regexec(&r, g->hp[i]->move, 0, 0, 0);
+/*
+ * Forgets the tag index of every game. Called when games are deleted or
+ * replaced since a new game may reuse the memory of an old one.
+ */
+static void reset_tag_index()
+{
+    int i;
 
-	if (ret == 0) {
-	    if (count == ++found) {
-		return i + 1;
-	    }
-	}
-	else {
-	    if (ret != REG_NOMATCH) {
-		regerror(ret, &r, errbuf, sizeof(errbuf));
-		cmessage(_("Error Matching Regular Expression"), ANY_KEY_STR, "%s", errbuf);
-		return -1;
-	    }
-	}
-    }
+    for (i = 0; i < tag_index_total; i++)
+	free_tag_index_entry(&tag_index[i]);
 
-    return -1;
+    free(tag_index);
+    tag_index = NULL;
+    tag_index_total = 0;
+    tag_index_gen++;
 }
 
-static int toggle_delete_flag(int n)
+static void free_tag_index()
 {
-    int i, x;
-    struct userdata_s *d = game[n]->data;
+    reset_tag_index();
+    strpool_free(&tag_names);
+    strpool_free(&tag_values);
+}
 
-    TOGGLE_FLAG(d->flags, CF_DELETE);
-    gindex = n;
+/*
+ * The moves of a game including variations for move searches across games.
+ * Moves are stored as IDs of interned SAN strings in depth first order with
+ * the node of the move played before each one, so a sequence is matched by
+ * following 'prev' back from its last move.
+ */
+struct move_index_s {
+    GAME g;
+    HISTORY **history;	/* The main line, its length and last move the */
+    int moves;		/* index was built from. */
+    HISTORY *last;
+    int total;
+    int *id;
+    int *prev;		/* Node of the previous move or -1. */
+};
 
-    for (i = x = 0; i < gtotal; i++) {
-	d = game[i]->data;
+static struct strpool_s move_names;
+static int *move_norm;	/* By SAN ID, the ID without check or NAG marks. */
+static struct move_index_s *move_index;
+static int move_index_total;
 
-	if (TEST_FLAG(d->flags, CF_DELETE))
-	    x++;
-    }
+/*
+ * Returns the ID of 'san' without any trailing check, mate or annotation
+ * characters.
+ */
+static int move_norm_id(const char *san)
+{
+    char buf[64], *p;
 
-    if (x == gtotal) {
-	cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
-	d = game[n]->data;
-	CLEAR_FLAG(d->flags, CF_DELETE);
-	return 1;
-    }
+    strncpy(buf, san, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
 
-    return 0;
+    for (p = buf + strlen(buf); p > buf && strchr("+#!?", *(p-1)); p--);
+    *p = 0;
+    return strpool_add(&move_names, buf);
 }
 
-static int find_game_exp(char *str, int which, int count)
+static int move_name_id(const char *san)
 {
-    char *nstr = NULL, *exp = NULL;
-    regex_t nexp, vexp;
-    int ret = -1;
-    int g = 0;
-    char buf[255] = {0}, *tmp;
-    char errbuf[255];
-    int found = 0;
-    int incr = (which == 0) ? -(1) : 1;
+    int n = move_names.total;
+    int id = strpool_add(&move_names, san);
 
-    strncpy(buf, str, sizeof(buf)-1);
-    tmp = buf;
+    if (id == n) {
+	int norm = move_norm_id(san);
 
-    if (strstr(tmp, ":") != NULL) {
-	nstr = strsep(&tmp, ":");
+	/* The pool may have grown by a second string. */
+	move_norm = Realloc(move_norm, move_names.total * sizeof(int));
+	move_norm[id] = norm;
 
-	if ((ret = regcomp(&nexp, nstr,
-			REG_ICASE|REG_EXTENDED|REG_NOSUB)) != 0) {
-	    regerror(ret, &nexp, errbuf, sizeof(errbuf));
-	    cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
-	    ret = g = -1;
-	    goto cleanup;
-	}
+	if (norm != id)
+	    move_norm[norm] = norm;
     }
 
-    exp = tmp;
-
-    while (exp && *exp && isspace(*exp))
-	exp++;
-
-    if (exp == NULL)
-	goto cleanup;
+    return id;
+}
 
-    if ((ret = regcomp(&vexp, exp, REG_EXTENDED|REG_NOSUB)) != 0) {
-	regerror(ret, &vexp, errbuf, sizeof(errbuf));
-	cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
-	ret = -1;
-	goto cleanup;
-    }
+/*
+ * Walks the moves of 'h' and its variations in index order. A variation
+ * replaces the move it is attached to so its first move follows the move
+ * before that one. When 'target' is found the move number in each line
+ * down to it is left in 'path'.
+ */
+struct move_walk_s {
+    struct move_index_s *x;	/* Filled in when not NULL. */
+    int node;
+    int target;
+    int size;
+    int *path;
+    int depth;
+    int pathsize;
+};
 
-    ret = -1;
+static int move_index_walk(struct move_walk_s *w, HISTORY **h, int prev)
+{
+    int i;
 
-    for (g = gindex + incr, found = 0; ; g += incr) {
-	int t;
+    for (i = 0; h && h[i]; i++) {
+	int n = w->node++;
 
-	if (g == gtotal)
-	    g = 0;
-	else if (g < 0)
-	    g = gtotal - 1;
+	if (w->depth >= w->pathsize) {
+	    w->pathsize += 8;
+	    w->path = Realloc(w->path, w->pathsize * sizeof(int));
+	}
 
-	if (g == gindex)
-	    break;
+	w->path[w->depth] = i;
 
-	for (t = 0; game[g]->tag[t]; t++) {
-	    if (nstr) {
-		if (regexec(&nexp, game[g]->tag[t]->name, 0, 0, 0) == 0) {
-		    if (regexec(&vexp, game[g]->tag[t]->value, 0, 0, 0) == 0) {
-			if (count == ++found) {
-			    ret = g;
-			    goto cleanup;
-			}
-		    }
-		}
-	    }
-	    else {
-		if (regexec(&vexp, game[g]->tag[t]->value, 0, 0, 0) == 0) {
-		    if (count == ++found) {
-			ret = g;
-			goto cleanup;
-		    }
-		}
+	if (w->x) {
+	    if (w->node > w->size) {
+		w->size = (w->size) ? w->size * 2 : 128;
+		w->x->id = Realloc(w->x->id, w->size * sizeof(int));
+		w->x->prev = Realloc(w->x->prev, w->size * sizeof(int));
 	    }
+
+	    w->x->id[n] = move_name_id(h[i]->move);
+	    w->x->prev[n] = prev;
 	}
 
-	ret = -1;
-    }
+	if (n == w->target)
+	    return 1;
+
+	if (h[i]->rav) {
+	    w->depth++;
 
-cleanup:
-    if (nstr)
-	regfree(&nexp);
+	    if (move_index_walk(w, h[i]->rav, prev))
+		return 1;
 
-    if (g != -1)
-	regfree(&vexp);
+	    w->depth--;
+	}
 
-    return ret;
+	prev = n;
+    }
+
+    return 0;
+}
+
+static void free_move_index_entry(struct move_index_s *x)
+{
+    free(x->id);
+    free(x->prev);
+    memset(x, 0, sizeof(struct move_index_s));
 }
 
 /*
- * Updates the notification line in the status window then refreshes the
- * status window.
+ * Returns the move index of game 'n', building it when the main line
+ * changed. Moves added to or removed from a variation are not noticed here;
+ * moves_changed() forgets the index then.
  */
-void update_status_notify(GAME g, char *fmt, ...)
+static struct move_index_s *game_moves(int n)
 {
-    va_list ap;
-#ifdef HAVE_VASPRINTF
-    char *line;
-#else
-    char line[COLS];
-#endif
+    struct move_index_s *x;
+    struct move_walk_s w = { NULL, 0, -1, 0, NULL, 0, 0 };
+    GAME g = game[n];
+    int total = pgn_history_total(g->history);
 
-    free(status.notify);
-    status.notify = NULL;
+    if (n >= move_index_total) {
+	move_index = Realloc(move_index, gtotal * sizeof(struct move_index_s));
+	memset(&move_index[move_index_total], 0,
+		(gtotal - move_index_total) * sizeof(struct move_index_s));
+	move_index_total = gtotal;
+    }
 
-    if (!fmt)
-	return;
+    x = &move_index[n];
 
-    va_start(ap, fmt);
-#ifdef HAVE_VASPRINTF
-    vasprintf(&line, fmt, ap);
-#else
-    vsnprintf(line, sizeof(line), fmt, ap);
-#endif
-    va_end(ap);
+    if (x->g == g && x->history == g->history && x->moves == total
+	    && x->last == (total ? g->history[total - 1] : NULL))
+	return x;
 
-    status.notify = str_to_wchar(line);
+    free_move_index_entry(x);
+    x->g = g;
+    x->history = g->history;
+    x->moves = total;
+    x->last = total ? g->history[total - 1] : NULL;
+    w.x = x;
+    move_index_walk(&w, g->history, -1);
+    x->total = w.node;
+    free(w.path);
 
-#ifdef HAVE_VASPRINTF
-    free(line);
-#endif
+    if (x->total) {
+	x->id = Realloc(x->id, x->total * sizeof(int));
+	x->prev = Realloc(x->prev, x->total * sizeof(int));
+    }
+
+    return x;
 }
 
-int rav_next_prev(GAME g, BOARD b, int n)
+/*
+ * Forgets the move index of every game. Like reset_tag_index() this is
+ * needed when games are deleted or replaced.
+ */
+static void reset_move_index()
 {
-    // Next RAV.
-    if (n) {
-	if ((!g->ravlevel && g->hindex && g->hp[g->hindex - 1]->rav == NULL) ||
-		(!g->ravlevel && !g->hindex && g->hp[g->hindex]->rav == NULL) ||
-		(g->ravlevel && g->hp[g->hindex]->rav == NULL))
-	    return 1;
+    int i;
 
-	g->rav = Realloc(g->rav, (g->ravlevel + 1) * sizeof(RAV));
-	g->rav[g->ravlevel].hp = g->hp;
-	g->rav[g->ravlevel].flags = g->flags;
-	g->rav[g->ravlevel].fen = pgn_game_to_fen(g, b);
-	g->rav[g->ravlevel].hindex = g->hindex;
-	g->hp = (!g->ravlevel) ? (g->hindex) ? g->hp[g->hindex - 1]->rav : g->hp[g->hindex]->rav : g->hp[g->hindex]->rav;
-	g->hindex = 0;
-	g->ravlevel++;
-	pgn_board_update(g, b, g->hindex + 1);
-	return 0;
-    }
+    for (i = 0; i < move_index_total; i++)
+	free_move_index_entry(&move_index[i]);
 
-    if (g->ravlevel - 1 < 0)
-	return 1;
+    free(move_index);
+    move_index = NULL;
+    move_index_total = 0;
+}
 
-    // Previous RAV.
-    g->ravlevel--;
-    pgn_board_init_fen(g, b, g->rav[g->ravlevel].fen);
-    free(g->rav[g->ravlevel].fen);
-    g->hp = g->rav[g->ravlevel].hp;
-    g->flags = g->rav[g->ravlevel].flags;
-    g->hindex = g->rav[g->ravlevel].hindex;
-    return 0;
+static void free_move_index()
+{
+    reset_move_index();
+    strpool_free(&move_names);
+    free(move_norm);
+    move_norm = NULL;
 }
 
-static void draw_window_decor()
+/*
+ * The opening explorer. For each position the continuations played in the
+ * loaded games are counted along with their results, the average rating of
+ * the side that played them and the last year they were played. Positions
+ * are keyed by a hash of the FEN without the move counters so that
+ * transpositions share their statistics. Only the first EXPLORER_PLIES
+ * plies of the main line of each game are counted.
+ */
+#define EXPLORER_PLIES	60
+
+struct explorer_move_s {
+    int move;		/* SAN ID without check marks. */
+    int games;
+    int white, draws, black;
+    long elo;		/* Sum of the ratings of the side to move. */
+    int nelo;
+    int year;
+};
+
+struct explorer_pos_s {
+    unsigned long long key;	/* 0 is an empty slot. */
+    struct explorer_move_s *m;
+    int total;
+};
+
+/*
+ * What a game added to the explorer so it can be taken out again when the
+ * game changes.
+ */
+struct explorer_game_s {
+    GAME g;
+    int plies;
+    HISTORY *last;
+    const char *fen;
+    int result;		/* 1 white wins, 0 draw, -1 black wins, 2 other. */
+    int elo[2];		/* By side. */
+    int year;
+};
+
+static struct explorer_pos_s *explorer_pos;
+static int explorer_npos;
+static int explorer_size;
+static struct explorer_game_s *explorer_games;
+static int explorer_ngames;
+
+static unsigned long long explorer_key(const char *fen)
 {
-    move_panel(boardp, 0,
-	       (config.boardleft) ? 0 : COLS - BOARD_WIDTH);
-    move_panel(historyp, LINES - HISTORY_HEIGHT,
-		(config.boardleft) ? (MEGA_BOARD) ? BOARD_WIDTH : 0 :
-		(MEGA_BOARD) ? 0 : COLS - HISTORY_WIDTH);
-    move_panel(statusp, 0,
-	       (config.boardleft) ? BOARD_WIDTH : 0);
-	move_panel(tagp, STATUS_HEIGHT + 1,
-		(config.boardleft) ? (MEGA_BOARD) ? BOARD_WIDTH :
-		HISTORY_WIDTH : 0);
+    unsigned long long h = 14695981039346656037ULL;
+    int fields = 0;
 
-    wbkgd(boardw, CP_BOARD_WINDOW);
-    wbkgd(statusw, CP_STATUS_WINDOW);
-    window_draw_title(statusw, _("Game Status"), STATUS_WIDTH,
-	    CP_STATUS_TITLE, CP_STATUS_BORDER);
-    wbkgd(tagw, CP_TAG_WINDOW);
-    window_draw_title(tagw, _("Roster Tags"), TAG_WIDTH, CP_TAG_TITLE,
-	    CP_TAG_BORDER);
-    wbkgd(historyw, CP_HISTORY_WINDOW);
-    window_draw_title(historyw, _("Move History"), HISTORY_WIDTH,
-	    CP_HISTORY_TITLE, CP_HISTORY_BORDER);
+    /* The board, side, castling and en passant fields. */
+    for (; *fen; fen++) {
+	if (*fen == ' ' && ++fields == 4)
+	    break;
+
+	h = (h ^ (unsigned char)*fen) * 1099511628211ULL;
+    }
+
+    return (h) ? h : 1;
 }
 
-void do_window_resize()
+/*
+ * Returns the slot of position 'key' which is empty when it was never
+ * added.
+ */
+static struct explorer_pos_s *explorer_slot(unsigned long long key)
 {
-    if (LINES < 23 || COLS < 74)
-	return;
+    int i;
 
-    resizeterm(LINES, COLS);
-    endwin();
-    wresize(boardw, BOARD_HEIGHT, BOARD_WIDTH);
-    wresize(historyw, HISTORY_HEIGHT, HISTORY_WIDTH);
-    wresize(statusw, STATUS_HEIGHT, STATUS_WIDTH);
-    wresize(tagw, TAG_HEIGHT, TAG_WIDTH);
-    clear ();
-    wclear (boardw);
-    wclear (historyw);
-    wclear (tagw);
-    wclear (statusw);
-    wclear (loadingw);
-    wclear (enginew);
-    draw_window_decor();
-    update_all(gp);
-    keypad(boardw, TRUE);
-    curs_set(0);
-    cbreak();
-    noecho();
+    for (i = key % explorer_size; ; i = (i + 1) % explorer_size) {
+	if (!explorer_pos[i].key || explorer_pos[i].key == key)
+	    return &explorer_pos[i];
+    }
 }
 
-void do_global_redraw ()
+/*
+ * Returns the position 'key' or NULL. When 'add' is set a missing position
+ * is added.
+ */
+static struct explorer_pos_s *explorer_find(unsigned long long key, int add)
 {
-    do_window_resize ();
+    struct explorer_pos_s *p;
+    int i;
+
+    if (add && explorer_npos * 2 >= explorer_size) {
+	struct explorer_pos_s *old = explorer_pos;
+	int n = explorer_size;
+
+	explorer_size = (n) ? n * 2 : 4096;
+	explorer_pos = Calloc(explorer_size, sizeof(struct explorer_pos_s));
+
+	for (i = 0; i < n; i++) {
+	    if (old[i].key)
+		*explorer_slot(old[i].key) = old[i];
+	}
+
+	free(old);
+    }
+
+    if (!explorer_size)
+	return NULL;
+
+    p = explorer_slot(key);
+
+    if (p->key)
+	return p;
+
+    if (!add)
+	return NULL;
+
+    p->key = key;
+    explorer_npos++;
+    return p;
 }
 
-void stop_clock()
+static const char *game_start_fen(int n)
 {
-    memset(&clock_timer, 0, sizeof(struct itimerval));
-    setitimer(ITIMER_REAL, &clock_timer, NULL);
+    const char *fen = game_tag_value(n, TAG_FEN);
+
+    return (fen) ? fen :
+	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 }
 
-void start_clock(GAME g)
+static void explorer_game_info(int n, struct explorer_game_s *x)
 {
-    struct userdata_s *d = g->data;
+    GAME g = game[n];
+    const char *s;
+    int id, i;
 
-    if (clock_timer.it_interval.tv_usec)
-	return;
+    memset(x, 0, sizeof(struct explorer_game_s));
+    x->g = g;
+    x->plies = pgn_history_total(g->history);
 
-    memset(&d->elapsed, 0, sizeof(struct timeval));
-    clock_timer.it_value.tv_sec = 0;
-    clock_timer.it_value.tv_usec = 100000;
-    clock_timer.it_interval.tv_sec = 0;
-    clock_timer.it_interval.tv_usec = 100000;
-    setitimer(ITIMER_REAL, &clock_timer, NULL);
+    if (x->plies > EXPLORER_PLIES)
+	x->plies = EXPLORER_PLIES;
+
+    x->last = (x->plies) ? g->history[x->plies - 1] : NULL;
+    x->fen = game_start_fen(n);
+    s = game_tag_value(n, TAG_RESULT);
+
+    if (s && !strcmp(s, "1-0"))
+	x->result = 1;
+    else if (s && !strcmp(s, "0-1"))
+	x->result = -1;
+    else if (s && !strcmp(s, "1/2-1/2"))
+	x->result = 0;
+    else
+	x->result = 2;
+
+    for (i = 0; i < 2; i++) {
+	id = strpool_find(&tag_names, (i == WHITE) ? "WhiteElo" : "BlackElo");
+
+	if (id != -1 && (s = game_tag_value(n, id)) != NULL)
+	    x->elo[i] = atoi(s);
+    }
+
+    if ((s = game_tag_value(n, TAG_DATE)) != NULL && isdigit(*s))
+	x->year = atoi(s);
 }
 
-static void update_clocks()
+/*
+ * Adds the game 'x' to the explorer when 'sign' is 1 or removes it when
+ * -1. The last year played is not lowered when a game is removed.
+ */
+static void explorer_add_game(struct explorer_game_s *x, int sign)
 {
-    int i;
-    struct userdata_s *d;
-    struct itimerval it;
-    int update = 0;
+    HISTORY **h = x->g->history;
+    const char *fen = x->fen;
+    int i, n;
 
-    getitimer(ITIMER_REAL, &it);
+    for (i = 0; i < x->plies; fen = h[i++]->fen) {
+	struct explorer_pos_s *p;
+	struct explorer_move_s *m;
+	int move, side;
 
-    for (i = 0; i < gtotal; i++) {
-	d = game[i]->data;
+	if (!fen || (p = explorer_find(explorer_key(fen), sign > 0)) == NULL)
+	    break;
 
-	if (d && d->mode == MODE_PLAY) {
-	    if (d->paused == 1 || TEST_FLAG(d->flags, CF_NEW))
+	/* move_name_id() may move move_norm. */
+	move = move_name_id(h[i]->move);
+	move = move_norm[move];
+	side = (strchr(fen, ' ') && strchr(fen, ' ')[1] == 'b') ? BLACK : WHITE;
+
+	for (n = 0; n < p->total && p->m[n].move != move; n++);
+
+	if (n == p->total) {
+	    if (sign < 0)
 		continue;
-	    else if (d->paused == -1) {
-		if (game[i]->side == game[i]->turn) {
-		    d->paused = 1;
-		    continue;
-		}
-	    }
 
-	    update_clock(game[i], it);
+	    p->m = Realloc(p->m, (p->total + 1) * sizeof(struct explorer_move_s));
+	    memset(&p->m[n], 0, sizeof(struct explorer_move_s));
+	    p->m[n].move = move;
+	    p->total++;
+	}
 
-	    if (game[i] == gp)
-		update = 1;
+	m = &p->m[n];
+	m->games += sign;
+
+	if (x->result == 1)
+	    m->white += sign;
+	else if (x->result == 0)
+	    m->draws += sign;
+	else if (x->result == -1)
+	    m->black += sign;
+
+	if (x->elo[side] > 0) {
+	    m->elo += sign * x->elo[side];
+	    m->nelo += sign;
 	}
-    }
 
-    if (update) {
-	update_status_window(gp);
-	update_panels();
-	doupdate();
+	if (sign > 0 && x->year > m->year)
+	    m->year = x->year;
     }
 }
 
-#define SKIP_SPACE(str) { while (isspace(*str)) str++; }
+static int explorer_game_changed(struct explorer_game_s *a,
+	struct explorer_game_s *b)
+{
+    return a->g != b->g || a->plies != b->plies || a->last != b->last
+	|| a->fen != b->fen || a->result != b->result
+	|| a->elo[WHITE] != b->elo[WHITE] || a->elo[BLACK] != b->elo[BLACK]
+	|| a->year != b->year;
+}
 
-static int parse_clock_time(char **str)
+static void reset_explorer()
 {
-    char *p = *str;
-    int n = 0, t = 0;
+    int i;
 
-    SKIP_SPACE(p);
+    for (i = 0; i < explorer_size; i++)
+	free(explorer_pos[i].m);
 
-    if (!isdigit(*p))
-	return -1;
+    free(explorer_pos);
+    free(explorer_games);
+    explorer_pos = NULL;
+    explorer_games = NULL;
+    explorer_npos = explorer_size = explorer_ngames = 0;
+}
 
-    while (*p) {
-	if (isdigit(*p)) {
-	    t = atoi(p);
+/*
+ * Brings the explorer up to date. The first call counts every game. After
+ * that only games whose moves or tags changed are taken out and counted
+ * again. When the moves a game was counted with no longer exist the
+ * explorer is rebuilt.
+ */
+static void update_explorer()
+{
+    struct explorer_game_s x;
+    int n;
 
-	    while (isdigit(*p))
-		p++;
+    if (!tag_names.total)
+	init_tag_names();
+
+    if (explorer_ngames < gtotal) {
+	explorer_games = Realloc(explorer_games,
+		gtotal * sizeof(struct explorer_game_s));
+	memset(&explorer_games[explorer_ngames], 0,
+		(gtotal - explorer_ngames) * sizeof(struct explorer_game_s));
+	explorer_ngames = gtotal;
+    }
+
+    for (n = 0; n < gtotal; n++) {
+	struct explorer_game_s *o = &explorer_games[n];
+
+	explorer_game_info(n, &x);
 
+	if (!explorer_game_changed(o, &x))
 	    continue;
+
+	if (o->g) {
+	    if (o->g != x.g || x.plies < o->plies
+		    || (o->plies && x.g->history[o->plies - 1] != o->last)) {
+		reset_explorer();
+		update_explorer();
+		return;
+	    }
+
+	    explorer_add_game(o, -1);
 	}
 
-	switch (*p) {
-	    case 'H':
-	    case 'h':
-		n += t * (60 * 60);
-		t = 0;
-		break;
-	    case 'M':
-	    case 'm':
-		n += t * 60;
-		t = 0;
-		break;
-	    case 'S':
-	    case 's':
-		n += t;
-		t = 0;
-		break;
-	    case ' ':
-		p++;
-	    case '/':
-	    case '+':
-		goto done;
-	    default:
-		*str = p;
-		return -1;
-	}
-
-	p++;
+	explorer_add_game(&x, 1);
+	*o = x;
     }
-
-done:
-    n += t;
-    *str = p;
-    return n;
 }
 
-static int parse_clock_input(struct clock_s *clk, char *str, int *incr)
+wchar_t *translate_tag_name(const char *tag)
 {
-    char *p = str;
-    long n = 0;
-    int plus = 0;
-    int m = 0;
-    int tc = 0;
+    int id;
 
-    SKIP_SPACE(p);
+    if (!tag_names.total)
+	init_tag_names();
 
-    if (!*p)
-	return 0;
+    id = strpool_find(&tag_names, tag);
 
-    if (*p == '+') {
-	plus = 1;
-	p++;
-	SKIP_SPACE(p);
+    /* The roster names are matched exactly. */
+    if (id >= 0 && id <= TAG_RESULT && !strcmp(tag, tag_names.str[id]))
+        return str_to_wchar (translatable_tag_names[id]);
 
-	if (*p == '+')
-	    goto move_incr;
-    }
-    else
-	memset(clk, 0, sizeof(struct clock_s));
+    return str_to_wchar (tag);
+}
 
-again:
-    /* Sudden death. */
-    if (strncasecmp(p, "SD", 2) == 0) {
-	n = 0;
-	p += 2;
-	goto tc;
+/*
+ * The tag window as last drawn. The translated names and truncated values
+ * are only converted again when a tag or the window size changes.
+ */
+struct tag_line_s {
+    TAG *tag;
+    char *name;
+    char *value;
+    wchar_t *namewc;
+    wchar_t *valuewc;
+};
+
+static struct tag_cache_s {
+    TAG **t;
+    int total;
+    unsigned gen;
+    int width, height;
+    int namel;
+    struct tag_line_s *line;
+} tag_cache;
+
+static int tag_window_redraw = 1;
+
+static void free_tag_cache()
+{
+    int i;
+
+    for (i = 0; i < tag_cache.total; i++) {
+	free(tag_cache.line[i].namewc);
+	free(tag_cache.line[i].valuewc);
     }
 
-    n = parse_clock_time(&p);
+    free(tag_cache.line);
+    memset(&tag_cache, 0, sizeof(struct tag_cache_s));
+}
 
-    if (n == -1)
-	return 1;
+/*
+ * Returns 1 if the cache still matches the tags 't'. As with game_tags()
+ * the pointers are compared and tag_generation catches the changes made
+ * here.
+ */
+static int tag_cache_valid(TAG **t)
+{
+    int i;
 
-    if (!n)
-	goto done;
+    if (t != tag_cache.t || tag_cache.gen != tag_generation
+	    || tag_cache.width != TAG_WIDTH || tag_cache.height != TAG_HEIGHT)
+	return 0;
 
-    /* Time control. */
-tc:
-    if (*p == '/') {
-	if (plus)
-	    return 1;
+    for (i = 0; t[i]; i++) {
+	struct tag_line_s *l = &tag_cache.line[i];
 
-	/* Sudden death without a previous time control. */
-	if (!n && !tc)
-	    return 1;
+	if (i == tag_cache.total || l->tag != t[i] || l->name != t[i]->name
+		|| l->value != t[i]->value)
+	    return 0;
+    }
 
-	m = n;
-	p++;
-	n = parse_clock_time(&p);
+    return i == tag_cache.total;
+}
 
-	if (n == -1)
-	    return 1;
+static void build_tag_cache(TAG **t)
+{
+    int i, l, w;
 
-	if (tc >= MAX_TC) {
-	    message(ERROR_STR, ANY_KEY_STR, "%s (%i)", _("Maximum number of time controls reached"), MAX_TC);
-	    return 1;
-	}
+    free_tag_cache();
 
-	clk->tc[tc][0] = m;
-	clk->tc[tc++][1] = n;
-	SKIP_SPACE(p);
+    for (i = 0; t[i]; i++);
 
-	if (*p == '+')
-	    goto move_incr;
+    tag_cache.t = t;
+    tag_cache.total = i;
+    tag_cache.gen = tag_generation;
+    tag_cache.width = TAG_WIDTH;
+    tag_cache.height = TAG_HEIGHT;
+    tag_cache.line = Calloc(i + 1, sizeof(struct tag_line_s));
 
-	if (*p)
-	    goto again;
+    for (i = 0; t[i]; i++) {
+	tag_cache.line[i].tag = t[i];
+	tag_cache.line[i].name = t[i]->name;
+	tag_cache.line[i].value = t[i]->value;
+	tag_cache.line[i].namewc = translate_tag_name(t[i]->name);
+	l = wcslen(tag_cache.line[i].namewc);
 
-	goto done;
+	if (l > tag_cache.namel)
+	    tag_cache.namel = l;
     }
 
-    if (plus)
-	*incr = n;
-    else
-	clk->tc[clk->tcn][1] = (n <= clk->elapsed.tv_sec) ? clk->elapsed.tv_sec + n : n;
+    w = TAG_WIDTH - tag_cache.namel - 4;
 
-move_incr:
-    if (*p) {
-	if (*p++ == '+') {
-	    if (!isdigit(*p))
-		return 1;
+    for (i = 0; t[i] && i < TAG_HEIGHT - 3; i++)
+	tag_cache.line[i].valuewc = str_etc(t[i]->value, w, 0);
+}
 
-	    n = parse_clock_time(&p);
+void update_tag_window(TAG **t)
+{
+    int i, w, namel;
 
-	    if (n == -1 || *p)
-		return 1;
+    if (!tag_cache_valid(t)) {
+	build_tag_cache(t);
+	tag_window_redraw = 1;
+    }
 
-	    clk->incr = n;
+    if (!tag_window_redraw)
+	return;
 
-	    SKIP_SPACE(p);
+    namel = tag_cache.namel;
+    w = TAG_WIDTH - namel - 4;
 
-	    if (*p)
-		return 1;
-	}
-	else
-	    return 1;
-    }
+    for (i = 0; t[i] && i < TAG_HEIGHT - 3; i++)
+	mvwprintw(tagw, (i + 2), 1, "%*ls: %-*ls", namel,
+		tag_cache.line[i].namewc, w, tag_cache.line[i].valuewc);
 
-done:
-    return 0;
+    for (; i < TAG_HEIGHT - 3; i++)
+	mvwprintw(tagw, (i + 2), 1, "%*s", namel + w + 2, " ");
+
+    tag_window_redraw = 0;
 }
 
-static int parse_which_clock(struct clock_s *clk, char *str)
+static struct enginebuf_s *find_enginebuf(struct engine_s *e)
 {
-    struct clock_s tmp;
-    int incr = 0;
+    struct enginebuf_s *eb;
 
-    memcpy(&tmp, clk, sizeof(struct clock_s));
-
-    if (parse_clock_input(&tmp, str, &incr)) {
-	cmessage(ERROR_STR, ANY_KEY_STR, _("Invalid clock specification"));
-	return 1;
+    for (eb = enginebufs; eb; eb = eb->next) {
+	if (eb->e == e)
+	    return eb;
     }
 
-    memcpy(clk, &tmp, sizeof(struct clock_s));
-    clk->tc[clk->tcn][1] += incr;
-    return 0;
+    return NULL;
 }
 
-void do_clock_input_finalize(WIN *win)
+static void free_enginebuf(struct engine_s *e)
 {
-    struct userdata_s *d = gp->data;
-    struct input_data_s *in = win->data;
-    char *p = in->str;
+    struct enginebuf_s **p, *eb;
 
-    if (!in->str) {
-	free(in);
-	return;
+    for (p = &enginebufs; *p; p = &(*p)->next) {
+	if ((*p)->e == e) {
+	    eb = *p;
+	    *p = eb->next;
+	    free(eb);
+	    return;
+	}
     }
+}
 
-    SKIP_SPACE(p);
+void append_enginebuf(GAME g, char *line)
+{
+    struct userdata_s *d = g->data;
+    struct enginebuf_s *eb = find_enginebuf(d->engine);
+    int n;
 
-    if (tolower(*p) == 'w') {
-	p++;
+    parse_analysis_line(g, line);
 
-	if (parse_which_clock(&d->wclock, p))
-	    goto done;
+    if (!eb) {
+	eb = Calloc(1, sizeof(struct enginebuf_s) +
+		engine_scrollback * sizeof(eb->line[0]));
+	eb->e = d->engine;
+	eb->size = engine_scrollback;
+	eb->next = enginebufs;
+	enginebufs = eb;
     }
-    else if (tolower(*p) == 'b') {
-	p++;
 
-	if (parse_which_clock(&d->bclock, p))
-	    goto done;
+    if (eb->count == eb->size) {
+	n = eb->head;
+	eb->head = (eb->head + 1) % eb->size;
     }
-    else {
-	if (parse_which_clock(&d->wclock, p))
-	    goto done;
+    else
+	n = (eb->head + eb->count++) % eb->size;
 
-	if (parse_which_clock(&d->bclock, p))
-	    goto done;
-    }
+    strncpy(eb->line[n], line, ENGINE_LINE_MAX);
+    eb->line[n][ENGINE_LINE_MAX] = 0;
+    eb->seq++;
+}
 
-    if (!d->wclock.tc[0][1] && !d->bclock.tc[0][1])
-	CLEAR_FLAG(d->flags, CF_CLOCK);
-    else
-	SET_FLAG(d->flags, CF_CLOCK);
+/*
+ * Prints line 'n' of the ring 'eb', 0 being the oldest, at window row 'row'.
+ * The line is padded to the window width so no clearing is needed.
+ */
+static void draw_engine_line(struct enginebuf_s *eb, int n, int row)
+{
+    int i = (eb->head + n) % eb->size;
 
-done:
-    free(in->str);
-    free(in);
+    mvwprintw(enginew, row, 1, "%-*.*s", COLS - 2, COLS - 2, eb->line[i]);
 }
 
-void do_engine_command_finalize(WIN *win)
+void update_engine_window(GAME g)
 {
-    struct userdata_s *d = gp->data;
-    struct input_data_s *in = win->data;
-    int x;
+    static GAME last_game;
+    static struct enginebuf_s *last_eb;
+    static unsigned long last_seq;
+    static int drawn;
+    struct userdata_s *d = g->data;
+    struct enginebuf_s *eb = d->engine ? find_enginebuf(d->engine) : NULL;
+    int rows = LINES - 3;
+    int i, total, n;
 
-    if (!in->str) {
-	free(in);
+    if (!enginew || panel_hidden(enginep))
 	return;
+
+    if (g != last_game || eb != last_eb)
+	engine_window_offset = 0;
+
+    /*
+     * Keep a scrolled back window on the same lines as new ones arrive. The
+     * offset is clamped to the available lines by the full redraw below.
+     */
+    if (engine_window_offset && eb && eb->seq != last_seq) {
+	engine_window_offset += eb->seq - last_seq;
+	engine_window_redraw = 1;
     }
 
-    if (!d->engine)
-	goto done;
+    /*
+     * Only scroll in the new lines when they are all still in the ring.
+     * Otherwise the ring is smaller than the window and has wrapped since the
+     * last update.
+     */
+    if (eb && !engine_window_redraw && g == last_game && eb == last_eb
+	    && eb->seq >= last_seq && eb->seq - last_seq < rows
+	    && eb->seq - last_seq <= eb->count) {
+	n = eb->seq - last_seq;
 
-    x = d->engine->status;
-    send_to_engine(gp, -1, "%s\n", in->str);
-    d->engine->status = x;
+	if (!n)
+	    return;
 
-done:
-    free(in->str);
-    free(in);
-}
+	/*
+	 * Scroll the lines already shown up to make room for the new ones.
+	 * The border columns scroll with them and are redrawn for the new
+	 * rows only.
+	 */
+	if (drawn + n > rows) {
+	    wsetscrreg(enginew, 2, rows + 1);
+	    scrollok(enginew, TRUE);
+	    wscrl(enginew, drawn + n - rows);
+	    scrollok(enginew, FALSE);
+	    drawn = rows - n;
+	}
 
-void do_board_details()
-{
-    config.details = (config.details) ? 0 : 1;
-}
+	for (i = 0; i < n; i++, drawn++) {
+	    draw_engine_line(eb, eb->count - n + i, drawn + 2);
+	    wattron(enginew, CP_MESSAGE_BORDER);
+	    mvwaddch(enginew, drawn + 2, 0, ACS_VLINE);
+	    mvwaddch(enginew, drawn + 2, COLS - 1, ACS_VLINE);
+	    wattroff(enginew, CP_MESSAGE_BORDER);
+	}
 
-void do_toggle_strict_castling()
-{
-    int n;
+	last_seq = eb->seq;
+	return;
+    }
 
-    pgn_config_get(PGN_STRICT_CASTLING, &n);
+    wmove(enginew, 0, 0);
+    wclrtobot(enginew);
+    drawn = 0;
 
-    if (n == 0)
-	pgn_config_set(PGN_STRICT_CASTLING, 1);
-    else
-	pgn_config_set(PGN_STRICT_CASTLING, 0);
-}
+    if (eb) {
+	total = (eb->count < rows) ? eb->count : rows;
 
-void do_play_set_clock()
-{
-    struct input_data_s *in;
+	if (engine_window_offset > eb->count - total)
+	    engine_window_offset = eb->count - total;
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->efunc = do_clock_input_finalize;
-    construct_input(_("Set Clock"), NULL, 1, 1,
-		    _ ("Format: [W | B] [+]T[+I] | ++I | M/T [M/T [...] [SD/T]] [+I]\n" \
-		       "T = time (hms), I = increment, M = moves per, SD = sudden death\ne.g., 30m or 4m+12s or 35/90m SD/30m"),
-		    NULL, NULL, 0, in, INPUT_HIST_CLOCK, -1);
+	if (engine_window_offset < 0)
+	    engine_window_offset = 0;
+
+	n = eb->count - total - engine_window_offset;
+
+	for (drawn = 0; drawn < total; drawn++)
+	    draw_engine_line(eb, n + drawn, drawn + 2);
+    }
+
+    window_draw_title(enginew, _("Engine IO Window"), COLS, CP_MESSAGE_TITLE,
+	    CP_MESSAGE_BORDER);
+    last_game = g;
+    last_eb = eb;
+    last_seq = eb ? eb->seq : 0;
+    engine_window_redraw = 0;
 }
 
-void do_play_toggle_human()
+/*
+ * Parses a UCI style "info" line: "info depth D ... multipv K score cp|mate X
+ * ... nodes N nps N ... pv MOVES". Returns the slot or -1 if the line
+ * contains no principal variation.
+ */
+static int parse_uci_info(char *str, struct analysis_line_s *l)
 {
-    struct userdata_s *d = gp->data;
+    char tok[32];
+    int n, slot = 0;
 
-    TOGGLE_FLAG(d->flags, CF_HUMAN);
+    str += 5;
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN) && pgn_history_total(gp->hp)) {
-	if (init_chess_engine(gp))
-	    return;
-    }
+    while (sscanf(str, "%31s%n", tok, &n) == 1) {
+	str += n;
+	n = 0;
 
-    CLEAR_FLAG(d->flags, CF_ENGINE_LOOP);
+	if (!strcmp(tok, "pv")) {
+	    while (isspace(*str))
+		str++;
 
-    if (d->engine)
-	d->engine->status = ENGINE_READY;
+	    strncpy(l->pv, str, ENGINE_LINE_MAX);
+	    l->pv[ENGINE_LINE_MAX] = 0;
+	    return (*l->pv && slot < ANALYSIS_MULTIPV) ? slot : -1;
+	}
+	else if (!strcmp(tok, "depth"))
+	    sscanf(str, "%d%n", &l->depth, &n);
+	else if (!strcmp(tok, "multipv")) {
+	    sscanf(str, "%d%n", &slot, &n);
+	    slot = (slot > 0) ? slot - 1 : 0;
+	}
+	else if (!strcmp(tok, "score")) {
+	    if (sscanf(str, "%31s %d%n", tok, &l->score, &n) != 2)
+		return -1;
+
+	    l->mate = !strcmp(tok, "mate") ? l->score : 0;
+	}
+	else if (!strcmp(tok, "nodes"))
+	    sscanf(str, "%llu%n", &l->nodes, &n);
+	else if (!strcmp(tok, "nps"))
+	    sscanf(str, "%lu%n", &l->nps, &n);
+
+	str += n;
+    }
+
+    return -1;
 }
 
-void do_play_toggle_engine()
+/*
+ * Parses xboard thinking output: "depth score time nodes pv". The depth may
+ * be followed by one of ".&+-". Returns 0 on success or -1 if this isn't
+ * thinking output.
+ */
+static int parse_xboard_thinking(char *str, struct analysis_line_s *l)
 {
-    struct userdata_s *d = gp->data;
+    char *p;
+    long t;
+    int n;
 
-    TOGGLE_FLAG(d->flags, CF_ENGINE_LOOP);
-    CLEAR_FLAG(d->flags, CF_HUMAN);
+    l->depth = strtol(str, &p, 10);
 
-    if (d->engine && TEST_FLAG(d->flags, CF_ENGINE_LOOP)) {
-        char *fen = pgn_game_to_fen (gp, d->b);
+    if (p == str || l->depth <= 0)
+	return -1;
 
-	pgn_board_update(gp, d->b,
-		pgn_history_total(gp->hp));
-	add_engine_command(gp, ENGINE_READY, "setboard %s\n", fen);
-	free (fen);
-    }
+    if (*p && strchr(".&+-", *p))
+	p++;
+
+    if (sscanf(p, "%d %ld %llu %n", &l->score, &t, &l->nodes, &n) != 3)
+	return -1;
+
+    p += n;
+
+    if (!*p)
+	return -1;
+
+    strncpy(l->pv, p, ENGINE_LINE_MAX);
+    l->pv[ENGINE_LINE_MAX] = 0;
+    l->nps = (t > 0) ? l->nodes * 100 / t : 0;
+    l->mate = 0;
+
+    if (abs(l->score) >= 100000)
+	l->mate = (l->score > 0) ? l->score - 100000 : l->score + 100000;
+
+    return 0;
 }
 
 /*
- * This will send a command to the engine skipping the command queue.
+ * xboard thinking output has no PV index. Returns the slot whose variation
+ * starts with the same move as 'l' or else an empty slot or the shallowest
+ * and worst scoring one.
  */
-void do_play_send_command()
+static int analysis_xboard_slot(struct analysis_line_s *l)
 {
-    struct userdata_s *d = gp->data;
-    struct input_data_s *in;
+    int i, slot = -1;
+    int n = strcspn(l->pv, " ");
 
-    if (!d->engine || d->engine->status == ENGINE_OFFLINE) {
-	if (init_chess_engine(gp))
-	    return;
+    for (i = 0; i < ANALYSIS_MULTIPV; i++) {
+	struct analysis_line_s *a = &analysis.line[i];
+
+	if (a->depth && !strncmp(a->pv, l->pv, n)
+		&& (a->pv[n] == ' ' || !a->pv[n]))
+	    return i;
     }
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->efunc = do_engine_command_finalize;
-    construct_input(_("Engine Command"), NULL, 1, 1, NULL, NULL, NULL, 0, in, INPUT_HIST_ENGINE, -1);
+    for (i = 0; i < ANALYSIS_MULTIPV; i++) {
+	struct analysis_line_s *a = &analysis.line[i];
+
+	if (!a->depth)
+	    return i;
+
+	if (slot == -1 || a->depth < analysis.line[slot].depth
+		|| (a->depth == analysis.line[slot].depth
+		    && a->score < analysis.line[slot].score))
+	    slot = i;
+    }
+
+    return slot;
 }
+
 /*
-void do_play_switch_turn()
+ * Called for every line of engine output for game 'g'.
+ */
+static void parse_analysis_line(GAME g, char *str)
 {
-    struct userdata_s *d = gp->data;
+    struct analysis_line_s l = {0};
+    int slot;
 
-    pgn_switch_side(gp);
-    pgn_switch_turn(gp);
+    if (analysis.g != g)
+	return;
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN))
-	add_engine_command(gp, -1,
-		(gp->side == WHITE) ? "white\n" : "black\n");
+    while (isspace(*str))
+	str++;
 
-    update_status_window(gp);
+    if (!strncmp(str, "info ", 5))
+	slot = parse_uci_info(str, &l);
+    else if (!parse_xboard_thinking(str, &l))
+	slot = analysis_xboard_slot(&l);
+    else
+	slot = -1;
+
+    if (slot == -1)
+	return;
+
+    l.seq = analysis.line[slot].seq + 1;
+    analysis.line[slot] = l;
 }
-*/
-void do_play_toggle_eh_mode()
+
+static char *analysis_count_to_char(unsigned long long n, char *buf,
+	size_t len)
 {
-    struct userdata_s *d = gp->data;
+    if (n >= 10000000)
+	snprintf(buf, len, "%lluM", n / 1000000);
+    else if (n >= 10000)
+	snprintf(buf, len, "%lluk", n / 1000);
+    else
+	snprintf(buf, len, "%llu", n);
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN)) {
-        if (!gp->hindex){
-	    pgn_switch_side(gp, TRUE);
-	    d->play_mode = (d->play_mode) ? PLAY_HE : PLAY_EH;
-	    if (gp->side == BLACK)
-	        update_status_notify(gp, _("Press 'g' to start the game"));
+    return buf;
+}
 
-	    d->rotate = !d->rotate;
-	}
-	else
-	    message(NULL, ANY_KEY_STR,
-		    _("You may only switch sides at the start of the \n"
-		      "game. Press ^K or ^N to begin a new game."));
+static int analysis_line_compare(const void *a, const void *b)
+{
+    const struct analysis_line_s *la = &analysis.line[*(const int *)a];
+    const struct analysis_line_s *lb = &analysis.line[*(const int *)b];
+
+    if (la->depth != lb->depth)
+	return lb->depth - la->depth;
+
+    if (la->mate || lb->mate) {
+	if (la->mate > 0 && lb->mate > 0)
+	    return la->mate - lb->mate;
+
+	return (lb->mate > 0 || la->mate < 0) ? 1 : -1;
     }
+
+    return lb->score - la->score;
 }
 
-void do_play_undo()
+/*
+ * Each variation takes two rows: the search information and the moves. Only
+ * rows whose variation changed since the last update are redrawn.
+ */
+static void update_analysis_window()
 {
-    struct userdata_s *d = gp->data;
+    static int drawn_slot[ANALYSIS_MULTIPV];
+    static unsigned long drawn_seq[ANALYSIS_MULTIPV];
+    int order[ANALYSIS_MULTIPV];
+    int w = TAG_WIDTH - 2;
+    int i;
 
-    if (!pgn_history_total(gp->hp))
+    if (!analysisw || panel_hidden(analysisp))
 	return;
 
-    if (keycount) {
-        if (gp->hindex - keycount < 0)
-	    gp->hindex = 0;
-	else {
-	    if (d->go_move)
-	        gp->hindex -= (keycount * 2) -1;
-	    else
-	        gp->hindex -= keycount * 2;
-	}
-    }
-    else {
-        if (gp->hindex - 2 < 0)
-	    gp->hindex = 0;
-	else {
-	    if (d->go_move)
-	        gp->hindex -= 1;
-	    else
-	        gp->hindex -= 2;
-	}
+    if (analysis.redraw) {
+	wmove(analysisw, 0, 0);
+	wclrtobot(analysisw);
+	window_draw_title(analysisw, _("Engine Analysis"), TAG_WIDTH,
+		CP_TAG_TITLE, CP_TAG_BORDER);
     }
 
-    pgn_history_free(gp->hp, gp->hindex);
-    gp->hindex = pgn_history_total(gp->hp);
-    pgn_board_update(gp, d->b, gp->hindex);
+    for (i = 0; i < ANALYSIS_MULTIPV; i++)
+	order[i] = i;
 
-    if (d->engine && d->engine->status == ENGINE_READY) {
-        char *fen = pgn_game_to_fen(gp, d->b);
+    qsort(order, ANALYSIS_MULTIPV, sizeof(int), analysis_line_compare);
 
-        add_engine_command(gp, ENGINE_READY, "setboard %s\n", fen);
-	free (fen);
-	d->engine->status = ENGINE_READY;
+    for (i = 0; i < ANALYSIS_MULTIPV && i * 2 + 3 < TAG_HEIGHT - 1; i++) {
+	struct analysis_line_s *l = &analysis.line[order[i]];
+	char score[16], nodes[16], nps[16], buf[80];
+
+	if (!analysis.redraw && drawn_slot[i] == order[i]
+		&& drawn_seq[i] == l->seq)
+	    continue;
+
+	drawn_slot[i] = order[i];
+	drawn_seq[i] = l->seq;
+
+	if (!l->depth) {
+	    mvwprintw(analysisw, i * 2 + 2, 1, "%-*s", w, "");
+	    mvwprintw(analysisw, i * 2 + 3, 1, "%-*s", w, "");
+	    continue;
+	}
+
+	if (l->mate)
+	    snprintf(score, sizeof(score), "#%i", l->mate);
+	else
+	    snprintf(score, sizeof(score), "%+.2f", (double)l->score / 100);
+
+	snprintf(buf, sizeof(buf), _("%i. %s  depth %i  nodes %s  nps %s"),
+		i + 1, score, l->depth,
+		analysis_count_to_char(l->nodes, nodes, sizeof(nodes)),
+		analysis_count_to_char(l->nps, nps, sizeof(nps)));
+	mvwprintw(analysisw, i * 2 + 2, 1, "%-*.*s", w, w, buf);
+	mvwprintw(analysisw, i * 2 + 3, 1, "   %-*.*s", w - 3, w - 3, l->pv);
     }
 
-    update_history_window(gp);
+    analysis.redraw = 0;
+}
 
-    if (d->go_move) {
-        pgn_switch_side(gp, FALSE);
-	d->go_move--;
+static void reset_analysis_lines()
+{
+    int i;
+
+    for (i = 0; i < ANALYSIS_MULTIPV; i++) {
+	unsigned long seq = analysis.line[i].seq;
+
+	memset(&analysis.line[i], 0, sizeof(struct analysis_line_s));
+	analysis.line[i].seq = seq + 1;
     }
+}
 
-    d->pm_undo = TRUE;
+/*
+ * Sends the current position of game 'g' to the engine and (re)starts
+ * analysis.
+ */
+static void send_analysis_position(GAME g)
+{
+    struct userdata_s *d = g->data;
+    char fen[FEN_MAX];
+
+    add_engine_command(g, ENGINE_READY, "setboard %s\n",
+	    board_to_fen(g, d->b, fen));
+    add_engine_command(g, ENGINE_THINKING, "analyze\n");
+    analysis.hp = g->hp;
+    analysis.hindex = g->hindex;
+    reset_analysis_lines();
 }
 
-void do_play_toggle_pause()
+static void stop_analysis()
 {
-    struct userdata_s *d = gp->data;
+    GAME g = analysis.g;
+    struct userdata_s *d;
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN) && gp->turn !=
-	    gp->side) {
-	d->paused = -1;
+    if (!g)
 	return;
-    }
 
-    d->paused = (d->paused) ? 0 : 1;
+    analysis.g = NULL;
+    d = g->data;
+
+    if (analysisw)
+	hide_panel(analysisp);
+
+    if (d && d->engine && d->engine->status != ENGINE_OFFLINE)
+	add_engine_command(g, ENGINE_READY, "exit\n");
 }
 
-void do_play_go()
+static void start_analysis(GAME g)
 {
-    struct userdata_s *d = gp->data;
+    struct userdata_s *d = g->data;
 
-    if (TEST_FLAG(d->flags, CF_HUMAN))
+    if (TEST_FLAG(d->flags, CF_HUMAN)) {
+	message(ERROR_STR, ANY_KEY_STR, "%s",
+		_("The engine is disabled in human vs. human mode."));
 	return;
+    }
 
-    if (fm_loaded_file && gp->side != gp->turn) {
-        pgn_switch_side(gp, FALSE);
-	add_engine_command(gp, ENGINE_THINKING, "black\n");
+    if (lease_engine(g))
+	return;
+
+    if (!analysisw) {
+	analysisw = newwin(TAG_HEIGHT, TAG_WIDTH, STATUS_HEIGHT + 1, 0);
+	analysisp = new_panel(analysisw);
+	wbkgd(analysisw, CP_TAG_WINDOW);
     }
 
-    add_engine_command(gp, ENGINE_THINKING, "go\n");
+    add_engine_command(g, ENGINE_READY, "post\n");
 
-    // Completa la función para que permita seguir jugando al usarla.
-    // Complete the function to allow continue playing when using.
-    if (gp->side == gp->turn)
-        pgn_switch_side(gp, FALSE);
+    if (!d->engine || d->engine->status == ENGINE_OFFLINE)
+	return;
 
-    d->go_move++;
+    if (ANALYSIS_MULTIPV > 1)
+	add_engine_command(g, ENGINE_READY, "option MultiPV=%i\n",
+		ANALYSIS_MULTIPV);
+
+    analysis.g = g;
+    send_analysis_position(g);
+    move_panel(analysisp, STATUS_HEIGHT + 1, getbegx(tagw));
+    show_panel(analysisp);
+    analysis.redraw = 1;
 }
 
-void do_play_config_command()
+/*
+ * Stops analysis when the analyzed game is no longer in focus or has left
+ * history mode. Otherwise restarts it when the position changed.
+ */
+static void sync_analysis(GAME g)
 {
-    int x, w;
+    struct userdata_s *d;
 
-    if (config.keys) {
-	for (x = 0; config.keys[x]; x++) {
-	    if (config.keys[x]->c == input_c) {
-		switch (config.keys[x]->type) {
-		    case KEY_DEFAULT:
-			add_engine_command(gp, -1, "%ls\n",
-				config.keys[x]->str);
-			break;
-		    case KEY_SET:
-			if (!keycount)
-			    break;
+    if (!analysis.g)
+	return;
 
-			add_engine_command(gp, -1,
-				"%ls %i\n", config.keys[x]->str, keycount);
-			keycount = 0;
-			break;
-		    case KEY_REPEAT:
-			if (!keycount)
-			    break;
+    d = analysis.g->data;
 
-			for (w = 0; w < keycount; w++)
-			    add_engine_command(gp, -1,
-				    "%ls\n", config.keys[x]->str);
-			keycount = 0;
-			break;
-		}
-	    }
-	}
+    if (analysis.g != g || d->mode != MODE_HISTORY || !d->engine
+	    || d->engine->status == ENGINE_OFFLINE) {
+	stop_analysis();
+	return;
     }
 
-    update_status_notify(gp, NULL);
+    if (analysis.hp == g->hp && analysis.hindex == g->hindex)
+	return;
+
+    add_engine_command(g, ENGINE_READY, "exit\n");
+    send_analysis_position(g);
 }
 
-void do_play_cancel_selected()
+static long monotonic_ms()
 {
-    struct userdata_s *d = gp->data;
+    struct timespec ts;
 
-    d->sp.icon = d->sp.srow = d->sp.scol = 0;
-    keycount = 0;
-    pgn_reset_valid_moves(d->b);
-    update_status_notify(gp, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void do_play_commit()
+/*
+ * Marks every window for redrawing when 'g' is the current game. The screen
+ * is updated by flush_frame() from game_loop() so engine output, clock
+ * ticks and key presses arriving together cost one terminal update.
+ */
+void update_all(GAME g)
 {
-    struct userdata_s *d = gp->data;
+    if (g != gp)
+	return;
 
-    pushkey = keycount = 0;
-    update_status_notify(gp, NULL);
+    frame_dirty |= FRAME_ALL;
+}
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN) &&
-	    (!d->engine || d->engine->status == ENGINE_THINKING))
+/*
+ * Returns the number of milliseconds until the next frame may be drawn or
+ * 'idle' when there is nothing to draw.
+ */
+static int frame_timeout(int idle)
+{
+    long n;
+
+    if (!frame_dirty)
+	return idle;
+
+    n = 1000 / frame_rate - (monotonic_ms() - frame_last);
+
+    if (n < 0)
+	return 0;
+
+    return (n < idle) ? n : idle;
+}
+
+/*
+ * Redraws the dirty windows of the current game and updates the screen,
+ * unless the last update was less than a frame ago.
+ */
+static void flush_frame()
+{
+    struct userdata_s *d = gp->data;
+    long now = monotonic_ms();
+    int dirty = frame_dirty;
+
+    /*
+     * In the middle of a macro. Don't update the screen.
+     */
+    if (!dirty || macro_match != -1)
 	return;
 
-    if (!d->sp.icon)
+    if (now - frame_last < 1000 / frame_rate)
 	return;
 
-    d->sp.row = d->c_row;
-    d->sp.col = d->c_col;
+    frame_dirty = 0;
+    frame_last = now;
 
-    if (d->rotate) {
-        rotate_position(&d->sp.row, &d->sp.col);
-	rotate_position(&d->sp.srow, &d->sp.scol);
+    if (dirty & FRAME_BOARD) {
+	wmove(boardw, ROWTOMATRIX(d->c_row), COLTOMATRIX(d->c_col));
+	update_board_window(gp);
     }
 
-    move_to_engine(gp);
+    if (dirty & FRAME_STATUS)
+	update_status_window(gp);
 
-    // Completa la función para que permita seguir jugando cuando se carga un
-    // archivo pgn (con juego no terminado) que inicie con turno del lado
-    // negro.
-    // Complete the function to allow continue playing when loading a file
-    // pgn (with unfinished game) you start to turn black side.
-    if (gp->side != gp->turn)
-        pgn_switch_side(gp, FALSE);
+    if (dirty & FRAME_HISTORY)
+	update_history_window(gp);
 
-    if (d->rotate && d->sp.icon)
-        rotate_position(&d->sp.srow, &d->sp.scol);
+    if (dirty & FRAME_TAGS)
+	update_tag_window(gp->tag);
 
-    // Envia comando 'go' a Polyglot en el primer movimiento  debido a que
-    // polyglot no envia el movimiento y cboard se queda esperando.
-    // Send command 'go' to the first movement Polyglot  because cboard
-    // waits to send polyglot movement and this does not make.
-    if (config.fmpolyglot &&
-	((gp->side == WHITE && !gp->hindex) || fm_loaded_file))
-	add_engine_command(gp, ENGINE_THINKING, "go\n");
+    if (dirty & FRAME_ENGINE)
+	update_engine_window(gp);
 
-    d->go_move = 0;
-    fm_loaded_file = FALSE;
-    d->pm_undo = FALSE;
+    if (dirty & FRAME_ANALYSIS)
+	update_analysis_window();
+
+    update_panels();
+    doupdate();
 }
 
-void do_play_select()
+static void game_next_prev(GAME g, int n, int count)
 {
-    struct userdata_s *d = gp->data;
-
-    if (!TEST_FLAG(d->flags, CF_HUMAN) && (!d->engine ||
-		d->engine->status == ENGINE_OFFLINE)) {
-	if (init_chess_engine(gp))
-	    return;
-    }
-
-    if (d->engine && d->engine->status == ENGINE_THINKING)
+    if (gtotal < 2)
 	return;
 
-    if (d->sp.icon)
-      do_play_cancel_selected ();
-
-    if (d->rotate)
-        rotate_position(&d->c_row, &d->c_col);
+    if (n == 1) {
+	if (gindex + count > gtotal - 1) {
+	    if (count != 1)
+		gindex = gtotal - 1;
+	    else
+		gindex = 0;
+	}
+	else
+	    gindex += count;
+    }
+    else {
+	if (gindex - count < 0) {
+	    if (count != 1)
+		gindex = 0;
+	    else
+		gindex = gtotal - 1;
+	}
+	else
+	    gindex -= count;
+    }
 
-    d->sp.icon = d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon;
+    gp = use_game(gindex);
+}
 
-    if (pgn_piece_to_int(d->sp.icon) == OPEN_SQUARE) {
-	d->sp.icon = 0;
-	return;
-    }
+/*
+ * Frees the games for which 'del' is set and closes the gaps in game[] in a
+ * single pass keeping the order of the rest. When 'del' is NULL game 'which'
+ * and the games marked for deletion are freed. Returns the new index of the
+ * first kept game from 'gindex' on.
+ */
+static int compact_games(const char *del, int which)
+{
+    struct userdata_s *d;
+    int i, n, current = -1;
 
-    if (((islower(d->sp.icon) && gp->turn != BLACK)
-		|| (isupper(d->sp.icon) && gp->turn != WHITE))) {
-        struct key_s **k;
-        char *str = Malloc (512);
+    for (i = n = 0; i < gtotal; i++) {
+	d = game[i]->data;
 
-	for (k = play_keys; *k; k++) {
-	  if ((*k)->f == do_play_toggle_eh_mode)
-	        break;
-	}
+	if (i == gindex)
+	    current = n;
 
-	snprintf (str, 512,  _("It is not your turn to move. You may switch playing sides by pressing \"%lc\"."),
-		  *k ? (*k)->c : '?');
-	message(NULL, ANY_KEY_STR, "%s", str);
-	free (str);
-	d->sp.icon = 0;
-	return;
-#if 0
-	if (pgn_history_total(gp->hp)) {
-	    message(NULL, ANY_KEY_STR, "%s", _("It is not your turn to move. You can switch sides "));
-	    d->sp.icon = 0;
-	    return;
+	if ((del) ? !del[i] :
+		i != which && (!d || !TEST_FLAG(d->flags, CF_DELETE))) {
+	    game[n++] = game[i];
+	    continue;
 	}
-	else {
-	    if (pgn_tag_find(gp->tag, "FEN") != E_PGN_ERR)
-		return;
 
-	    add_engine_command(gp, ENGINE_READY, "black\n");
-	    pgn_switch_turn(gp);
+	free_userdata_once(game[i]);
+	pgn_free(game[i]);
+    }
 
-	    if (gp->side != BLACK)
-		pgn_switch_side(gp);
-	}
-#endif
+    if (n != gtotal) {
+	reset_tag_index();
+	reset_move_index();
+	reset_explorer();
+	reset_position_cache();
     }
 
-    d->sp.srow = d->c_row;
-    d->sp.scol = d->c_col;
+    gtotal = n;
+    return (current == -1 || current >= n) ? n - 1 : current;
+}
 
-    if (config.validmoves)
-	pgn_find_valid_moves(gp, d->b, d->sp.scol, d->sp.srow);
+static void delete_game(int which)
+{
+    compact_games(NULL, which);
 
-    if (d->rotate) {
-        rotate_position(&d->c_row, &d->c_col);
-	rotate_position(&d->sp.srow, &d->sp.scol);
+    if (which != -1) {
+	if (which + 1 >= gtotal)
+	    gindex = gtotal - 1;
+	else
+	    gindex = which;
     }
+    else
+	gindex = gtotal - 1;
 
-    CLEAR_FLAG(d->flags, CF_NEW);
-    start_clock(gp);
+    gp = use_game(gindex);
+    gp->hp = gp->history;
 }
 
-static wchar_t *build_help(struct key_s **keys)
+/*
+ * FIXME find across multiple games.
+ */
+static int find_move_exp(GAME g, regex_t r, int which, int count)
 {
-    int i, nlen = 1, len, t, n;
-    wchar_t *buf = NULL, *wc = NULL;
-    wchar_t *p;
+    int i;
+    int ret;
+    char errbuf[255];
+    int incr;
+    int found;
+    int total = pgn_history_total(g->hp);
 
-    if (!keys)
-	return NULL;
+    incr = (which == 0) ? -1 : 1;
 
-    for (i = len = t = 0; keys[i]; i++) {
-	if (!keys[i]->d)
-	    continue;
+    for (i = g->hindex + incr - 1, found = 0; ; i += incr) {
+	if (i == g->hindex - 1)
+	    break;
 
-	if (keys[i]->key) {
-	    if (wcslen(keys[i]->key) > nlen) {
-		nlen = wcslen(keys[i]->key);
-		t += nlen;
+	if (i >= total)
+	    i = 0;
+	else if (i < 0)
+	    i = total - 1;
+
+	// FIXME RAV
+	ret = regexec(&r, g->hp[i]->move, 0, 0, 0);
+
+	if (ret == 0) {
+	    if (count == ++found) {
+		return i + 1;
 	    }
-	    else
-		t++;
 	}
-	else
-	    t++;
-
-	if (keys[i]->d) {
-	    if (wcslen(keys[i]->d) > len)
-		len = wcslen(keys[i]->d);
+	else {
+	    if (ret != REG_NOMATCH) {
+		regerror(ret, &r, errbuf, sizeof(errbuf));
+		cmessage(_("Error Matching Regular Expression"), ANY_KEY_STR, "%s", errbuf);
+		return -1;
+	    }
 	}
+    }
 
-	t += len;
-	t += keys[i]->r;
+    return -1;
+}
+
+/*
+ * Sets or clears the delete flag of userdata 'd' keeping delete_marked up to
+ * date.
+ */
+static void set_delete_flag(struct userdata_s *d, int set)
+{
+    if (!TEST_FLAG(d->flags, CF_DELETE) == !set)
+	return;
+
+    if (set) {
+	SET_FLAG(d->flags, CF_DELETE);
+	delete_marked++;
     }
+    else {
+	CLEAR_FLAG(d->flags, CF_DELETE);
+	delete_marked--;
+    }
+}
 
-    t += 4 + i + 1;
-    buf = Malloc((t+1)*sizeof(wchar_t));
-    p = buf;
+static int toggle_delete_flag(int n)
+{
+    struct userdata_s *d = use_game(n)->data;
 
-    for (i = 0; keys[i]; i++) {
-	if (!keys[i]->d)
-	    continue;
+    set_delete_flag(d, !TEST_FLAG(d->flags, CF_DELETE));
+    gindex = n;
 
-	if (keys[i]->key)
-	    n = wcslen(keys[i]->key);
-	else
-	    n = 1;
+    if (delete_marked == gtotal) {
+	cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
+	set_delete_flag(d, 0);
+	return 1;
+    }
 
-	while (n++ <= nlen)
-	    *p++ = ' ';
+    return 0;
+}
 
-	*p = 0;
+/*
+ * Games by tag value for indexed searches. For each tag name ID the
+ * (value, game) pairs are kept sorted by value so exact and prefix queries
+ * are a binary search. Built by the first indexed search and again after
+ * any game's tag index changed.
+ */
+struct tag_entry_s {
+    int rank;		/* Of the value in case insensitive order. */
+    int game;
+};
 
-	if (keys[i]->key) {
-	    wcsncat(buf, keys[i]->key, t-1);
-	    p = buf + wcslen(buf);
-	}
-	else
-	    *p++ = keys[i]->c;
+struct tag_search_s {
+    unsigned gen;
+    int *order;			/* Value IDs by rank. */
+    int *rank;			/* By value ID. */
+    int nvalues;
+    struct tag_entry_s **e;	/* By name ID. */
+    int *total;
+    int names;
+    char *query;		/* The last query and its matching games. */
+    int *match;
+    int nmatch;
+};
 
-	*p++ = ' ';
-	*p++ = '-';
-	*p++ = ' ';
-	*p = 0;
+static struct tag_search_s tag_search;
 
-	if (keys[i]->d)
-	    wcsncat(buf, keys[i]->d, t-1);
+static int tag_value_cmp(const void *a, const void *b)
+{
+    const char *s1 = tag_values.str[*(const int *)a];
+    const char *s2 = tag_values.str[*(const int *)b];
+    int n = strcasecmp(s1, s2);
 
-	if (keys[i]->r) {
-	    wc = str_to_wchar ("*");
-	    wcsncat(buf, wc, t-1);
-	    free (wc);
-	}
+    return (n) ? n : strcmp(s1, s2);
+}
 
-	wc = str_to_wchar ("\n");
-	wcscat(buf, wc);
-	free (wc);
-	p = buf + wcslen(buf);
-    }
+static int tag_entry_cmp(const void *a, const void *b)
+{
+    const struct tag_entry_s *e1 = a, *e2 = b;
 
-    return buf;
+    if (e1->rank != e2->rank)
+	return (e1->rank < e2->rank) ? -1 : 1;
+
+    return e1->game - e2->game;
 }
 
-void do_global_help ()
+static void free_tag_search()
 {
-    wchar_t *buf = build_help(global_keys);
+    int i;
 
-    construct_message(_("Global Game Keys (* = can take a repeat count)"),
-		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL, buf, do_more_help,
-		      0, 1, "%ls", buf);
+    for (i = 0; i < tag_search.names; i++)
+	free(tag_search.e[i]);
+
+    free(tag_search.e);
+    free(tag_search.total);
+    free(tag_search.order);
+    free(tag_search.rank);
+    free(tag_search.query);
+    free(tag_search.match);
+    memset(&tag_search, 0, sizeof(struct tag_search_s));
 }
 
-void do_main_help(WIN *win)
+static void build_tag_search()
 {
-    switch (win->c) {
-	case 'p':
-	    do_play_help ();
-	    break;
-	case 'h':
-	    do_history_help ();
-	    break;
-	case 'e':
-	    do_edit_help ();
-	    break;
-	case 'g':
-	    do_global_help ();
-	    break;
-	default:
-	    break;
-    }
-}
+    struct tag_search_s *s = &tag_search;
+    int g, i;
 
-static void do_more_help(WIN *win)
-{
-    if (win->c == KEY_F(1) || win->c == CTRL_KEY('g'))
-      construct_message(_("Command Key Index"),
-			_ ("p/h/e/g or any other key to quit"), 0, 0,
-			NULL, NULL, NULL, do_main_help, 0, 0, "%s",
-			_ (
-			   "p - play mode keys\n"
-			   "h - history mode keys\n"
-			   "e - board edit mode keys\n"
-			   "g - global game keys"
-			   ));
-}
+    /* Catches tags that were edited or games that were added. */
+    for (g = 0; g < gtotal; g++)
+	game_tags(g);
 
-void do_play_help()
-{
-    wchar_t *buf = build_help(play_keys);
+    if (s->e && s->gen == tag_index_gen)
+	return;
 
-    construct_message(_("Play Mode Keys (* = can take a repeat count)"),
-		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL,
-		      buf, do_more_help, 0, 1, "%ls", buf);
-}
+    free_tag_search();
+    s->order = Malloc((tag_values.total + 1) * sizeof(int));
+    s->rank = Malloc((tag_values.total + 1) * sizeof(int));
+    s->nvalues = tag_values.total;
 
-void do_play_history_mode()
-{
-    struct userdata_s *d = gp->data;
+    for (i = 0; i < tag_values.total; i++)
+	s->order[i] = i;
 
-    if (!pgn_history_total(gp->hp) ||
-	    (d->engine && d->engine->status == ENGINE_THINKING))
-	return;
+    qsort(s->order, tag_values.total, sizeof(int), tag_value_cmp);
 
-    d->mode = MODE_HISTORY;
-    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
-}
+    for (i = 0; i < tag_values.total; i++)
+	s->rank[s->order[i]] = i;
 
-void do_play_edit_mode()
-{
-    struct userdata_s *d = gp->data;
+    s->names = tag_names.total;
+    s->e = Calloc(s->names, sizeof(struct tag_entry_s *));
+    s->total = Calloc(s->names, sizeof(int));
 
-    if (pgn_history_total(gp->hp))
-	return;
+    for (g = 0; g < gtotal; g++) {
+	for (i = 0; i < tag_index[g].total; i++)
+	    s->total[tag_index[g].name[i]]++;
+    }
 
-    pgn_board_init_fen(gp, d->b, NULL);
-    config.details++;
-    d->mode = MODE_EDIT;
-}
+    for (i = 0; i < s->names; i++) {
+	s->e[i] = Malloc((s->total[i] + 1) * sizeof(struct tag_entry_s));
+	s->total[i] = 0;
+    }
 
-void do_edit_insert_finalize(WIN *win)
-{
-    struct userdata_s *d = win->data;
+    for (g = 0; g < gtotal; g++) {
+	struct tag_index_s *x = &tag_index[g];
 
-    if (pgn_piece_to_int(win->c) == -1)
-	return;
+	for (i = 0; i < x->total; i++) {
+	    struct tag_entry_s *e = &s->e[x->name[i]][s->total[x->name[i]]++];
 
-    d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon = win->c;
+	    e->rank = s->rank[x->id[i]];
+	    e->game = g;
+	}
+    }
+
+    for (i = 0; i < s->names; i++)
+	qsort(s->e[i], s->total[i], sizeof(struct tag_entry_s), tag_entry_cmp);
+
+    s->gen = tag_index_gen;
 }
 
-void do_edit_select()
+/*
+ * Returns the first of 'total' entries whose value is not less than 'key'
+ * or, when 'after' is set, greater than 'key'. Only the first 'len'
+ * characters of a value are compared when 'len' is not zero.
+ */
+static int tag_entry_bound(struct tag_entry_s *e, int total, const char *key,
+	size_t len, int after)
 {
-    struct userdata_s *d = gp->data;
-
-    if (d->sp.icon)
-	return;
+    int lo = 0, hi = total;
 
-    d->sp.icon = d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	const char *v = tag_values.str[tag_search.order[e[mid].rank]];
+	int n = (len) ? strncasecmp(v, key, len) : strcasecmp(v, key);
 
-    if (pgn_piece_to_int(d->sp.icon) == OPEN_SQUARE) {
-	d->sp.icon = 0;
-	return;
+	if (n < 0 || (after && n == 0))
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
 
-    d->sp.srow = d->c_row;
-    d->sp.scol = d->c_col;
+    return lo;
 }
 
-void do_edit_commit()
+static int tag_is_number(const char *s, long *n)
 {
-    int p;
-    struct userdata_s *d = gp->data;
-
-    pushkey = keycount = 0;
-    update_status_notify(gp, NULL);
+    char *p;
 
-    if (!d->sp.icon)
-	return;
+    if (!*s)
+	return 0;
 
-    d->sp.row = d->c_row;
-    d->sp.col = d->c_col;
-    p = d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon;
-    d->b[RANKTOBOARD(d->sp.row)][FILETOBOARD(d->sp.col)].icon = p;
-    d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon =
-	pgn_int_to_piece(gp->turn, OPEN_SQUARE);
-    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+    *n = strtol(s, &p, 10);
+    return !*p;
 }
 
-void do_edit_delete()
+/*
+ * Whether 'v' is within the range 'lo'..'hi' where either may be empty.
+ * Numbers compare by value and anything else by prefix so that
+ * Date=2000..2005 includes 2005.12.31.
+ */
+static int tag_in_range(const char *v, const char *lo, const char *hi)
 {
-    struct userdata_s *d = gp->data;
+    long n, l = 0, h = 0;
 
-    if (d->sp.icon)
-	d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon =
-	    pgn_int_to_piece(gp->turn, OPEN_SQUARE);
-    else
-	d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon =
-	    pgn_int_to_piece(gp->turn, OPEN_SQUARE);
+    if (tag_is_number(v, &n) && (!*lo || tag_is_number(lo, &l))
+	    && (!*hi || tag_is_number(hi, &h)))
+	return (!*lo || n >= l) && (!*hi || n <= h);
 
-    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+    return (!*lo || strcasecmp(v, lo) >= 0)
+	&& (!*hi || strncasecmp(v, hi, strlen(hi)) <= 0);
 }
 
-void do_edit_cancel_selected()
+/*
+ * Matches an indexed query "name=value", "name=prefix*" or "name=lo..hi"
+ * and keeps the matching games in tag_search.match. Returns 0 when 'str' is
+ * not an indexed query and should be matched as a regular expression.
+ */
+static int tag_search_query(const char *str)
 {
-    struct userdata_s *d = gp->data;
+    struct tag_search_s *s = &tag_search;
+    struct tag_entry_s *e;
+    char buf[255], *name, *value, *p;
+    unsigned char *games;
+    int id, in, n = 0, i;
 
-    d->sp.icon = d->sp.srow = d->sp.scol = 0;
-    keycount = 0;
-    update_status_notify(gp, NULL);
-}
+    for (p = (char *)str; isspace(*p); p++);
+    strncpy(buf, p, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
 
-void do_edit_switch_turn()
-{
-    pgn_switch_turn(gp);
-}
+    for (p = name = buf; isalnum(*p) || *p == '_'; p++);
 
-void do_edit_toggle_castle()
-{
-    struct userdata_s *d = gp->data;
+    if (p == name)
+	return 0;
 
-    castling_state(gp, d->b, RANKTOBOARD(d->c_row),
-	    FILETOBOARD(d->c_col),
-	    d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon, 1);
-}
+    for (value = p; isspace(*value); value++);
 
-void do_edit_insert()
-{
-    struct userdata_s *d = gp->data;
+    if (*value++ != '=')
+	return 0;
 
-    construct_message(_("Insert Piece"), _("P=pawn, R=rook, N=knight, B=bishop, "), 0, 0, NULL, NULL,
-	    d->b, do_edit_insert_finalize, 0, 0, "%s", _("Type the piece letter to insert. Lowercase "));
-}
+    *p = 0;
 
-void do_edit_enpassant()
-{
-    struct userdata_s *d = gp->data;
+    while (isspace(*value))
+	value++;
 
-    if (d->c_row == 6 || d->c_row == 3) {
-	pgn_reset_enpassant(d->b);
-	d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].enpassant = 1;
-    }
-}
+    for (p = value + strlen(value); p > value && isspace(*(p-1)); p--);
+    *p = 0;
 
-void do_edit_help()
-{
-    wchar_t *buf = build_help(edit_keys);
+    build_tag_search();
 
-    construct_message(_("Edit Mode Keys (* = can take a repeat count)"),
-		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL, buf, do_more_help,
-		      0, 1, "%ls", buf);
-}
+    if (s->query && !strcmp(s->query, str))
+	return 1;
 
-void do_edit_exit()
-{
-    struct userdata_s *d = gp->data;
-    char *fen = pgn_game_to_fen(gp, d->b);
+    free(s->query);
+    free(s->match);
+    s->query = strdup(str);
+    s->match = NULL;
+    s->nmatch = 0;
+    id = strpool_find(&tag_names, name);
 
-    config.details--;
-    pgn_tag_add(&gp->tag, "FEN", fen);
-    free (fen);
-    pgn_tag_add(&gp->tag, "SetUp", "1");
-    pgn_tag_sort(gp->tag);
-    pgn_board_update(gp, d->b, gp->hindex);
-    d->mode = MODE_PLAY;
-}
+    if (id == -1 || id >= s->names)
+	return 1;
 
-void really_do_annotate_finalize(struct input_data_s *in,
-	struct userdata_s *d)
-{
-    HISTORY *h = in->data;
-    int len;
+    e = s->e[id];
+    games = Calloc(gtotal + 1, 1);
 
-    if (!in->str) {
-	if (h->comment) {
-	    free(h->comment);
-	    h->comment = NULL;
+    if ((p = strstr(value, "..")) != NULL) {
+	*p = 0;
+	p += 2;
+
+	/* Each distinct value is only compared once. */
+	for (i = 0, in = 0; i < s->total[id]; i++) {
+	    if (!i || e[i].rank != e[i-1].rank)
+		in = tag_in_range(tag_values.str[s->order[e[i].rank]], value, p);
+
+	    if (in && !games[e[i].game]) {
+		games[e[i].game] = 1;
+		n++;
+	    }
 	}
     }
     else {
-	len = strlen(in->str);
-	h->comment = Realloc(h->comment, len+1);
-	strncpy(h->comment, in->str, len);
-	h->comment[len] = 0;
+	size_t len = 0;
+	int from = 0, to = s->total[id], prefix = 0;
+
+	if (*value && value[strlen(value)-1] == '*') {
+	    value[strlen(value)-1] = 0;
+	    len = strlen(value);
+	    prefix = 1;
+	}
+
+	/* A lone '*' matches any game having the tag. */
+	if (!prefix || len) {
+	    from = tag_entry_bound(e, s->total[id], value, len, 0);
+	    to = tag_entry_bound(e, s->total[id], value, len, 1);
+	}
+
+	for (i = from; i < to; i++) {
+	    if (!games[e[i].game]) {
+		games[e[i].game] = 1;
+		n++;
+	    }
+	}
     }
 
-    free(in->str);
-    free(in);
-    SET_FLAG(d->flags, CF_MODIFIED);
-}
+    s->match = Malloc((n + 1) * sizeof(int));
 
-void do_annotate_finalize(WIN *win)
-{
-    struct userdata_s *d = gp->data;
-    struct input_data_s *in = win->data;
+    for (i = 0; i < gtotal; i++) {
+	if (games[i])
+	    s->match[s->nmatch++] = i;
+    }
 
-    really_do_annotate_finalize(in, d);
+    free(games);
+    return 1;
 }
 
-void do_find_move_exp_finalize(int init, int which)
+/*
+ * Returns the 'count'th game matching the last indexed query after the
+ * current game in the direction 'incr' or -1.
+ */
+static int tag_search_step(int incr, int count)
 {
-    int n;
-    struct userdata_s *d = gp->data;
-    static int firstrun;
-    static regex_t r;
-    int ret;
-    char errbuf[255];
-
-    if (init || !firstrun) {
-	if (!firstrun)
-	    regfree(&r);
+    struct tag_search_s *s = &tag_search;
+    int lo = 0, hi = s->nmatch, n;
 
-	if ((ret = regcomp(&r, moveexp, REG_EXTENDED|REG_NOSUB)) != 0) {
-	    regerror(ret, &r, errbuf, sizeof(errbuf));
-	    cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
-	    return;
-	}
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
 
-	firstrun = 1;
+	if (s->match[mid] < gindex)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
 
-    if ((n = find_move_exp(gp, r,
-		    (which == -1) ? 0 : 1, (keycount) ? keycount : 1)) == -1)
-	return;
+    /* The current game is not a match of its own. */
+    n = s->nmatch - (lo < s->nmatch && s->match[lo] == gindex);
 
-    gp->hindex = n;
-    pgn_board_update(gp, d->b, gp->hindex);
-}
+    if (count > n)
+	return -1;
 
-void do_find_move_exp(WIN *win)
-{
-    struct input_data_s *in = win->data;
-    int *n = in->data;
-    int which = *n;
+    if (incr == 1) {
+	if (lo < s->nmatch && s->match[lo] == gindex)
+	    lo++;
 
-    if (in->str) {
-	strncpy(moveexp, in->str, sizeof(moveexp)-1);
-	moveexp[sizeof(moveexp)-1] = 0;
-	do_find_move_exp_finalize(1, which);
-	free(in->str);
+	return s->match[(lo + count - 1) % s->nmatch];
     }
 
-    free(in->data);
-    free(in);
+    return s->match[((lo - count) % s->nmatch + s->nmatch) % s->nmatch];
 }
 
-void do_move_jump_finalize(int n)
+/*
+ * Regular expression results by string pool ID: 0 is unknown, 1 a match
+ * and 2 no match.
+ */
+struct tag_memo_s {
+    unsigned char *m;
+    int n;
+};
+
+/*
+ * Returns whether the interned string 'id' of 'pool' matches 'r'.
+ */
+static int tag_memo_match(struct tag_memo_s *memo, regex_t *r,
+	struct strpool_s *pool, int id)
 {
-    struct userdata_s *d = gp->data;
+    /* The pool grows while games are indexed. */
+    if (id >= memo->n) {
+	memo->m = Realloc(memo->m, pool->total);
+	memset(memo->m + memo->n, 0, pool->total - memo->n);
+	memo->n = pool->total;
+    }
 
-    if (n < 0 || n > (pgn_history_total(gp->hp) / 2))
-	return;
+    if (!memo->m[id])
+	memo->m[id] = regexec(r, pool->str[id], 0, 0, 0) ? 2 : 1;
 
-    keycount = 0;
-    update_status_notify(gp, NULL);
-    gp->hindex = (n) ? n * 2 - 1 : n * 2;
-    pgn_board_update(gp, d->b, gp->hindex);
+    return memo->m[id] == 1;
 }
 
-void do_move_jump(WIN *win)
-{
-    struct input_data_s *in = win->data;
+/*
+ * A compiled "[name expression:]value expression".
+ */
+struct tag_exp_s {
+    regex_t nexp, vexp;
+    int name;		/* Whether there was a name expression. */
+    struct tag_memo_s name_memo, value_memo;
+};
 
-    if (!in->str || !isinteger(in->str)) {
-	if (in->str)
-	    free(in->str);
+static int compile_tag_exp(struct tag_exp_s *e, const char *str)
+{
+    char buf[255] = {0}, *tmp = buf, *exp;
+    char errbuf[255];
+    int ret;
 
-	free(in);
-	return;
-    }
+    memset(e, 0, sizeof(struct tag_exp_s));
+    strncpy(buf, str, sizeof(buf)-1);
 
-    do_move_jump_finalize(atoi(in->str));
-    free(in->str);
-    free(in);
-}
+    if (strstr(tmp, ":") != NULL) {
+	char *nstr = strsep(&tmp, ":");
 
-struct history_menu_s {
-    char *line;
-    int hindex;
-    int ravlevel;
-    int move;
-    int indent;
-};
+	if ((ret = regcomp(&e->nexp, nstr,
+			REG_ICASE|REG_EXTENDED|REG_NOSUB)) != 0) {
+	    regerror(ret, &e->nexp, errbuf, sizeof(errbuf));
+	    cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
+	    return -1;
+	}
 
-void free_history_menu_data(struct history_menu_s **h)
-{
-    int i;
+	e->name = 1;
+    }
 
-    if (!h)
-	return;
+    for (exp = tmp; *exp && isspace(*exp); exp++);
 
-    for (i = 0; h[i]; i++) {
-	free(h[i]->line);
-	free(h[i]);
+    if ((ret = regcomp(&e->vexp, exp, REG_EXTENDED|REG_NOSUB)) != 0) {
+	regerror(ret, &e->vexp, errbuf, sizeof(errbuf));
+	cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
+
+	if (e->name)
+	    regfree(&e->nexp);
+
+	return -1;
     }
 
-    free(h);
+    return 0;
 }
 
-void get_history_data(HISTORY **hp, struct history_menu_s ***menu, int m,
-	int turn)
+/*
+ * Returns the number of tags of game 'g' matching 'e'. Each distinct name
+ * and value is only matched once. Tag names and values repeat across games.
+ */
+static int tag_exp_count(struct tag_exp_s *e, int g)
 {
-    int i, n = 0;
-    int t = pgn_history_total(hp);
-    char buf[MAX_SAN_MOVE_LEN + 4];
-    static int depth;
-    struct history_menu_s **hmenu = *menu;
-
-    if (hmenu)
-	for (n = 0; hmenu[n]; n++);
-    else
-	depth = 0;
-
-    for (i = 0; i < t; i++) {
-	hmenu = Realloc(hmenu, (n + 2) * sizeof(struct history_menu_s *));
-	hmenu[n] = Malloc(sizeof(struct history_menu_s));
-	snprintf(buf, sizeof(buf), "%c%s%s", (turn == WHITE) ? 'W' : 'B',
-		hp[i]->move, (hp[i]->comment || hp[i]->nag[0]) ? " !" : "");
-	hmenu[n]->line = strdup(buf);
-	hmenu[n]->hindex = i;
-	hmenu[n]->indent = 0;
-	hmenu[n]->ravlevel = depth;
-	hmenu[n]->move = (n && depth > hmenu[n-1]->ravlevel) ? m++ : m;
-	n++;
-	hmenu[n] = NULL;
-
-#if 0
-	if (hp[i]->rav) {
-	    depth++;
-	    get_history_data(hp[i]->rav, &hmenu, m, turn);
-	    for (n = 0; hmenu[n]; n++);
-	    depth--;
+    struct tag_index_s *x = game_tags(g);
+    int t, n = 0;
 
-	    if (depth)
-		m--;
-	}
-#endif
+    for (t = 0; t < x->total; t++) {
+	if (e->name && !tag_memo_match(&e->name_memo, &e->nexp, &tag_names,
+		    x->name[t]))
+	    continue;
 
-	turn = (turn == WHITE) ? BLACK : WHITE;
+	if (tag_memo_match(&e->value_memo, &e->vexp, &tag_values, x->id[t]))
+	    n++;
     }
 
-    *menu = hmenu;
+    return n;
 }
 
-void history_draw_update(struct menu_input_s *m)
+static void free_tag_exp(struct tag_exp_s *e)
 {
-    GAME g = m->data;
-    struct userdata_s *d = g->data;
+    if (e->name)
+	regfree(&e->nexp);
 
-    g->hindex = m->selected + 1;
-    update_cursor(g, m->selected);
-    pgn_board_update(g, d->b, m->selected + 1);
+    regfree(&e->vexp);
+    free(e->name_memo.m);
+    free(e->value_memo.m);
 }
 
-struct menu_item_s **get_history_items(WIN *win)
+static int find_game_exp(char *str, int which, int count)
 {
-    struct menu_input_s *m = win->data;
-    GAME g = m->data;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-    struct menu_item_s **items = m->items;
-    int i;
-
-    if (!hm) {
-	get_history_data(g->history, &hm, 0,
-		TEST_FLAG(g->flags, GF_BLACK_OPENING));
-	m->selected = g->hindex - 1;
-
-	if (m->selected < 0)
-	    m->selected = 0;
+    struct tag_exp_s e;
+    int incr = (which == 0) ? -(1) : 1;
+    int g, found = 0;
 
-	m->draw_exit_func = history_draw_update;
-    }
+    if (tag_search_query(str))
+	return tag_search_step(incr, count);
 
-    d->data = hm;
+    if (compile_tag_exp(&e, str))
+	return -1;
 
-    if (items) {
-	for (i = 0; items[i]; i++)
-	    free(items[i]);
+    for (g = gindex + incr; ; g += incr) {
+	if (g == gtotal)
+	    g = 0;
+	else if (g < 0)
+	    g = gtotal - 1;
 
-	free(items);
-	items = NULL;
-    }
+	if (g == gindex) {
+	    g = -1;
+	    break;
+	}
 
-    for (i = 0; hm[i]; i++) {
-	items = Realloc(items, (i+2) * sizeof(struct menu_item_s *));
-	items[i] = Malloc(sizeof(struct menu_item_s));
-	items[i]->name = hm[i]->line;
-	items[i]->value = NULL;
-	items[i]->selected = 0;
+	if ((found += tag_exp_count(&e, g)) >= count)
+	    break;
     }
 
-    if (items)
-	items[i] = NULL;
-
-    m->nofree = 1;
-    m->items = items;
-    return items;
+    free_tag_exp(&e);
+    return g;
 }
 
-void history_menu_quit(struct menu_input_s *m)
+/*
+ * Updates the notification line in the status window then refreshes the
+ * status window.
+ */
+void update_status_notify(GAME g, char *fmt, ...)
 {
-    pushkey = -1;
-}
+    va_list ap;
+#ifdef HAVE_VASPRINTF
+    char *line;
+#else
+    char line[COLS];
+#endif
 
-void history_menu_exit(WIN *win)
-{
-    GAME g = win->data;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-    int i;
+    free(status.notify);
+    status.notify = NULL;
 
-    if (!hm)
+    if (!fmt)
 	return;
 
-    for (i = 0; hm[i]; i++) {
-	free(hm[i]->line);
-	free(hm[i]);
-    }
+    va_start(ap, fmt);
+#ifdef HAVE_VASPRINTF
+    vasprintf(&line, fmt, ap);
+#else
+    vsnprintf(line, sizeof(line), fmt, ap);
+#endif
+    va_end(ap);
 
-    free(hm);
-    d->data = NULL;
+    status.notify = str_to_wchar(line);
+
+#ifdef HAVE_VASPRINTF
+    free(line);
+#endif
 }
 
-// FIXME RAV
-void history_menu_next(struct menu_input_s *m)
+int rav_next_prev(GAME g, BOARD b, int n)
 {
-    GAME g = m->data;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-    int n, t;
+    // Next RAV.
+    if (n) {
+	if ((!g->ravlevel && g->hindex && g->hp[g->hindex - 1]->rav == NULL) ||
+		(!g->ravlevel && !g->hindex && g->hp[g->hindex]->rav == NULL) ||
+		(g->ravlevel && g->hp[g->hindex]->rav == NULL))
+	    return 1;
 
-    for (t = 0; hm[t]; t++);
+	g->rav = Realloc(g->rav, (g->ravlevel + 1) * sizeof(RAV));
+	g->rav[g->ravlevel].hp = g->hp;
+	g->rav[g->ravlevel].flags = g->flags;
+	g->rav[g->ravlevel].fen = pgn_game_to_fen(g, b);
+	g->rav[g->ravlevel].hindex = g->hindex;
+	g->hp = (!g->ravlevel) ? (g->hindex) ? g->hp[g->hindex - 1]->rav : g->hp[g->hindex]->rav : g->hp[g->hindex]->rav;
+	g->hindex = 0;
+	g->ravlevel++;
+	history_board_update(g, b, g->hindex + 1);
+	return 0;
+    }
 
-    if (m->selected + 1 == t)
-	n = 0;
-    else
-	n = hm[m->selected + 1]->hindex;
+    if (g->ravlevel - 1 < 0)
+	return 1;
 
-    n++;
-    g->hindex = n;
+    // Previous RAV.
+    g->ravlevel--;
+    pgn_board_init_fen(g, b, g->rav[g->ravlevel].fen);
+    free(g->rav[g->ravlevel].fen);
+    g->hp = g->rav[g->ravlevel].hp;
+    g->flags = g->rav[g->ravlevel].flags;
+    g->hindex = g->rav[g->ravlevel].hindex;
+    return 0;
 }
 
-// FIXME RAV
-void history_menu_prev(struct menu_input_s *m)
+static void draw_window_decor()
 {
-    GAME g = m->data;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-    int n, t;
+    move_panel(boardp, 0,
+	       (config.boardleft) ? 0 : COLS - BOARD_WIDTH);
+    move_panel(historyp, LINES - HISTORY_HEIGHT,
+		(config.boardleft) ? (MEGA_BOARD) ? BOARD_WIDTH : 0 :
+		(MEGA_BOARD) ? 0 : COLS - HISTORY_WIDTH);
+    move_panel(statusp, 0,
+	       (config.boardleft) ? BOARD_WIDTH : 0);
+	move_panel(tagp, STATUS_HEIGHT + 1,
+		(config.boardleft) ? (MEGA_BOARD) ? BOARD_WIDTH :
+		HISTORY_WIDTH : 0);
 
-    for (t = 0; hm[t]; t++);
+    wbkgd(boardw, CP_BOARD_WINDOW);
+    wbkgd(statusw, CP_STATUS_WINDOW);
+    window_draw_title(statusw, _("Game Status"), STATUS_WIDTH,
+	    CP_STATUS_TITLE, CP_STATUS_BORDER);
+    wbkgd(tagw, CP_TAG_WINDOW);
+    window_draw_title(tagw, _("Roster Tags"), TAG_WIDTH, CP_TAG_TITLE,
+	    CP_TAG_BORDER);
 
-    if (m->selected - 1 < 0)
-	n = t - 1;
-    else
-	n = hm[m->selected - 1]->hindex;
+    if (analysisw)
+	move_panel(analysisp, STATUS_HEIGHT + 1, getbegx(tagw));
 
-    n++;
-    g->hindex = n;
+    wbkgd(historyw, CP_HISTORY_WINDOW);
+    window_draw_title(historyw, _("Move History"), HISTORY_WIDTH,
+	    CP_HISTORY_TITLE, CP_HISTORY_BORDER);
 }
 
-void history_menu_help(struct menu_input_s *m)
+void do_window_resize()
 {
-    message(_("History Menu Help"), ANY_KEY_STR, "%s",
-	    _ (
-	       "    UP/DOWN - previous/next menu item\n"
-	       "   HOME/END - first/last menu item\n"
-	       "  PGDN/PGUP - next/previous page\n"
-	       "  a-zA-Z0-9 - jump to item\n"
-	       "     CTRL-a - annotate the selected move\n"
-	       "      ENTER - view annotation\n"
-	       "     CTRL-d - toggle board details\n"
-	       "   ESCAPE/M - return to move history"
-	       ));
-}
+    if (LINES < 23 || COLS < 74)
+	return;
 
-void do_annotate_move(HISTORY *hp)
-{
-    char buf[COLS - 4];
-    struct input_data_s *in;
+    resizeterm(LINES, COLS);
+    endwin();
+    wresize(boardw, BOARD_HEIGHT, BOARD_WIDTH);
+    wresize(historyw, HISTORY_HEIGHT, HISTORY_WIDTH);
+    wresize(statusw, STATUS_HEIGHT, STATUS_WIDTH);
+    wresize(tagw, TAG_HEIGHT, TAG_WIDTH);
 
-    snprintf(buf, sizeof(buf), "%s \"%s\"", _("Editing Annotation for"), hp->move);
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->data = hp;
-    in->efunc = do_annotate_finalize;
-    construct_input(buf, hp->comment, MAX_PGN_LINE_LEN / INPUT_WIDTH, 0,
-	    _("Type CTRL-t to edit NAG"), edit_nag, NULL, CTRL_KEY('T'), in, -1, -1);
+    if (analysisw) {
+	wresize(analysisw, TAG_HEIGHT, TAG_WIDTH);
+	analysis.redraw = 1;
+    }
+
+    clear ();
+    wclear (boardw);
+    wclear (historyw);
+    wclear (tagw);
+    wclear (statusw);
+    wclear (loadingw);
+    wclear (enginew);
+    engine_window_redraw = 1;
+    tag_window_redraw = 1;
+    board_geometry(board_geom.rotate);
+    draw_window_decor();
+    update_all(gp);
+    keypad(boardw, TRUE);
+    curs_set(0);
+    cbreak();
+    noecho();
 }
 
-void history_menu_view_annotation(struct menu_input_s *m)
+void do_global_redraw ()
 {
-    GAME g = m->data;
-
-    // FIXME RAV
-    view_annotation(g->history[m->selected]);
+    do_window_resize ();
 }
 
-void history_menu_annotate_finalize(WIN *win)
+void stop_clock()
 {
-    struct input_data_s *in = win->data;
-    GAME g = in->moredata;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-
-    really_do_annotate_finalize(in, d);
-    free_history_menu_data(hm);
-    hm = NULL;
-    get_history_data(g->history, &hm, 0, TEST_FLAG(g->flags, GF_BLACK_OPENING));
-    d->data = hm;
-    pushkey = REFRESH_MENU;
+    memset(&clock_timer, 0, sizeof(struct itimerval));
+    setitimer(ITIMER_REAL, &clock_timer, NULL);
 }
 
-void history_menu_annotate(struct menu_input_s *m)
+void start_clock(GAME g)
 {
-    GAME g = m->data;
-    char buf[COLS - 4];
-    struct input_data_s *in;
-    HISTORY *hp = g->history[m->selected]; // FIXME RAV
+    struct userdata_s *d = g->data;
 
-    snprintf(buf, sizeof(buf), "%s \"%s\"", _("Editing Annotation for"), hp->move);
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->data = hp;
-    in->moredata = m->data;
-    in->efunc = history_menu_annotate_finalize;
-    construct_input(buf, hp->comment, MAX_PGN_LINE_LEN / INPUT_WIDTH, 0,
-	    _("Type CTRL-t to edit NAG"), edit_nag, NULL, CTRL_KEY('T'), in, -1, -1);
-}
+    if (clock_timer.it_interval.tv_usec)
+	return;
 
-void history_menu_details(struct menu_input_s *m)
-{
-    do_board_details();
+    memset(&d->elapsed, 0, sizeof(struct timeval));
+    clock_timer.it_value.tv_sec = 0;
+    clock_timer.it_value.tv_usec = 100000;
+    clock_timer.it_interval.tv_sec = 0;
+    clock_timer.it_interval.tv_usec = 100000;
+    setitimer(ITIMER_REAL, &clock_timer, NULL);
 }
 
-// FIXME RAV
-void history_menu_print(WIN *win)
+static void update_clocks()
 {
-    struct menu_input_s *m = win->data;
-    GAME g = m->data;
-    struct userdata_s *d = g->data;
-    struct history_menu_s **hm = d->data;
-    struct history_menu_s *h = hm[m->top];
     int i;
-    char *p = m->item->name;
-    int line = m->print_line - 2;
-/*
- * Solaris 5.9 doesn't have wattr_get() or any function that requires an
- * attr_t data type.
- */
-    attr_t attrs;
-    short pair;
-    int total;
+    struct userdata_s *d;
+    struct itimerval it;
+    int update = 0;
 
-    for (total = 0; hm[total]; total++);
-    wattr_get(win->w, &attrs, &pair, NULL);
-    wattroff(win->w, COLOR_PAIR(pair));
-    mvwaddch(win->w, m->print_line, 1,
-	    *p == 'W' ? *p | mix_cp(CP_BOARD_WHITE, CP_HISTORY_WINDOW, ATTRS(CP_BOARD_WHITE), A_FG_B_BG) : *p | mix_cp(CP_BOARD_BLACK, CP_HISTORY_WINDOW, ATTRS(CP_BOARD_BLACK), A_FG_B_BG));
-    p++;
+    getitimer(ITIMER_REAL, &it);
 
-    if (h->hindex == 0 && line == 0)
-	waddch(win->w, ACS_ULCORNER | CP_HISTORY_MENU_LG);
-    else if ((!hm[h->hindex + (win->rows - 5) + 1] && line == win->rows - 5) ||
-	    (m->top + line == total - 1))
-	waddch(win->w, ACS_LLCORNER | CP_HISTORY_MENU_LG);
-    else if (hm[m->top + 1]->ravlevel != h->ravlevel || !h->ravlevel)
-	waddch(win->w, ACS_LTEE | CP_HISTORY_MENU_LG);
-    else
-	waddch(win->w, ACS_VLINE | CP_HISTORY_MENU_LG);
+    for (i = 0; i < gtotal; i++) {
+	d = game[i]->data;
 
-    wattron(win->w, COLOR_PAIR(pair) | attrs);
+	if (d && d->mode == MODE_PLAY) {
+	    if (d->paused == 1 || TEST_FLAG(d->flags, CF_NEW))
+		continue;
+	    else if (d->paused == -1) {
+		if (game[i]->side == game[i]->turn) {
+		    d->paused = 1;
+		    continue;
+		}
+	    }
 
-    for (i = 2; *p; p++, i++)
-	waddch(win->w, (*p == '!') ? *p | A_BOLD : *p);
+	    update_clock(i, it);
 
-    while (i++ < win->cols - 2)
-	waddch(win->w, ' ');
+	    if (game[i] == gp)
+		update = 1;
+	}
+    }
+
+    /*
+     * Called from the SIGALRM handler. Drawing is left to game_loop().
+     */
+    if (update)
+	frame_dirty |= FRAME_STATUS;
 }
 
-void history_menu(GAME g)
+#define SKIP_SPACE(str) { while (isspace(*str)) str++; }
+
+static int parse_clock_time(char **str)
 {
-    struct menu_key_s **keys = NULL;
+    char *p = *str;
+    int n = 0, t = 0;
 
-    add_menu_key(&keys, KEY_ESCAPE, history_menu_quit);
-    add_menu_key(&keys, 'M', history_menu_quit);
-    add_menu_key(&keys, KEY_UP, history_menu_prev);
-    add_menu_key(&keys, KEY_DOWN, history_menu_next);
-    add_menu_key(&keys, KEY_F(1), history_menu_help);
-    add_menu_key(&keys, CTRL_KEY('a'), history_menu_annotate);
-    add_menu_key(&keys, CTRL_KEY('d'), history_menu_details);
-    add_menu_key(&keys, '\n', history_menu_view_annotation);
-    construct_menu(MEGA_BOARD ? LINES - HISTORY_HEIGHT_MB : LINES,
-			TAG_WIDTH, 0, config.boardleft ? BOARD_WIDTH : 0,
-			_("Move History Tree"), 1, get_history_items, keys, g,
-			history_menu_print, history_menu_exit);
-}
+    SKIP_SPACE(p);
 
-void do_history_menu()
-{
-    history_menu(gp);
-}
+    if (!isdigit(*p))
+	return -1;
 
-void do_history_half_move_toggle()
-{
-    movestep = (movestep == 1) ? 2 : 1;
-    update_history_window(gp);
-}
+    while (*p) {
+	if (isdigit(*p)) {
+	    t = atoi(p);
 
-void do_history_rotate_board()
-{
-    struct userdata_s *d = gp->data;
-    d->rotate = !d->rotate;
-}
+	    while (isdigit(*p))
+		p++;
 
-void do_history_jump_next()
-{
-    struct userdata_s *d = gp->data;
+	    continue;
+	}
 
-    pgn_history_next(gp, d->b, (keycount > 0) ?
-	    config.jumpcount * keycount * movestep :
-	    config.jumpcount * movestep);
-}
+	switch (*p) {
+	    case 'H':
+	    case 'h':
+		n += t * (60 * 60);
+		t = 0;
+		break;
+	    case 'M':
+	    case 'm':
+		n += t * 60;
+		t = 0;
+		break;
+	    case 'S':
+	    case 's':
+		n += t;
+		t = 0;
+		break;
+	    case ' ':
+		p++;
+	    case '/':
+	    case '+':
+		goto done;
+	    default:
+		*str = p;
+		return -1;
+	}
 
-void do_history_jump_prev()
-{
-    struct userdata_s *d = gp->data;
+	p++;
+    }
 
-    pgn_history_prev(gp, d->b, (keycount) ?
-	    config.jumpcount * keycount * movestep :
-	    config.jumpcount * movestep);
+done:
+    n += t;
+    *str = p;
+    return n;
 }
 
-void do_history_prev()
+static int parse_clock_input(struct clock_s *clk, char *str, int *incr)
 {
-    struct userdata_s *d = gp->data;
+    char *p = str;
+    long n = 0;
+    int plus = 0;
+    int m = 0;
+    int tc = 0;
 
-    pgn_history_prev(gp, d->b,
-	    (keycount) ? keycount * movestep : movestep);
-}
+    SKIP_SPACE(p);
 
-void do_history_next()
-{
-    struct userdata_s *d = gp->data;
+    if (!*p)
+	return 0;
 
-    pgn_history_next(gp, d->b, (keycount) ?
-	    keycount * movestep : movestep);
-}
+    if (*p == '+') {
+	plus = 1;
+	p++;
+	SKIP_SPACE(p);
 
-void do_history_mode_finalize(struct userdata_s *d)
-{
-    pushkey = 0;
-    d->mode = MODE_PLAY;
-}
+	if (*p == '+')
+	    goto move_incr;
+    }
+    else
+	memset(clk, 0, sizeof(struct clock_s));
 
-void do_history_mode_confirm(WIN *win)
-{
-    struct userdata_s *d = gp->data;
-    wchar_t str[] = { win->c, 0 };
+again:
+    /* Sudden death. */
+    if (strncasecmp(p, "SD", 2) == 0) {
+	n = 0;
+	p += 2;
+	goto tc;
+    }
 
-    if (!wcscmp (str, resume_wchar)) {
-        pgn_history_free(gp->hp, gp->hindex);
-	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+    n = parse_clock_time(&p);
+
+    if (n == -1)
+	return 1;
+
+    if (!n)
+	goto done;
+
+    /* Time control. */
+tc:
+    if (*p == '/') {
+	if (plus)
+	    return 1;
+
+	/* Sudden death without a previous time control. */
+	if (!n && !tc)
+	    return 1;
+
+	m = n;
+	p++;
+	n = parse_clock_time(&p);
+
+	if (n == -1)
+	    return 1;
+
+	if (tc >= MAX_TC) {
+	    if (curses_initialized)
+		message(ERROR_STR, ANY_KEY_STR, "%s (%i)", _("Maximum number of time controls reached"), MAX_TC);
+	    else
+		warnx("%s (%i)", _("Maximum number of time controls reached"), MAX_TC);
+
+	    return 1;
+	}
+
+	clk->tc[tc][0] = m;
+	clk->tc[tc++][1] = n;
+	SKIP_SPACE(p);
+
+	if (*p == '+')
+	    goto move_incr;
+
+	if (*p)
+	    goto again;
+
+	goto done;
     }
-#if 0
-	case 'C':
-	case 'c':
-	    if (pgn_history_rav_new(gp, d->b,
-			gp->hindex) != E_PGN_OK)
-		return;
 
-	    break;
-#endif
-     else
-         return;
+    if (plus)
+	*incr = n;
+    else
+	clk->tc[clk->tcn][1] = (n <= clk->elapsed.tv_sec) ? clk->elapsed.tv_sec + n : n;
 
-    if (!TEST_FLAG(d->flags, CF_HUMAN)) {
-        char *fen =  pgn_game_to_fen(gp, d->b);
+move_incr:
+    if (*p) {
+	if (*p++ == '+') {
+	    if (!isdigit(*p))
+		return 1;
 
-	add_engine_command(gp, ENGINE_READY, "setboard %s\n", fen);
-	free (fen);
+	    n = parse_clock_time(&p);
+
+	    if (n == -1 || *p)
+		return 1;
+
+	    clk->incr = n;
+
+	    SKIP_SPACE(p);
+
+	    if (*p)
+		return 1;
+	}
+	else
+	    return 1;
     }
 
-    do_history_mode_finalize(d);
+done:
+    return 0;
 }
 
-void do_history_toggle()
+static int parse_which_clock(struct clock_s *clk, char *str)
 {
-    struct userdata_s *d = gp->data;
+    struct clock_s tmp;
+    int incr = 0;
 
-    // FIXME Resuming from previous history could append to a RAV.
-    if (gp->hindex != pgn_history_total(gp->hp)) {
-	if (!pushkey)
-	    construct_message(NULL, _ ("What would you like to do?"), 0, 1,
-			      NULL, NULL, NULL, do_history_mode_confirm, 0, 0,
-			      _("The current move is not the final move of this round. Press \"%ls\" to resume a game from the current move and discard future moves or any other key to cancel."),
-			      resume_wchar);
-	return;
-    }
-    else {
-	if (TEST_FLAG(gp->flags, GF_GAMEOVER))
-	    return;
-    }
+    memcpy(&tmp, clk, sizeof(struct clock_s));
 
-    if (gp->side != gp->turn) {
-        d->play_mode = PLAY_EH;
-    }
-    else {
-        d->play_mode = PLAY_HE;
-	d->rotate = FALSE;
+    if (parse_clock_input(&tmp, str, &incr)) {
+	cmessage(ERROR_STR, ANY_KEY_STR, _("Invalid clock specification"));
+	return 1;
     }
 
-    do_history_mode_finalize(d);
+    memcpy(clk, &tmp, sizeof(struct clock_s));
+    clk->tc[clk->tcn][1] += incr;
+    return 0;
 }
 
-void do_history_annotate()
+void do_clock_input_finalize(WIN *win)
 {
-    int n = gp->hindex;
+    struct userdata_s *d = gp->data;
+    struct input_data_s *in = win->data;
+    char *p = in->str;
 
-    if (n && gp->hp[n - 1]->move)
-	n--;
-    else
+    if (!in->str) {
+	free(in);
 	return;
+    }
 
-    do_annotate_move(gp->hp[n]);
-}
+    SKIP_SPACE(p);
 
-void do_history_help()
-{
-    wchar_t *buf = build_help(history_keys);
+    if (tolower(*p) == 'w') {
+	p++;
 
-    construct_message(_("History Mode Keys (* = can take a repeat count)"),
-		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL,
-		      buf, do_more_help, 0, 1, "%ls", buf);
+	if (parse_which_clock(&d->wclock, p))
+	    goto done;
+    }
+    else if (tolower(*p) == 'b') {
+	p++;
+
+	if (parse_which_clock(&d->bclock, p))
+	    goto done;
+    }
+    else {
+	if (parse_which_clock(&d->wclock, p))
+	    goto done;
+
+	if (parse_which_clock(&d->bclock, p))
+	    goto done;
+    }
+
+    if (!d->wclock.tc[0][1] && !d->bclock.tc[0][1])
+	CLEAR_FLAG(d->flags, CF_CLOCK);
+    else
+	SET_FLAG(d->flags, CF_CLOCK);
+
+done:
+    free(in->str);
+    free(in);
 }
 
-void do_history_find(int which)
+void do_engine_command_finalize(WIN *win)
 {
-    struct input_data_s *in;
-    int *p;
+    struct userdata_s *d = gp->data;
+    struct input_data_s *in = win->data;
+    int x;
 
-    if (pgn_history_total(gp->hp) < 2)
+    if (!in->str) {
+	free(in);
 	return;
+    }
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    p = Malloc(sizeof(int));
-    *p = which;
-    in->data = p;
-    in->efunc = do_find_move_exp;
+    if (!d->engine)
+	goto done;
 
-    if (!*moveexp || which == 0) {
-	construct_input(_("Find Move Text Expression"), NULL, 1, 0, NULL, NULL, NULL,
-		0, in, INPUT_HIST_MOVE_EXP, -1);
-	return;
-    }
+    x = d->engine->status;
+    send_to_engine(gp, -1, "%s\n", in->str);
+    d->engine->status = x;
 
-    free(p);
+done:
+    free(in->str);
     free(in);
-    do_find_move_exp_finalize(0, which);
 }
 
-void do_history_find_new()
+void do_board_details()
 {
-    do_history_find(0);
+    config.details = (config.details) ? 0 : 1;
 }
 
-void do_history_find_prev()
+void do_toggle_strict_castling()
 {
-    do_history_find(-1);
+    int n;
+
+    pgn_config_get(PGN_STRICT_CASTLING, &n);
+
+    if (n == 0)
+	pgn_config_set(PGN_STRICT_CASTLING, 1);
+    else
+	pgn_config_set(PGN_STRICT_CASTLING, 0);
 }
 
-void do_history_find_next()
+void do_play_set_clock()
 {
-    do_history_find(1);
+    struct input_data_s *in;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->efunc = do_clock_input_finalize;
+    construct_input(_("Set Clock"), NULL, 1, 1,
+		    _ ("Format: [W | B] [+]T[+I] | ++I | M/T [M/T [...] [SD/T]] [+I]\n" \
+		       "T = time (hms), I = increment, M = moves per, SD = sudden death\ne.g., 30m or 4m+12s or 35/90m SD/30m"),
+		    NULL, NULL, 0, in, INPUT_HIST_CLOCK, -1);
 }
 
-void do_history_rav(int which)
+void do_play_toggle_human()
 {
     struct userdata_s *d = gp->data;
 
-    rav_next_prev(gp, d->b, which);
-}
+    TOGGLE_FLAG(d->flags, CF_HUMAN);
 
-void do_history_rav_next()
-{
-    do_history_rav(1);
+    if (!TEST_FLAG(d->flags, CF_HUMAN) && pgn_history_total(gp->hp)) {
+	if (lease_engine(gp) || init_chess_engine(gp))
+	    return;
+    }
+
+    CLEAR_FLAG(d->flags, CF_ENGINE_LOOP);
+
+    if (d->engine)
+	d->engine->status = ENGINE_READY;
 }
 
-void do_history_rav_prev()
+void do_play_toggle_engine()
 {
-    do_history_rav(0);
+    struct userdata_s *d = gp->data;
+
+    TOGGLE_FLAG(d->flags, CF_ENGINE_LOOP);
+    CLEAR_FLAG(d->flags, CF_HUMAN);
+
+    if (d->engine && TEST_FLAG(d->flags, CF_ENGINE_LOOP)) {
+        char fen[FEN_MAX];
+
+	board_to_fen(gp, d->b, fen);
+	pgn_board_update(gp, d->b,
+		pgn_history_total(gp->hp));
+	add_engine_command(gp, ENGINE_READY, "setboard %s\n", fen);
+    }
 }
 
-void do_history_jump()
+/*
+ * This will send a command to the engine skipping the command queue.
+ */
+void do_play_send_command()
 {
+    struct userdata_s *d = gp->data;
     struct input_data_s *in;
 
-    if (pgn_history_total(gp->hp) < 2)
+    if (lease_engine(gp))
 	return;
 
-    if (!keycount) {
-	in = Calloc(1, sizeof(struct input_data_s));
-	in->efunc = do_move_jump;
-
-	construct_input(_("Jump to Move Number"), NULL, 1, 1, NULL,
-		NULL, NULL, 0, in, -1, 0);
-	return;
+    if (!d->engine || d->engine->status == ENGINE_OFFLINE) {
+	if (init_chess_engine(gp))
+	    return;
     }
 
-    do_move_jump_finalize(keycount);
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->efunc = do_engine_command_finalize;
+    construct_input(_("Engine Command"), NULL, 1, 1, NULL, NULL, NULL, 0, in, INPUT_HIST_ENGINE, -1);
 }
-
-static void free_userdata_once(GAME g)
+/*
+void do_play_switch_turn()
 {
-    struct userdata_s *d = g->data;
+    struct userdata_s *d = gp->data;
 
-    if (!d)
-	return;
+    pgn_switch_side(gp);
+    pgn_switch_turn(gp);
 
-    if (d->engine) {
-	stop_engine(g);
+    if (!TEST_FLAG(d->flags, CF_HUMAN))
+	add_engine_command(gp, -1,
+		(gp->side == WHITE) ? "white\n" : "black\n");
 
-	if (d->engine->enginebuf) {
-	    int n;
+    update_status_window(gp);
+}
+*/
+void do_play_toggle_eh_mode()
+{
+    struct userdata_s *d = gp->data;
 
-	    for (n = 0; d->engine->enginebuf[n]; n++)
-		free(d->engine->enginebuf[n]);
+    if (!TEST_FLAG(d->flags, CF_HUMAN)) {
+        if (!gp->hindex){
+	    pgn_switch_side(gp, TRUE);
+	    d->play_mode = (d->play_mode) ? PLAY_HE : PLAY_EH;
+	    if (gp->side == BLACK)
+	        update_status_notify(gp, _("Press 'g' to start the game"));
 
-	    free(d->engine->enginebuf);
+	    d->rotate = !d->rotate;
 	}
+	else
+	    message(NULL, ANY_KEY_STR,
+		    _("You may only switch sides at the start of the \n"
+		      "game. Press ^K or ^N to begin a new game."));
+    }
+}
 
-	if (d->engine->queue) {
-	    struct queue_s **q;
+void do_play_undo()
+{
+    struct userdata_s *d = gp->data;
 
-	    for (q = d->engine->queue; *q; q++)
-		free(*q);
+    if (!pgn_history_total(gp->hp))
+	return;
 
-	    free(d->engine->queue);
+    if (keycount) {
+        if (gp->hindex - keycount < 0)
+	    gp->hindex = 0;
+	else {
+	    if (d->go_move)
+	        gp->hindex -= (keycount * 2) -1;
+	    else
+	        gp->hindex -= keycount * 2;
+	}
+    }
+    else {
+        if (gp->hindex - 2 < 0)
+	    gp->hindex = 0;
+	else {
+	    if (d->go_move)
+	        gp->hindex -= 1;
+	    else
+	        gp->hindex -= 2;
 	}
-
-	free(d->engine);
     }
 
-#ifdef WITH_LIBPERL
-    if (d->perlfen)
-	free(d->perlfen);
+    forget_positions(gp);
+    moves_changed(gp);
+    pgn_history_free(gp->hp, gp->hindex);
+    gp->hindex = pgn_history_total(gp->hp);
+    pgn_board_update(gp, d->b, gp->hindex);
 
-    if (d->oldfen)
-	free(d->oldfen);
-#endif
+    if (d->engine && d->engine->status == ENGINE_READY) {
+        char fen[FEN_MAX];
 
-    free(d);
-    g->data = NULL;
-}
+        add_engine_command(gp, ENGINE_READY, "setboard %s\n",
+		board_to_fen(gp, d->b, fen));
+	d->engine->status = ENGINE_READY;
+    }
 
-static void free_userdata()
-{
-    int i;
+    update_history_window(gp);
 
-    for (i = 0; i < gtotal; i++) {
-	free_userdata_once(game[i]);
-	game[i]->data = NULL;
+    if (d->go_move) {
+        pgn_switch_side(gp, FALSE);
+	d->go_move--;
     }
+
+    d->pm_undo = TRUE;
 }
 
-void update_loading_window(int n)
+void do_play_toggle_pause()
 {
-    char buf[16];
+    struct userdata_s *d = gp->data;
 
-    if (!loadingw) {
-	loadingw = newwin(3, COLS / 2, CALCPOSY(3), CALCPOSX(COLS / 2));
-	loadingp = new_panel(loadingw);
-	wbkgd(loadingw, CP_MESSAGE_WINDOW);
+    if (!TEST_FLAG(d->flags, CF_HUMAN) && gp->turn !=
+	    gp->side) {
+	d->paused = -1;
+	return;
     }
 
-    wmove(loadingw, 0, 0);
-    wclrtobot(loadingw);
-    wattron(loadingw, CP_MESSAGE_BORDER);
-    box(loadingw, ACS_VLINE, ACS_HLINE);
-    wattroff(loadingw, CP_MESSAGE_BORDER);
-    mvwprintw(loadingw, 1, CENTER_INT((COLS / 2), 11 +
-				      strlen(itoa(gtotal, buf))),
-	      _("Loading... %i%% (%i games)"), n, gtotal);
-    update_panels();
-    doupdate();
+    d->paused = (d->paused) ? 0 : 1;
 }
 
-static void init_userdata_once(GAME g, int n)
+void do_play_go()
 {
-    struct userdata_s *d = NULL;
+    struct userdata_s *d = gp->data;
 
-    d = Calloc(1, sizeof(struct userdata_s));
-    d->n = n;
-    d->c_row = 2, d->c_col = 5;
-    SET_FLAG(d->flags, CF_NEW);
-    g->data = d;
+    if (TEST_FLAG(d->flags, CF_HUMAN) || lease_engine(gp))
+	return;
 
-    if (pgn_board_init_fen(g, d->b, NULL) != E_PGN_OK)
-	pgn_board_init(d->b);
-}
+    if (fm_loaded_file && gp->side != gp->turn) {
+        pgn_switch_side(gp, FALSE);
+	add_engine_command(gp, ENGINE_THINKING, "black\n");
+    }
 
-void init_userdata()
-{
-    int i;
+    add_engine_command(gp, ENGINE_THINKING, "go\n");
+
+    // Completa la función para que permita seguir jugando al usarla.
+    // Complete the function to allow continue playing when using.
+    if (gp->side == gp->turn)
+        pgn_switch_side(gp, FALSE);
 
-    for (i = 0; i < gtotal; i++)
-	init_userdata_once(game[i], i);
+    d->go_move++;
 }
 
-void fix_marks(int *start, int *end)
+void do_play_config_command()
 {
-    int i;
+    int x, w;
 
-    *start = (*start < 0) ? 0 : *start;
-    *end = (*end < 0) ? 0 : *end;
+    if (config.keys) {
+	for (x = 0; config.keys[x]; x++) {
+	    if (config.keys[x]->c == input_c)
+		break;
+	}
 
-    if (*start > *end) {
-	i = *start;
-	*start = *end;
-        *end = i + 1;
+	if (config.keys[x] && lease_engine(gp))
+	    return;
+
+	for (x = 0; config.keys[x]; x++) {
+	    if (config.keys[x]->c == input_c) {
+		switch (config.keys[x]->type) {
+		    case KEY_DEFAULT:
+			add_engine_command(gp, -1, "%ls\n",
+				config.keys[x]->str);
+			break;
+		    case KEY_SET:
+			if (!keycount)
+			    break;
+
+			add_engine_command(gp, -1,
+				"%ls %i\n", config.keys[x]->str, keycount);
+			keycount = 0;
+			break;
+		    case KEY_REPEAT:
+			if (!keycount)
+			    break;
+
+			for (w = 0; w < keycount; w++)
+			    add_engine_command(gp, -1,
+				    "%ls\n", config.keys[x]->str);
+			keycount = 0;
+			break;
+		}
+	    }
+	}
     }
 
-    *end = (*end > gtotal) ? gtotal : *end;
+    update_status_notify(gp, NULL);
 }
 
-void do_new_game_finalize(GAME g)
+void do_play_cancel_selected()
 {
-    struct userdata_s *d = g->data;
+    struct userdata_s *d = gp->data;
 
-    d->mode = MODE_PLAY;
-    update_status_notify(g, NULL);
-    d->rotate = FALSE;
-    d->go_move = 0;
+    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+    keycount = 0;
+    pgn_reset_valid_moves(d->b);
+    update_status_notify(gp, NULL);
 }
 
-void do_new_game_from_scratch(WIN *win)
+void do_play_commit()
 {
-    wchar_t str[] = {  win->c, 0 };
+    struct userdata_s *d = gp->data;
 
-    if (wcscmp (str, yes_wchar))
-        return;
+    pushkey = keycount = 0;
+    update_status_notify(gp, NULL);
 
-    stop_clock();
-    free_userdata();
-    pgn_parse(NULL);
-    gp = game[gindex];
-    add_custom_tags(&gp->tag);
-    init_userdata();
-    loadfile[0] = 0;
-    do_new_game_finalize(gp);
-}
+    if (!TEST_FLAG(d->flags, CF_HUMAN) &&
+	    (!d->engine || d->engine->status == ENGINE_THINKING))
+	return;
 
-void do_new_game()
-{
-    pgn_new_game();
-    gp = game[gindex];
-    add_custom_tags(&gp->tag);
-    init_userdata_once(gp, gindex);
-    do_new_game_finalize(gp);
+    if (!d->sp.icon)
+	return;
+
+    d->sp.row = d->c_row;
+    d->sp.col = d->c_col;
+
+    if (d->rotate) {
+        rotate_position(&d->sp.row, &d->sp.col);
+	rotate_position(&d->sp.srow, &d->sp.scol);
+    }
+
+    move_to_engine(gp);
+
+    // Completa la función para que permita seguir jugando cuando se carga un
+    // archivo pgn (con juego no terminado) que inicie con turno del lado
+    // negro.
+    // Complete the function to allow continue playing when loading a file
+    // pgn (with unfinished game) you start to turn black side.
+    if (gp->side != gp->turn)
+        pgn_switch_side(gp, FALSE);
+
+    if (d->rotate && d->sp.icon)
+        rotate_position(&d->sp.srow, &d->sp.scol);
+
+    // Envia comando 'go' a Polyglot en el primer movimiento  debido a que
+    // polyglot no envia el movimiento y cboard se queda esperando.
+    // Send command 'go' to the first movement Polyglot  because cboard
+    // waits to send polyglot movement and this does not make.
+    if (config.fmpolyglot &&
+	((gp->side == WHITE && !gp->hindex) || fm_loaded_file))
+	add_engine_command(gp, ENGINE_THINKING, "go\n");
+
+    d->go_move = 0;
+    fm_loaded_file = FALSE;
+    d->pm_undo = FALSE;
+}
+
+void do_play_select()
+{
+    struct userdata_s *d = gp->data;
+
+    if (!TEST_FLAG(d->flags, CF_HUMAN) && (!d->engine ||
+		d->engine->status == ENGINE_OFFLINE)) {
+	if (lease_engine(gp) || init_chess_engine(gp))
+	    return;
+    }
+
+    if (d->engine && d->engine->status == ENGINE_THINKING)
+	return;
+
+    if (d->sp.icon)
+      do_play_cancel_selected ();
+
+    if (d->rotate)
+        rotate_position(&d->c_row, &d->c_col);
+
+    d->sp.icon = d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon;
+
+    if (pgn_piece_to_int(d->sp.icon) == OPEN_SQUARE) {
+	d->sp.icon = 0;
+	return;
+    }
+
+    if (((islower(d->sp.icon) && gp->turn != BLACK)
+		|| (isupper(d->sp.icon) && gp->turn != WHITE))) {
+        struct key_s **k;
+        char *str = Malloc (512);
+
+	for (k = play_keys; *k; k++) {
+	  if ((*k)->f == do_play_toggle_eh_mode)
+	        break;
+	}
+
+	snprintf (str, 512,  _("It is not your turn to move. You may switch playing sides by pressing \"%lc\"."),
+		  *k ? (*k)->c : '?');
+	message(NULL, ANY_KEY_STR, "%s", str);
+	free (str);
+	d->sp.icon = 0;
+	return;
+#if 0
+	if (pgn_history_total(gp->hp)) {
+	    message(NULL, ANY_KEY_STR, "%s", _("It is not your turn to move. You can switch sides "));
+	    d->sp.icon = 0;
+	    return;
+	}
+	else {
+	    if (pgn_tag_find(gp->tag, "FEN") != E_PGN_ERR)
+		return;
+
+	    add_engine_command(gp, ENGINE_READY, "black\n");
+	    pgn_switch_turn(gp);
+
+	    if (gp->side != BLACK)
+		pgn_switch_side(gp);
+	}
+#endif
+    }
+
+    d->sp.srow = d->c_row;
+    d->sp.scol = d->c_col;
+
+    if (config.validmoves)
+	pgn_find_valid_moves(gp, d->b, d->sp.scol, d->sp.srow);
+
+    if (d->rotate) {
+        rotate_position(&d->c_row, &d->c_col);
+	rotate_position(&d->sp.srow, &d->sp.scol);
+    }
+
+    CLEAR_FLAG(d->flags, CF_NEW);
+    start_clock(gp);
+}
+
+static wchar_t *build_help(struct key_s **keys)
+{
+    int i, nlen = 1, len, t, n;
+    wchar_t *buf = NULL, *wc = NULL;
+    wchar_t *p;
+
+    if (!keys)
+	return NULL;
+
+    for (i = len = t = 0; keys[i]; i++) {
+	if (!keys[i]->d)
+	    continue;
+
+	if (keys[i]->key) {
+	    if (wcslen(keys[i]->key) > nlen) {
+		nlen = wcslen(keys[i]->key);
+		t += nlen;
+	    }
+	    else
+		t++;
+	}
+	else
+	    t++;
+
+	if (keys[i]->d) {
+	    if (wcslen(keys[i]->d) > len)
+		len = wcslen(keys[i]->d);
+	}
+
+	t += len;
+	t += keys[i]->r;
+    }
+
+    t += 4 + i + 1;
+    buf = Malloc((t+1)*sizeof(wchar_t));
+    p = buf;
+
+    for (i = 0; keys[i]; i++) {
+	if (!keys[i]->d)
+	    continue;
+
+	if (keys[i]->key)
+	    n = wcslen(keys[i]->key);
+	else
+	    n = 1;
+
+	while (n++ <= nlen)
+	    *p++ = ' ';
+
+	*p = 0;
+
+	if (keys[i]->key) {
+	    wcsncat(buf, keys[i]->key, t-1);
+	    p = buf + wcslen(buf);
+	}
+	else
+	    *p++ = keys[i]->c;
+
+	*p++ = ' ';
+	*p++ = '-';
+	*p++ = ' ';
+	*p = 0;
+
+	if (keys[i]->d)
+	    wcsncat(buf, keys[i]->d, t-1);
+
+	if (keys[i]->r) {
+	    wc = str_to_wchar ("*");
+	    wcsncat(buf, wc, t-1);
+	    free (wc);
+	}
+
+	wc = str_to_wchar ("\n");
+	wcscat(buf, wc);
+	free (wc);
+	p = buf + wcslen(buf);
+    }
+
+    return buf;
+}
+
+void do_global_help ()
+{
+    wchar_t *buf = build_help(global_keys);
+
+    construct_message(_("Global Game Keys (* = can take a repeat count)"),
+		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL, buf, do_more_help,
+		      0, 1, "%ls", buf);
+}
+
+void do_main_help(WIN *win)
+{
+    switch (win->c) {
+	case 'p':
+	    do_play_help ();
+	    break;
+	case 'h':
+	    do_history_help ();
+	    break;
+	case 'e':
+	    do_edit_help ();
+	    break;
+	case 'g':
+	    do_global_help ();
+	    break;
+	default:
+	    break;
+    }
+}
+
+static void do_more_help(WIN *win)
+{
+    if (win->c == KEY_F(1) || win->c == CTRL_KEY('g'))
+      construct_message(_("Command Key Index"),
+			_ ("p/h/e/g or any other key to quit"), 0, 0,
+			NULL, NULL, NULL, do_main_help, 0, 0, "%s",
+			_ (
+			   "p - play mode keys\n"
+			   "h - history mode keys\n"
+			   "e - board edit mode keys\n"
+			   "g - global game keys"
+			   ));
+}
+
+void do_play_help()
+{
+    wchar_t *buf = build_help(play_keys);
+
+    construct_message(_("Play Mode Keys (* = can take a repeat count)"),
+		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL,
+		      buf, do_more_help, 0, 1, "%ls", buf);
+}
+
+void do_play_history_mode()
+{
+    struct userdata_s *d = gp->data;
+    int total = pgn_history_total(gp->hp);
+
+    if (!total || (d->engine && d->engine->status == ENGINE_THINKING))
+	return;
+
+    d->mode = MODE_HISTORY;
+    pgn_board_update(gp, d->b, total);
+}
+
+void do_play_edit_mode()
+{
+    struct userdata_s *d = gp->data;
+
+    if (pgn_history_total(gp->hp))
+	return;
+
+    pgn_board_init_fen(gp, d->b, NULL);
+    config.details++;
+    d->mode = MODE_EDIT;
+}
+
+void do_edit_insert_finalize(WIN *win)
+{
+    struct userdata_s *d = win->data;
+
+    if (pgn_piece_to_int(win->c) == -1)
+	return;
+
+    d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon = win->c;
+}
+
+void do_edit_select()
+{
+    struct userdata_s *d = gp->data;
+
+    if (d->sp.icon)
+	return;
+
+    d->sp.icon = d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon;
+
+    if (pgn_piece_to_int(d->sp.icon) == OPEN_SQUARE) {
+	d->sp.icon = 0;
+	return;
+    }
+
+    d->sp.srow = d->c_row;
+    d->sp.scol = d->c_col;
+}
+
+void do_edit_commit()
+{
+    int p;
+    struct userdata_s *d = gp->data;
+
+    pushkey = keycount = 0;
+    update_status_notify(gp, NULL);
+
+    if (!d->sp.icon)
+	return;
+
+    d->sp.row = d->c_row;
+    d->sp.col = d->c_col;
+    p = d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon;
+    d->b[RANKTOBOARD(d->sp.row)][FILETOBOARD(d->sp.col)].icon = p;
+    d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon =
+	pgn_int_to_piece(gp->turn, OPEN_SQUARE);
+    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+}
+
+void do_edit_delete()
+{
+    struct userdata_s *d = gp->data;
+
+    if (d->sp.icon)
+	d->b[RANKTOBOARD(d->sp.srow)][FILETOBOARD(d->sp.scol)].icon =
+	    pgn_int_to_piece(gp->turn, OPEN_SQUARE);
+    else
+	d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon =
+	    pgn_int_to_piece(gp->turn, OPEN_SQUARE);
+
+    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+}
+
+void do_edit_cancel_selected()
+{
+    struct userdata_s *d = gp->data;
+
+    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+    keycount = 0;
+    update_status_notify(gp, NULL);
+}
+
+void do_edit_switch_turn()
+{
+    pgn_switch_turn(gp);
+}
+
+void do_edit_toggle_castle()
+{
+    struct userdata_s *d = gp->data;
+
+    castling_state(gp, d->b, RANKTOBOARD(d->c_row),
+	    FILETOBOARD(d->c_col),
+	    d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].icon, 1);
+}
+
+void do_edit_insert()
+{
+    struct userdata_s *d = gp->data;
+
+    construct_message(_("Insert Piece"), _("P=pawn, R=rook, N=knight, B=bishop, "), 0, 0, NULL, NULL,
+	    d->b, do_edit_insert_finalize, 0, 0, "%s", _("Type the piece letter to insert. Lowercase "));
+}
+
+void do_edit_enpassant()
+{
+    struct userdata_s *d = gp->data;
+
+    if (d->c_row == 6 || d->c_row == 3) {
+	pgn_reset_enpassant(d->b);
+	d->b[RANKTOBOARD(d->c_row)][FILETOBOARD(d->c_col)].enpassant = 1;
+    }
+}
+
+void do_edit_help()
+{
+    wchar_t *buf = build_help(edit_keys);
+
+    construct_message(_("Edit Mode Keys (* = can take a repeat count)"),
+		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL, buf, do_more_help,
+		      0, 1, "%ls", buf);
+}
+
+void do_edit_exit()
+{
+    struct userdata_s *d = gp->data;
+    char *fen = pgn_game_to_fen(gp, d->b);
+
+    config.details--;
+    pgn_tag_add(&gp->tag, "FEN", fen);
+    free (fen);
+    pgn_tag_add(&gp->tag, "SetUp", "1");
+    pgn_tag_sort(gp->tag);
+    tags_changed(gindex);
+    pgn_board_update(gp, d->b, gp->hindex);
+    d->mode = MODE_PLAY;
+}
+
+void really_do_annotate_finalize(struct input_data_s *in,
+	struct userdata_s *d)
+{
+    HISTORY *h = in->data;
+    int len;
+
+    if (!in->str) {
+	if (h->comment) {
+	    free(h->comment);
+	    h->comment = NULL;
+	}
+    }
+    else {
+	len = strlen(in->str);
+	h->comment = Realloc(h->comment, len+1);
+	strncpy(h->comment, in->str, len);
+	h->comment[len] = 0;
+    }
+
+    free(in->str);
+    free(in);
+    SET_FLAG(d->flags, CF_MODIFIED);
+}
+
+void do_annotate_finalize(WIN *win)
+{
+    struct userdata_s *d = gp->data;
+    struct input_data_s *in = win->data;
+
+    really_do_annotate_finalize(in, d);
+}
+
+void do_find_move_exp_finalize(int init, int which)
+{
+    int n;
+    struct userdata_s *d = gp->data;
+    static int firstrun;
+    static regex_t r;
+    int ret;
+    char errbuf[255];
+
+    if (init || !firstrun) {
+	if (!firstrun)
+	    regfree(&r);
+
+	if ((ret = regcomp(&r, moveexp, REG_EXTENDED|REG_NOSUB)) != 0) {
+	    regerror(ret, &r, errbuf, sizeof(errbuf));
+	    cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
+	    return;
+	}
+
+	firstrun = 1;
+    }
+
+    if ((n = find_move_exp(gp, r,
+		    (which == -1) ? 0 : 1, (keycount) ? keycount : 1)) == -1)
+	return;
+
+    gp->hindex = n;
+    history_board_update(gp, d->b, gp->hindex);
+}
+
+void do_find_move_exp(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    int *n = in->data;
+    int which = *n;
+
+    if (in->str) {
+	strncpy(moveexp, in->str, sizeof(moveexp)-1);
+	moveexp[sizeof(moveexp)-1] = 0;
+	do_find_move_exp_finalize(1, which);
+	free(in->str);
+    }
+
+    free(in->data);
+    free(in);
+}
+
+#define MAX_MOVE_RESULTS	1000
+
+/*
+ * Results of the last move search across games. Games are remembered by
+ * pointer too since games may be deleted before a result is selected.
+ */
+struct move_result_s {
+    GAME g;
+    int game;
+    int node;
+};
+
+static struct move_result_s *move_results;
+static int move_results_total;
+static int move_results_selected;
+
+/*
+ * Called when moves were added to or removed from any line of game 'g'.
+ * Forgets its move index and drops its search results since their node
+ * numbers may now point to other moves.
+ */
+static void moves_changed(GAME g)
+{
+    int i, n;
+
+    for (i = 0; i < move_index_total; i++) {
+	if (move_index[i].g == g)
+	    free_move_index_entry(&move_index[i]);
+    }
+
+    for (i = n = 0; i < move_results_total; i++) {
+	if (move_results[i].g != g)
+	    move_results[n++] = move_results[i];
+	else if (n < move_results_selected)
+	    move_results_selected--;
+    }
+
+    move_results_total = n;
+
+    if (move_results_selected >= n)
+	move_results_selected = (n) ? n - 1 : 0;
+}
+
+/*
+ * Whether 's' looks like a SAN move. Only used to tell a move sequence from
+ * a regular expression.
+ */
+static int is_san_move(const char *s)
+{
+    const char *p;
+
+    if (!strncmp(s, "O-O-O", 5))
+	s += 5;
+    else if (!strncmp(s, "O-O", 3))
+	s += 3;
+    else {
+	if (strchr("KQRBN", *s) && *s)
+	    s++;
+	else if (*s < 'a' || *s > 'h')
+	    return 0;
+
+	for (p = s; *s && strchr("abcdefgh12345678x", *s); s++);
+
+	if (s - p < 2 || !isdigit(*(s-1)))
+	    return 0;
+
+	if (*s == '=')
+	    s++;
+
+	if (*s && strchr("QRBN", *s))
+	    s++;
+    }
+
+    while (*s && strchr("+#!?", *s))
+	s++;
+
+    return !*s;
+}
+
+/*
+ * Parses a sequence of SAN moves with optional move numbers like
+ * "1. e4 c5 2. Nf3" into SAN IDs without check marks. Returns the number of
+ * moves, 0 if a move was never seen in any game or -1 if 'str' is not a
+ * move sequence.
+ */
+static int parse_move_sequence(const char *str, int *seq, int max)
+{
+    char buf[255], *tmp = buf, *tok;
+    int n = 0, unknown = 0;
+
+    strncpy(buf, str, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
+
+    while ((tok = strsep(&tmp, " \t")) != NULL) {
+	char *p = tok;
+
+	while (isdigit(*p))
+	    p++;
+
+	if (p != tok && *p == '.') {
+	    while (*p == '.')
+		p++;
+
+	    tok = p;
+	}
+
+	if (!*tok)
+	    continue;
+
+	if (!is_san_move(tok) || n == max)
+	    return -1;
+
+	for (p = tok + strlen(tok); p > tok && strchr("+#!?", *(p-1)); p--);
+	*p = 0;
+
+	if ((seq[n++] = strpool_find(&move_names, tok)) == -1)
+	    unknown = 1;
+    }
+
+    return (n && unknown) ? 0 : (n) ? n : -1;
+}
+
+/*
+ * Returns the game number of search result 'r' or -1 if it was deleted.
+ */
+static int move_result_game(struct move_result_s *r)
+{
+    int n;
+
+    if (r->game < gtotal && game[r->game] == r->g)
+	return r->game;
+
+    for (n = 0; n < gtotal; n++) {
+	if (game[n] == r->g)
+	    return n;
+    }
+
+    return -1;
+}
+
+/*
+ * Finds the line and move of search result 'r'. The caller frees
+ * w->path.
+ */
+static HISTORY *move_result_path(struct move_result_s *r, int n,
+	struct move_walk_s *w)
+{
+    HISTORY **h = game[n]->history;
+    int i;
+
+    memset(w, 0, sizeof(struct move_walk_s));
+    w->target = r->node;
+
+    if (r->node >= game_moves(n)->total
+	    || !move_index_walk(w, game[n]->history, -1))
+	return NULL;
+
+    for (i = 0; i < w->depth; i++)
+	h = h[w->path[i]]->rav;
+
+    return h[w->path[w->depth]];
+}
+
+static char *move_result_line(struct move_result_s *r)
+{
+    struct move_walk_s w;
+    const char *white, *black, *fen;
+    char buf[MAX_MENU_WIDTH + 1];
+    const char *p;
+    HISTORY *h;
+    int n = move_result_game(r);
+    int i, ply, num, black_move;
+
+    if (n == -1 || (h = move_result_path(r, n, &w)) == NULL) {
+	snprintf(buf, sizeof(buf), "%s", _("(deleted)"));
+	return strdup(buf);
+    }
+
+    /* A variation starts at the move it replaces. */
+    for (i = 0, ply = 0; i <= w.depth; i++)
+	ply += w.path[i];
+
+    if ((fen = game_tag_value(n, TAG_FEN)) != NULL
+	    && (p = strrchr(fen, ' ')) != NULL) {
+	ply += (atoi(p + 1) - 1) * 2;
+
+	if ((p = strchr(fen, ' ')) != NULL && p[1] == 'b')
+	    ply++;
+    }
+
+    num = ply / 2 + 1;
+    black_move = ply % 2;
+
+    white = game_tag_value(n, TAG_WHITE);
+    black = game_tag_value(n, TAG_BLACK);
+    snprintf(buf, sizeof(buf), "%5i  %s - %s  %i.%s%s%s", n + 1,
+	    (white) ? white : "?", (black) ? black : "?", num,
+	    (black_move) ? ".." : "", h->move,
+	    (w.depth) ? _(" (variation)") : "");
+    free(w.path);
+    return strdup(buf);
+}
+
+/*
+ * Selects the game of search result 'r' and moves to the result,
+ * descending into the variations on the way like '+' does.
+ */
+static void move_result_jump(struct move_result_s *r)
+{
+    struct userdata_s *d;
+    struct move_walk_s w;
+    int n = move_result_game(r);
+    int i;
+
+    if (n == -1 || move_result_path(r, n, &w) == NULL) {
+	update_status_notify(gp, "%s", _("The game no longer exists"));
+	return;
+    }
+
+    gindex = n;
+    gp = use_game(gindex);
+    d = gp->data;
+    d->mode = MODE_HISTORY;
+
+    while (!rav_next_prev(gp, d->b, 0));
+
+    for (i = 0; i < w.depth; i++) {
+	gp->hindex = (i) ? w.path[i] : w.path[i] + 1;
+	history_board_update(gp, d->b, gp->hindex);
+	rav_next_prev(gp, d->b, 1);
+    }
+
+    gp->hindex = w.path[w.depth] + 1;
+    pgn_board_update(gp, d->b, gp->hindex);
+    free(w.path);
+    update_status_notify(gp, NULL);
+}
+
+struct menu_item_s **get_move_result_items(WIN *win)
+{
+    struct menu_input_s *m = win->data;
+    struct menu_item_s **items;
+    int i;
+
+    if (m->items)
+	return m->items;
+
+    items = Malloc((move_results_total + 1) * sizeof(struct menu_item_s *));
+
+    for (i = 0; i < move_results_total; i++) {
+	items[i] = Calloc(1, sizeof(struct menu_item_s));
+	items[i]->name = move_result_line(&move_results[i]);
+    }
+
+    items[i] = NULL;
+    m->selected = move_results_selected;
+    m->items = items;
+    return items;
+}
+
+void move_result_print(WIN *win)
+{
+    struct menu_input_s *m = win->data;
+
+    mvwprintw(win->w, m->print_line, 1, "%-*s", win->cols - 2, m->item->name);
+}
+
+void move_results_quit(struct menu_input_s *m)
+{
+    move_results_selected = m->selected;
+    pushkey = -1;
+}
+
+void move_results_select(struct menu_input_s *m)
+{
+    move_results_quit(m);
+    move_result_jump(&move_results[m->selected]);
+}
+
+void move_results_help(struct menu_input_s *m)
+{
+    message(_("Move Search Results Keys"), ANY_KEY_STR, "%s",
+	    _ (
+	       "    UP/DOWN - previous/next menu item\n"
+	       "   HOME/END - first/last menu item\n"
+	       "  PGDN/PGUP - next/previous page\n"
+	       "      ENTER - jump to the move\n"
+	       "     ESCAPE - quit"
+	       ));
+}
+
+static void move_results_menu()
+{
+    struct menu_key_s **keys = NULL;
+
+    add_menu_key(&keys, KEY_ESCAPE, move_results_quit);
+    add_menu_key(&keys, '\n', move_results_select);
+    add_menu_key(&keys, KEY_F(1), move_results_help);
+    construct_menu(0, MAX_MENU_WIDTH, -1, -1, _("Move Search Results"), 1,
+	    get_move_result_items, keys, NULL, move_result_print, NULL);
+}
+
+static void find_moves(const char *str)
+{
+    struct tag_memo_s memo = {0};
+    regex_t r;
+    int seq[64];
+    int nseq, g, found = 0;
+
+    for (g = 0; g < gtotal; g++)
+	game_moves(g);
+
+    if ((nseq = parse_move_sequence(str, seq, 64)) == -1) {
+	char errbuf[255];
+	int ret;
+
+	if ((ret = regcomp(&r, str, REG_EXTENDED|REG_NOSUB)) != 0) {
+	    regerror(ret, &r, errbuf, sizeof(errbuf));
+	    cmessage(_("Error Compiling Regular Expression"), ANY_KEY_STR, "%s", errbuf);
+	    return;
+	}
+    }
+
+    free(move_results);
+    move_results = NULL;
+    move_results_total = move_results_selected = 0;
+
+    for (g = 0; nseq && g < gtotal; g++) {
+	struct move_index_s *x = &move_index[g];
+	int n;
+
+	for (n = 0; n < x->total; n++) {
+	    if (nseq == -1) {
+		if (!tag_memo_match(&memo, &r, &move_names, x->id[n]))
+		    continue;
+	    }
+	    else {
+		int i, p = n;
+
+		for (i = nseq - 1; i >= 0 && p != -1; i--, p = x->prev[p]) {
+		    if (move_norm[x->id[p]] != seq[i])
+			break;
+		}
+
+		if (i >= 0)
+		    continue;
+	    }
+
+	    if (found++ < MAX_MOVE_RESULTS) {
+		move_results = Realloc(move_results,
+			found * sizeof(struct move_result_s));
+		move_results[found - 1].g = game[g];
+		move_results[found - 1].game = g;
+		move_results[found - 1].node = n;
+		move_results_total = found;
+	    }
+	}
+    }
+
+    if (nseq == -1)
+	regfree(&r);
+
+    free(memo.m);
+
+    if (!found) {
+	update_status_notify(gp, "%s", _("No matches found"));
+	return;
+    }
+
+    if (found > MAX_MOVE_RESULTS)
+	update_status_notify(gp, _("Showing the first %i of %i matches"),
+		MAX_MOVE_RESULTS, found);
+
+    move_results_menu();
+}
+
+void do_find_moves(WIN *win)
+{
+    struct input_data_s *in = win->data;
+
+    if (in->str) {
+	find_moves(in->str);
+	free(in->str);
+    }
+
+    free(in);
+}
+
+void do_global_find_moves()
+{
+    struct input_data_s *in;
+
+    if (!gtotal)
+	return;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->efunc = do_find_moves;
+    construct_input(_("Find Moves in All Games"), NULL, 1, 0,
+	    _("SAN move sequence or move text expression"), NULL, NULL, 0,
+	    in, INPUT_HIST_MOVE_EXP, -1);
+}
+
+void do_global_move_results()
+{
+    if (move_results_total)
+	move_results_menu();
+}
+
+void do_move_jump_finalize(int n)
+{
+    struct userdata_s *d = gp->data;
+
+    if (n < 0 || n > (pgn_history_total(gp->hp) / 2))
+	return;
+
+    keycount = 0;
+    update_status_notify(gp, NULL);
+    gp->hindex = (n) ? n * 2 - 1 : n * 2;
+    history_board_update(gp, d->b, gp->hindex);
+}
+
+void do_move_jump(WIN *win)
+{
+    struct input_data_s *in = win->data;
+
+    if (!in->str || !isinteger(in->str)) {
+	if (in->str)
+	    free(in->str);
+
+	free(in);
+	return;
+    }
+
+    do_move_jump_finalize(atoi(in->str));
+    free(in->str);
+    free(in);
+}
+
+struct history_menu_s {
+    char *line;
+    int hindex;
+    int ravlevel;
+    int move;
+    int indent;
+};
+
+void free_history_menu_data(struct history_menu_s **h)
+{
+    int i;
+
+    if (!h)
+	return;
+
+    for (i = 0; h[i]; i++) {
+	free(h[i]->line);
+	free(h[i]);
+    }
+
+    free(h);
+}
+
+void get_history_data(HISTORY **hp, struct history_menu_s ***menu, int m,
+	int turn)
+{
+    int i, n = 0;
+    int t = pgn_history_total(hp);
+    char buf[MAX_SAN_MOVE_LEN + 4];
+    static int depth;
+    struct history_menu_s **hmenu = *menu;
+
+    if (hmenu)
+	for (n = 0; hmenu[n]; n++);
+    else
+	depth = 0;
+
+    for (i = 0; i < t; i++) {
+	hmenu = Realloc(hmenu, (n + 2) * sizeof(struct history_menu_s *));
+	hmenu[n] = Malloc(sizeof(struct history_menu_s));
+	snprintf(buf, sizeof(buf), "%c%s%s", (turn == WHITE) ? 'W' : 'B',
+		hp[i]->move, (hp[i]->comment || hp[i]->nag[0]) ? " !" : "");
+	hmenu[n]->line = strdup(buf);
+	hmenu[n]->hindex = i;
+	hmenu[n]->indent = 0;
+	hmenu[n]->ravlevel = depth;
+	hmenu[n]->move = (n && depth > hmenu[n-1]->ravlevel) ? m++ : m;
+	n++;
+	hmenu[n] = NULL;
+
+#if 0
+	if (hp[i]->rav) {
+	    depth++;
+	    get_history_data(hp[i]->rav, &hmenu, m, turn);
+	    for (n = 0; hmenu[n]; n++);
+	    depth--;
+
+	    if (depth)
+		m--;
+	}
+#endif
+
+	turn = (turn == WHITE) ? BLACK : WHITE;
+    }
+
+    *menu = hmenu;
+}
+
+void history_draw_update(struct menu_input_s *m)
+{
+    GAME g = m->data;
+    struct userdata_s *d = g->data;
+
+    g->hindex = m->selected + 1;
+    update_cursor(g, m->selected);
+    history_board_update(g, d->b, m->selected + 1);
+}
+
+struct menu_item_s **get_history_items(WIN *win)
+{
+    struct menu_input_s *m = win->data;
+    GAME g = m->data;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+    struct menu_item_s **items = m->items;
+    int i;
+
+    if (!hm) {
+	get_history_data(g->history, &hm, 0,
+		TEST_FLAG(g->flags, GF_BLACK_OPENING));
+	m->selected = g->hindex - 1;
+
+	if (m->selected < 0)
+	    m->selected = 0;
+
+	m->draw_exit_func = history_draw_update;
+    }
+
+    d->data = hm;
+
+    if (items) {
+	for (i = 0; items[i]; i++)
+	    free(items[i]);
+
+	free(items);
+	items = NULL;
+    }
+
+    for (i = 0; hm[i]; i++) {
+	items = Realloc(items, (i+2) * sizeof(struct menu_item_s *));
+	items[i] = Malloc(sizeof(struct menu_item_s));
+	items[i]->name = hm[i]->line;
+	items[i]->value = NULL;
+	items[i]->selected = 0;
+    }
+
+    if (items)
+	items[i] = NULL;
+
+    m->nofree = 1;
+    m->items = items;
+    return items;
+}
+
+void history_menu_quit(struct menu_input_s *m)
+{
+    pushkey = -1;
+}
+
+void history_menu_exit(WIN *win)
+{
+    GAME g = win->data;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+    int i;
+
+    if (!hm)
+	return;
+
+    for (i = 0; hm[i]; i++) {
+	free(hm[i]->line);
+	free(hm[i]);
+    }
+
+    free(hm);
+    d->data = NULL;
+}
+
+// FIXME RAV
+void history_menu_next(struct menu_input_s *m)
+{
+    GAME g = m->data;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+    int n, t;
+
+    for (t = 0; hm[t]; t++);
+
+    if (m->selected + 1 == t)
+	n = 0;
+    else
+	n = hm[m->selected + 1]->hindex;
+
+    n++;
+    g->hindex = n;
+}
+
+// FIXME RAV
+void history_menu_prev(struct menu_input_s *m)
+{
+    GAME g = m->data;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+    int n, t;
+
+    for (t = 0; hm[t]; t++);
+
+    if (m->selected - 1 < 0)
+	n = t - 1;
+    else
+	n = hm[m->selected - 1]->hindex;
+
+    n++;
+    g->hindex = n;
+}
+
+void history_menu_help(struct menu_input_s *m)
+{
+    message(_("History Menu Help"), ANY_KEY_STR, "%s",
+	    _ (
+	       "    UP/DOWN - previous/next menu item\n"
+	       "   HOME/END - first/last menu item\n"
+	       "  PGDN/PGUP - next/previous page\n"
+	       "  a-zA-Z0-9 - jump to item\n"
+	       "     CTRL-a - annotate the selected move\n"
+	       "      ENTER - view annotation\n"
+	       "     CTRL-d - toggle board details\n"
+	       "   ESCAPE/M - return to move history"
+	       ));
+}
+
+void do_annotate_move(HISTORY *hp)
+{
+    char buf[COLS - 4];
+    struct input_data_s *in;
+
+    snprintf(buf, sizeof(buf), "%s \"%s\"", _("Editing Annotation for"), hp->move);
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->data = hp;
+    in->efunc = do_annotate_finalize;
+    construct_input(buf, hp->comment, MAX_PGN_LINE_LEN / INPUT_WIDTH, 0,
+	    _("Type CTRL-t to edit NAG"), edit_nag, NULL, CTRL_KEY('T'), in, -1, -1);
+}
+
+void history_menu_view_annotation(struct menu_input_s *m)
+{
+    GAME g = m->data;
+
+    // FIXME RAV
+    view_annotation(g->history[m->selected]);
+}
+
+void history_menu_annotate_finalize(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    GAME g = in->moredata;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+
+    really_do_annotate_finalize(in, d);
+    free_history_menu_data(hm);
+    hm = NULL;
+    get_history_data(g->history, &hm, 0, TEST_FLAG(g->flags, GF_BLACK_OPENING));
+    d->data = hm;
+    pushkey = REFRESH_MENU;
+}
+
+void history_menu_annotate(struct menu_input_s *m)
+{
+    GAME g = m->data;
+    char buf[COLS - 4];
+    struct input_data_s *in;
+    HISTORY *hp = g->history[m->selected]; // FIXME RAV
+
+    snprintf(buf, sizeof(buf), "%s \"%s\"", _("Editing Annotation for"), hp->move);
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->data = hp;
+    in->moredata = m->data;
+    in->efunc = history_menu_annotate_finalize;
+    construct_input(buf, hp->comment, MAX_PGN_LINE_LEN / INPUT_WIDTH, 0,
+	    _("Type CTRL-t to edit NAG"), edit_nag, NULL, CTRL_KEY('T'), in, -1, -1);
+}
+
+void history_menu_details(struct menu_input_s *m)
+{
+    do_board_details();
+}
+
+// FIXME RAV
+void history_menu_print(WIN *win)
+{
+    struct menu_input_s *m = win->data;
+    GAME g = m->data;
+    struct userdata_s *d = g->data;
+    struct history_menu_s **hm = d->data;
+    struct history_menu_s *h = hm[m->top];
+    int i;
+    char *p = m->item->name;
+    int line = m->print_line - 2;
+/*
+ * Solaris 5.9 doesn't have wattr_get() or any function that requires an
+ * attr_t data type.
+ */
+    attr_t attrs;
+    short pair;
+    int total;
+
+    for (total = 0; hm[total]; total++);
+    wattr_get(win->w, &attrs, &pair, NULL);
+    wattroff(win->w, COLOR_PAIR(pair));
+    mvwaddch(win->w, m->print_line, 1,
+	    *p == 'W' ? *p | mix_cp(CP_BOARD_WHITE, CP_HISTORY_WINDOW, ATTRS(CP_BOARD_WHITE), A_FG_B_BG) : *p | mix_cp(CP_BOARD_BLACK, CP_HISTORY_WINDOW, ATTRS(CP_BOARD_BLACK), A_FG_B_BG));
+    p++;
+
+    if (h->hindex == 0 && line == 0)
+	waddch(win->w, ACS_ULCORNER | CP_HISTORY_MENU_LG);
+    else if ((!hm[h->hindex + (win->rows - 5) + 1] && line == win->rows - 5) ||
+	    (m->top + line == total - 1))
+	waddch(win->w, ACS_LLCORNER | CP_HISTORY_MENU_LG);
+    else if (hm[m->top + 1]->ravlevel != h->ravlevel || !h->ravlevel)
+	waddch(win->w, ACS_LTEE | CP_HISTORY_MENU_LG);
+    else
+	waddch(win->w, ACS_VLINE | CP_HISTORY_MENU_LG);
+
+    wattron(win->w, COLOR_PAIR(pair) | attrs);
+
+    for (i = 2; *p; p++, i++)
+	waddch(win->w, (*p == '!') ? *p | A_BOLD : *p);
+
+    while (i++ < win->cols - 2)
+	waddch(win->w, ' ');
+}
+
+void history_menu(GAME g)
+{
+    struct menu_key_s **keys = NULL;
+
+    add_menu_key(&keys, KEY_ESCAPE, history_menu_quit);
+    add_menu_key(&keys, 'M', history_menu_quit);
+    add_menu_key(&keys, KEY_UP, history_menu_prev);
+    add_menu_key(&keys, KEY_DOWN, history_menu_next);
+    add_menu_key(&keys, KEY_F(1), history_menu_help);
+    add_menu_key(&keys, CTRL_KEY('a'), history_menu_annotate);
+    add_menu_key(&keys, CTRL_KEY('d'), history_menu_details);
+    add_menu_key(&keys, '\n', history_menu_view_annotation);
+    construct_menu(MEGA_BOARD ? LINES - HISTORY_HEIGHT_MB : LINES,
+			TAG_WIDTH, 0, config.boardleft ? BOARD_WIDTH : 0,
+			_("Move History Tree"), 1, get_history_items, keys, g,
+			history_menu_print, history_menu_exit);
+}
+
+void do_history_menu()
+{
+    history_menu(gp);
+}
+
+static int explorer_move_cmp(const void *a, const void *b)
+{
+    const struct explorer_move_s *m1 = a, *m2 = b;
+
+    return m2->games - m1->games;
+}
+
+struct menu_item_s **get_explorer_items(WIN *win)
+{
+    struct menu_input_s *m = win->data;
+    struct userdata_s *d = gp->data;
+    struct explorer_move_s *moves;
+    struct explorer_pos_s *p;
+    struct menu_item_s **items;
+    char buf[FEN_MAX];
+    const char *fen;
+    int i, n, total = 0;
+
+    if (m->items)
+	return m->items;
+
+    /* The history FEN is what the explorer was built from. */
+    if (gp->ravlevel)
+	fen = board_to_fen(gp, d->b, buf);
+    else
+	fen = (gp->hindex) ? gp->hp[gp->hindex - 1]->fen :
+		game_start_fen(gindex);
+
+    p = explorer_find(explorer_key(fen), 0);
+    moves = Malloc(((p) ? p->total : 0) * sizeof(struct explorer_move_s) + 1);
+
+    for (i = 0; p && i < p->total; i++) {
+	if (p->m[i].games > 0)
+	    moves[total++] = p->m[i];
+    }
+
+    qsort(moves, total, sizeof(struct explorer_move_s), explorer_move_cmp);
+    items = Malloc((total + 2) * sizeof(struct menu_item_s *));
+
+    for (i = n = 0; i < total; i++) {
+	struct explorer_move_s *e = &moves[i];
+	char elo[8] = "-", year[8] = "-";
+	char buf[64];
+
+	if (e->nelo)
+	    snprintf(elo, sizeof(elo), "%li", e->elo / e->nelo);
+
+	if (e->year)
+	    snprintf(year, sizeof(year), "%i", e->year);
+
+	snprintf(buf, sizeof(buf), "%-7s %6i %3i%% %3i%% %3i%% %5s %5s",
+		move_names.str[e->move], e->games, e->white * 100 / e->games,
+		e->draws * 100 / e->games, e->black * 100 / e->games, elo, year);
+	items[n] = Calloc(1, sizeof(struct menu_item_s));
+	items[n++]->name = strdup(buf);
+    }
+
+    if (!n) {
+	items[n] = Calloc(1, sizeof(struct menu_item_s));
+	items[n++]->name = strdup(_("No games reach this position"));
+    }
+
+    items[n] = NULL;
+    free(moves);
+    m->items = items;
+    return items;
+}
+
+void explorer_help(struct menu_input_s *m)
+{
+    message(_("Opening Explorer Keys"), ANY_KEY_STR, "%s",
+	    _ (
+	       "Each line is a move played from the current position followed\n"
+	       "by the number of games, the white wins, draws and black wins,\n"
+	       "the average rating of the side playing the move and the last\n"
+	       "year it was played. Only the first moves of a game are counted.\n"
+	       "\n"
+	       "    UP/DOWN - previous/next menu item\n"
+	       "  PGDN/PGUP - next/previous page\n"
+	       "     ESCAPE - quit"
+	       ));
+}
+
+void explorer_menu()
+{
+    struct menu_key_s **keys = NULL;
+
+    update_explorer();
+    add_menu_key(&keys, KEY_ESCAPE, history_menu_quit);
+    add_menu_key(&keys, '\n', history_menu_quit);
+    add_menu_key(&keys, KEY_F(1), explorer_help);
+    construct_menu(MEGA_BOARD ? LINES - HISTORY_HEIGHT_MB : LINES,
+			TAG_WIDTH, 0, config.boardleft ? BOARD_WIDTH : 0,
+			_("Opening Explorer"), 1, get_explorer_items, keys, NULL,
+			nag_print, NULL);
+}
+
+void do_history_explorer()
+{
+    explorer_menu();
+}
+
+void do_history_half_move_toggle()
+{
+    movestep = (movestep == 1) ? 2 : 1;
+    update_history_window(gp);
+}
+
+void do_history_rotate_board()
+{
+    struct userdata_s *d = gp->data;
+    d->rotate = !d->rotate;
+}
+
+void do_history_jump_next()
+{
+    struct userdata_s *d = gp->data;
+
+    history_next(gp, d->b, (keycount > 0) ?
+	    config.jumpcount * keycount * movestep :
+	    config.jumpcount * movestep);
+}
+
+void do_history_jump_prev()
+{
+    struct userdata_s *d = gp->data;
+
+    history_prev(gp, d->b, (keycount) ?
+	    config.jumpcount * keycount * movestep :
+	    config.jumpcount * movestep);
+}
+
+void do_history_prev()
+{
+    struct userdata_s *d = gp->data;
+
+    history_prev(gp, d->b,
+	    (keycount) ? keycount * movestep : movestep);
+}
+
+void do_history_next()
+{
+    struct userdata_s *d = gp->data;
+
+    history_next(gp, d->b, (keycount) ?
+	    keycount * movestep : movestep);
+}
+
+void do_history_analyze()
+{
+    GAME g = analysis.g;
+
+    stop_analysis();
+
+    if (g != gp)
+	start_analysis(gp);
+}
+
+void do_history_mode_finalize(struct userdata_s *d)
+{
+    pushkey = 0;
+    d->mode = MODE_PLAY;
+}
+
+void do_history_mode_confirm(WIN *win)
+{
+    struct userdata_s *d = gp->data;
+    wchar_t str[] = { win->c, 0 };
+
+    if (!wcscmp (str, resume_wchar)) {
+	forget_positions(gp);
+	moves_changed(gp);
+        pgn_history_free(gp->hp, gp->hindex);
+	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+    }
+#if 0
+	case 'C':
+	case 'c':
+	    if (pgn_history_rav_new(gp, d->b,
+			gp->hindex) != E_PGN_OK)
+		return;
+
+	    break;
+#endif
+     else
+         return;
+
+    if (!TEST_FLAG(d->flags, CF_HUMAN) && !lease_engine(gp)) {
+        char fen[FEN_MAX];
+
+	add_engine_command(gp, ENGINE_READY, "setboard %s\n",
+		board_to_fen(gp, d->b, fen));
+    }
+
+    do_history_mode_finalize(d);
+}
+
+void do_history_toggle()
+{
+    struct userdata_s *d = gp->data;
+
+    // FIXME Resuming from previous history could append to a RAV.
+    if (gp->hindex != pgn_history_total(gp->hp)) {
+	if (!pushkey)
+	    construct_message(NULL, _ ("What would you like to do?"), 0, 1,
+			      NULL, NULL, NULL, do_history_mode_confirm, 0, 0,
+			      _("The current move is not the final move of this round. Press \"%ls\" to resume a game from the current move and discard future moves or any other key to cancel."),
+			      resume_wchar);
+	return;
+    }
+    else {
+	if (TEST_FLAG(gp->flags, GF_GAMEOVER))
+	    return;
+    }
+
+    if (gp->side != gp->turn) {
+        d->play_mode = PLAY_EH;
+    }
+    else {
+        d->play_mode = PLAY_HE;
+	d->rotate = FALSE;
+    }
+
+    do_history_mode_finalize(d);
+}
+
+void do_history_annotate()
+{
+    int n = gp->hindex;
+
+    if (n && gp->hp[n - 1]->move)
+	n--;
+    else
+	return;
+
+    do_annotate_move(gp->hp[n]);
+}
+
+void do_history_help()
+{
+    wchar_t *buf = build_help(history_keys);
+
+    construct_message(_("History Mode Keys (* = can take a repeat count)"),
+		      ANY_KEY_SCROLL_STR, 0, 0, NULL, NULL,
+		      buf, do_more_help, 0, 1, "%ls", buf);
+}
+
+void do_history_find(int which)
+{
+    struct input_data_s *in;
+    int *p;
+
+    if (pgn_history_total(gp->hp) < 2)
+	return;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    p = Malloc(sizeof(int));
+    *p = which;
+    in->data = p;
+    in->efunc = do_find_move_exp;
+
+    if (!*moveexp || which == 0) {
+	construct_input(_("Find Move Text Expression"), NULL, 1, 0, NULL, NULL, NULL,
+		0, in, INPUT_HIST_MOVE_EXP, -1);
+	return;
+    }
+
+    free(p);
+    free(in);
+    do_find_move_exp_finalize(0, which);
+}
+
+void do_history_find_new()
+{
+    do_history_find(0);
+}
+
+void do_history_find_prev()
+{
+    do_history_find(-1);
+}
+
+void do_history_find_next()
+{
+    do_history_find(1);
+}
+
+void do_history_rav(int which)
+{
+    struct userdata_s *d = gp->data;
+
+    rav_next_prev(gp, d->b, which);
+}
+
+void do_history_rav_next()
+{
+    do_history_rav(1);
+}
+
+void do_history_rav_prev()
+{
+    do_history_rav(0);
+}
+
+void do_history_jump()
+{
+    struct input_data_s *in;
+
+    if (pgn_history_total(gp->hp) < 2)
+	return;
+
+    if (!keycount) {
+	in = Calloc(1, sizeof(struct input_data_s));
+	in->efunc = do_move_jump;
+
+	construct_input(_("Jump to Move Number"), NULL, 1, 1, NULL,
+		NULL, NULL, 0, in, -1, 0);
+	return;
+    }
+
+    do_move_jump_finalize(keycount);
+}
+
+/*
+ * Engine processes are shared by all games. A game leases one of
+ * engine_pool_size engines when it needs one. When none are free the least
+ * recently used idle engine is taken from its game and given the position of
+ * the new game.
+ */
+static struct engine_pool_s {
+    GAME g;
+    unsigned long used;
+} *engine_pool;
+
+static int engine_is_idle(GAME g)
+{
+    struct userdata_s *d = g->data;
+
+    if (d->engine->status == ENGINE_OFFLINE)
+	return 1;
+
+    return g != analysis.g && d->engine->status != ENGINE_THINKING
+	&& !d->engine->queue && !TEST_FLAG(d->flags, CF_ENGINE_LOOP);
+}
+
+/*
+ * Makes sure game 'g' has an engine. Returns 0 on success or 1 if all
+ * engines are busy.
+ */
+static int lease_engine(GAME g)
+{
+    static unsigned long tick;
+    struct userdata_s *d = g->data;
+    struct engine_s *e;
+    int i, n = -1;
+
+    if (!engine_pool)
+	engine_pool = Calloc(engine_pool_size, sizeof(struct engine_pool_s));
+
+    for (i = 0; i < engine_pool_size; i++) {
+	if (engine_pool[i].g == g) {
+	    engine_pool[i].used = ++tick;
+	    return 0;
+	}
+    }
+
+    /* Not a pooled engine. */
+    if (d->engine)
+	return 0;
+
+    for (i = 0; i < engine_pool_size; i++) {
+	if (!engine_pool[i].g) {
+	    n = i;
+	    break;
+	}
+
+	if (engine_is_idle(engine_pool[i].g)
+		&& (n == -1 || engine_pool[i].used < engine_pool[n].used))
+	    n = i;
+    }
+
+    if (n == -1) {
+	message(ERROR_STR, ANY_KEY_STR,
+		_("All %i chess engines are busy. Try again later."),
+		engine_pool_size);
+	return 1;
+    }
+
+    if (engine_pool[n].g) {
+	struct userdata_s *od = engine_pool[n].g->data;
+
+	e = od->engine;
+	od->engine = NULL;
+	free_enginebuf(e);
+    }
+    else {
+	e = Calloc(1, sizeof(struct engine_s));
+	e->pid = -1;
+	e->status = ENGINE_OFFLINE;
+    }
+
+    d->engine = e;
+    engine_pool[n].g = g;
+    engine_pool[n].used = ++tick;
+
+    /*
+     * Reset a running engine and give it the position of this game. An
+     * offline engine is started and sent the position by
+     * init_chess_engine().
+     */
+    if (e->status != ENGINE_OFFLINE) {
+	char fen[FEN_MAX];
+
+	add_engine_command(g, ENGINE_READY, "new\n");
+	set_engine_defaults(g, config.einit);
+	add_engine_command(g, ENGINE_READY, "setboard %s\n",
+		board_to_fen(g, d->b, fen));
+    }
+
+    return 0;
+}
+
+/*
+ * Removes the engine of game 'g' from the pool. The caller frees it.
+ */
+static void release_engine(GAME g)
+{
+    int i;
+
+    for (i = 0; engine_pool && i < engine_pool_size; i++) {
+	if (engine_pool[i].g == g)
+	    engine_pool[i].g = NULL;
+    }
+}
+
+/*
+ * The games which have userdata, least recently used first. Userdata is
+ * created by use_game() when a game is first used rather than for every
+ * loaded game. Once there are more than USERDATA_MAX, the userdata of
+ * the least recently used games is released again if it holds nothing
+ * that differs from a new one.
+ */
+#define USERDATA_MAX		256
+
+static GAME *userdata_games;
+static int userdata_total, userdata_size;
+
+static void unlist_userdata(GAME g)
+{
+    int i;
+
+    for (i = userdata_total - 1; i >= 0; i--) {
+	if (userdata_games[i] == g) {
+	    memmove(&userdata_games[i], &userdata_games[i + 1],
+		    (--userdata_total - i) * sizeof(GAME));
+	    break;
+	}
+    }
+}
+
+static void list_userdata(GAME g)
+{
+    if (userdata_total == userdata_size) {
+	userdata_size = (userdata_size) ? userdata_size * 2 : 64;
+	userdata_games = Realloc(userdata_games, userdata_size * sizeof(GAME));
+    }
+
+    userdata_games[userdata_total++] = g;
+}
+
+static int userdata_releasable(GAME g)
+{
+    struct userdata_s *d = g->data;
+
+    if (g == gp || d->engine || d->data || d->mode != MODE_HISTORY
+	    || d->rotate || (d->flags & ~CF_NEW))
+	return 0;
+
+#ifdef WITH_LIBPERL
+    if (d->perlfen || d->oldfen)
+	return 0;
+#endif
+
+    return 1;
+}
+
+static void free_userdata_once(GAME g)
+{
+    struct userdata_s *d = g->data;
+
+    if (!d)
+	return;
+
+    if (TEST_FLAG(d->flags, CF_DELETE))
+	delete_marked--;
+
+    if (analysis.g == g) {
+	analysis.g = NULL;
+	hide_panel(analysisp);
+    }
+
+    if (d->engine) {
+	release_engine(g);
+	stop_engine(g);
+
+	free_enginebuf(d->engine);
+
+	if (d->engine->queue) {
+	    struct queue_s **q;
+
+	    for (q = d->engine->queue; *q; q++)
+		free(*q);
+
+	    free(d->engine->queue);
+	}
+
+	free(d->engine->iobuf);
+	free(d->engine);
+    }
+
+#ifdef WITH_LIBPERL
+    if (d->perlfen)
+	free(d->perlfen);
+
+    if (d->oldfen)
+	free(d->oldfen);
+#endif
+
+    free(d);
+    g->data = NULL;
+    unlist_userdata(g);
+}
+
+static void free_userdata()
+{
+    while (userdata_total)
+	free_userdata_once(userdata_games[userdata_total - 1]);
+
+    free(userdata_games);
+    userdata_games = NULL;
+    userdata_size = 0;
+    free_tag_search();
+    free_tag_index();
+    free_move_index();
+    reset_explorer();
+    reset_position_cache();
+}
+
+void update_loading_window(int n)
+{
+    char buf[16];
+
+    if (!loadingw) {
+	loadingw = newwin(3, COLS / 2, CALCPOSY(3), CALCPOSX(COLS / 2));
+	loadingp = new_panel(loadingw);
+	wbkgd(loadingw, CP_MESSAGE_WINDOW);
+    }
+
+    wmove(loadingw, 0, 0);
+    wclrtobot(loadingw);
+    wattron(loadingw, CP_MESSAGE_BORDER);
+    box(loadingw, ACS_VLINE, ACS_HLINE);
+    wattroff(loadingw, CP_MESSAGE_BORDER);
+    mvwprintw(loadingw, 1, CENTER_INT((COLS / 2), 11 +
+				      strlen(itoa(gtotal, buf))),
+	      _("Loading... %i%% (%i games)"), n, gtotal);
+    update_panels();
+    doupdate();
+}
+
+static void init_userdata_once(GAME g, int n)
+{
+    struct userdata_s *d = NULL;
+
+    d = Calloc(1, sizeof(struct userdata_s));
+    d->n = n;
+    d->c_row = 2, d->c_col = 5;
+    SET_FLAG(d->flags, CF_NEW);
+    g->data = d;
+    list_userdata(g);
+
+    if (pgn_board_init_fen(g, d->b, NULL) != E_PGN_OK)
+	pgn_board_init(d->b);
+}
+
+/*
+ * Returns game 'n' after creating its userdata if it has none and marking it
+ * as the most recently used.
+ */
+static GAME use_game(int n)
+{
+    GAME g = game[n];
+    int i;
+
+    if (!g->data)
+	init_userdata_once(g, n);
+    else if (userdata_games[userdata_total - 1] != g) {
+	unlist_userdata(g);
+	list_userdata(g);
+    }
+
+    for (i = 0; userdata_total > USERDATA_MAX && i < userdata_total - 1;) {
+	if (userdata_releasable(userdata_games[i]))
+	    free_userdata_once(userdata_games[i]);
+	else
+	    i++;
+    }
+
+    return g;
+}
+
+/*
+ * Only the current game needs userdata after loading. The others get theirs
+ * from use_game().
+ */
+void init_userdata()
+{
+    use_game(gindex);
+}
+
+void fix_marks(int *start, int *end)
+{
+    int i;
+
+    *start = (*start < 0) ? 0 : *start;
+    *end = (*end < 0) ? 0 : *end;
+
+    if (*start > *end) {
+	i = *start;
+	*start = *end;
+        *end = i + 1;
+    }
+
+    *end = (*end > gtotal) ? gtotal : *end;
+}
+
+void do_new_game_finalize(GAME g)
+{
+    struct userdata_s *d = g->data;
+
+    d->mode = MODE_PLAY;
+    update_status_notify(g, NULL);
+    d->rotate = FALSE;
+    d->go_move = 0;
+}
+
+void do_new_game_from_scratch(WIN *win)
+{
+    wchar_t str[] = {  win->c, 0 };
+
+    if (wcscmp (str, yes_wchar))
+        return;
+
+    stop_clock();
+    free_userdata();
+    pgn_parse(NULL);
+    gp = use_game(gindex);
+    add_custom_tags(&gp->tag);
+    tags_changed(gindex);
+    init_userdata();
+    loadfile[0] = 0;
+    do_new_game_finalize(gp);
+}
+
+void do_new_game()
+{
+    pgn_new_game();
+    gp = use_game(gindex);
+    add_custom_tags(&gp->tag);
+    tags_changed(gindex);
+    do_new_game_finalize(gp);
+}
+
+void do_game_delete_finalize(int n)
+{
+    struct userdata_s *d;
+
+    delete_game((!n) ? gindex : -1);
+    d = gp->data;
+    if (d->mode != MODE_EDIT)
+	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+}
+
+void do_game_delete_confirm(WIN *win)
+{
+    int *n;
+    wchar_t str[] = { win->c, 0 };
+
+    if (wcscmp (str, yes_wchar)) {
+	free(win->data);
+	return;
+    }
+
+    n = (int *)win->data;
+    do_game_delete_finalize(*n);
+    free(win->data);
+}
+
+void do_game_delete()
+{
+    char *tmp = NULL;
+    int n = delete_marked;
+    int *p;
+
+    if (gtotal < 2) {
+	cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
+	return;
+    }
+
+    tmp = NULL;
+
+    if (!n)
+	tmp = _("Delete the current game?");
+    else {
+	if (n == gtotal) {
+	    cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
+	    return;
+	}
+
+	tmp = _("Delete all games marked for deletion?");
+    }
+
+    if (config.deleteprompt) {
+	p = Malloc(sizeof(int));
+	*p = n;
+	construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, p,
+		do_game_delete_confirm, 0, 0, tmp);
+	return;
+    }
+
+    do_game_delete_finalize(n);
+}
+
+void do_find_game_exp_finalize(int which)
+{
+    struct userdata_s *d = gp->data;
+    int n;
+
+    if ((n = find_game_exp(gameexp, (which == -1) ? 0 : 1,
+		    (keycount) ? keycount : 1)) == -1) {
+	update_status_notify(gp, "%s", _("No matches found"));
+	return;
+    }
+
+    gindex = n;
+    gp = use_game(gindex);
+    d = gp->data;
+
+    if (pgn_history_total(gp->hp))
+	d->mode = MODE_HISTORY;
+
+    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+}
+
+void do_find_game_exp(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    int *n = in->data;
+    int c = *n;
+
+    if (in->str) {
+	strncpy(gameexp, in->str, sizeof(gameexp));
+	gameexp[sizeof(gameexp)-1] = 0;
+
+	if (c == '?')
+	    c = '}';
+
+	do_find_game_exp_finalize(c);
+	free(in->str);
+    }
+
+    free(in->data);
+    free(in);
+}
+
+void do_game_jump_finalize(int n)
+{
+    struct userdata_s *d;
+
+    if (--n > gtotal - 1 || n < 0)
+	return;
+
+    gindex = n;
+    gp = use_game(gindex);
+    d = gp->data;
+    history_board_update(gp, d->b, pgn_history_total(gp->hp));
+    update_status_notify(gp, NULL);
+}
+
+void do_game_jump(WIN *win)
+{
+    struct input_data_s *in = win->data;
+
+    if (!in->str || !isinteger(in->str)) {
+	if (in->str)
+	    free(in->str);
+
+	free(in);
+	return;
+    }
+
+    do_game_jump_finalize(atoi(in->str));
+    free(in->str);
+    free(in);
+}
+
+void do_load_file(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    char *tmp = in->str;
+    struct userdata_s *d;
+    PGN_FILE *pgn = NULL;
+    int n;
+
+    if (!in->str) {
+	free(in);
+	return;
+    }
+
+    if ((tmp = pathfix(tmp)) == NULL)
+	goto done;
+
+    n = pgn_open(tmp, "r", &pgn);
+
+    if (n == E_PGN_ERR) {
+	cmessage(ERROR_STR, ANY_KEY_STR, "%s\n%s", tmp, strerror(errno));
+	goto done;
+    }
+    else if (n == E_PGN_INVALID) {
+	cmessage(ERROR_STR, ANY_KEY_STR, "%s\n%s", tmp, _("Not a regular file"));
+	goto done;
+    }
+
+    free_userdata();
+
+    if (pgn_parse(pgn) == E_PGN_ERR) {
+	del_panel(loadingp);
+	delwin(loadingw);
+	loadingw = NULL;
+	loadingp = NULL;
+	init_userdata();
+	goto done;
+    }
+
+    del_panel(loadingp);
+    delwin(loadingw);
+    loadingw = NULL;
+    loadingp = NULL;
+    init_userdata();
+    strncpy(loadfile, tmp, sizeof(loadfile));
+    loadfile[sizeof(loadfile)-1] = 0;
+    gp = use_game(gindex);
+    d = gp->data;
+
+    if (pgn_history_total(gp->hp))
+	d->mode = MODE_HISTORY;
+
+    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+
+    fm_loaded_file = TRUE;
+	d->rotate = FALSE;
+
+done:
+    pgn_close(pgn);
+
+    if (in->str)
+	free(in->str);
+
+    free(in);
+}
+
+void do_game_save(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    int *x = in->data;
+    int n = *x;
+    char *tmp = in->str;
+    char tfile[FILENAME_MAX];
+    char *p;
+    int i;
+    struct userdata_s *d;
+
+    if (!tmp || (tmp = pathfix(tmp)) == NULL)
+	goto done;
+
+    if (pgn_is_compressed(tmp) == E_PGN_ERR) {
+	p = tmp + strlen(tmp) - 1;
+
+	if (*p != 'n' || *(p-1) != 'g' || *(p-2) != 'p' ||
+		*(p-3) != '.') {
+	    snprintf(tfile, sizeof(tfile), "%s.pgn", tmp);
+	    tmp = tfile;
+	}
+    }
+
+    /*
+     * When in edit mode, update the FEN tag.
+     */
+    if (n == -1) {
+	for (i = 0; i < gtotal; i++) {
+	    d = game[i]->data;
+
+	    if (d && d->mode == MODE_EDIT) {
+	        char *fen = pgn_game_to_fen(game[i], d->b);
+
+		pgn_tag_add(&game[i]->tag, "FEN", fen);
+		tags_changed(i);
+		free (fen);
+	    }
+	}
+    }
+    else {
+	d = game[n]->data;
+
+	if (d && d->mode == MODE_EDIT) {
+	    char *fen = pgn_game_to_fen(game[n], d->b);
+
+	    pgn_tag_add(&game[n]->tag, "FEN", fen);
+	    tags_changed(n);
+	    free (fen);
+	}
+    }
+
+    save_pgn(tmp, n);
+
+done:
+    if (in->str)
+	free(in->str);
+
+    free(in->data);
+    free(in);
+}
+
+void do_get_game_save_input(int n)
+{
+    struct input_data_s *in = Calloc(1, sizeof(struct input_data_s));
+    int *p = Malloc(sizeof(int));
+
+    in->efunc = do_game_save;
+    *p = n;
+    in->data = p;
+
+    construct_input(_("Save Game Filename"), loadfile, 1, 1, _("Type TAB for file browser"),
+	file_browser, NULL, '\t', in, INPUT_HIST_FILE, -1);
+}
+
+void do_game_save_multi_confirm(WIN *win)
+{
+    int i;
+    wchar_t str[] = { win->c, 0 };
+
+    if (!wcscmp (str, current_wchar))
+	i = gindex;
+    else if (!wcscmp (str, all_wchar))
+	i = -1;
+    else {
+	update_status_notify(gp, "%s", _("Save game aborted."));
+	return;
+    }
+
+    do_get_game_save_input(i);
+}
+
+void do_global_about()
+{
+    cmessage(_("ABOUT"), ANY_KEY_STR,
+	     _("%s\nUsing %s with %i colors and %i color pairs\n%s"),
+	     PACKAGE_STRING, curses_version(), COLORS, COLOR_PAIRS,
+	     COPYRIGHT);
+}
+
+void global_game_next_prev(int which)
+{
+    struct userdata_s *d;
+
+    game_next_prev(gp, (which == 1) ? 1 : 0,
+	    (keycount) ? keycount : 1);
+    d = gp->data;
+
+    if (delete_count) {
+	if (which == 1) {
+	    markend = markstart + delete_count;
+	    delete_count = 0;
+	}
+	else {
+	    markend = markstart - delete_count + 1;
+	    delete_count = -1; // to fix gindex in the other direction
+	}
+
+	fix_marks(&markstart, &markend);
+	do_global_toggle_delete();
+    }
+
+    if (d->mode == MODE_HISTORY)
+	pgn_board_update(gp, d->b, gp->hindex);
+    else if (d->mode == MODE_PLAY)
+	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+}
+
+void do_global_next_game()
+{
+    global_game_next_prev(1);
+}
+
+void do_global_prev_game()
+{
+    global_game_next_prev(0);
+}
+
+void global_find(int which)
+{
+    struct input_data_s *in;
+    int *p;
+
+    if (gtotal < 2)
+	return;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    p = Malloc(sizeof(int));
+    *p = which;
+    in->data = p;
+    in->efunc = do_find_game_exp;
+
+    if (!*gameexp || which == 0) {
+	construct_input(_("Find Game by Tag Expression"), NULL, 1, 0,
+		_("[name:]value regex, name=value[*] or name=lo..hi"), NULL, NULL, 0, in,
+		INPUT_HIST_GAME_EXP, -1);
+	return;
+    }
+
+    free(p);
+    free(in);
+    do_find_game_exp_finalize(which);
+}
+
+void do_global_find_new()
+{
+    global_find(0);
+}
+
+void do_global_find_next()
+{
+    global_find(1);
+}
+
+void do_global_find_prev()
+{
+    global_find(-1);
+}
+
+void do_global_game_jump()
+{
+    if (gtotal < 2)
+	return;
+
+    if (!keycount) {
+        struct input_data_s *in;
+
+	in = Calloc(1, sizeof(struct input_data_s));
+	in->efunc = do_game_jump;
+	construct_input(_("Jump to Game Number"), NULL, 1, 1, NULL, NULL, NULL, 0, in,
+		-1, 0);
+	return;
+    }
+
+    do_game_jump_finalize(keycount);
+}
+
+/*
+ * The game list. 'match' holds the games passing the filter in game order
+ * and 'row' the same games in display order. Sorting is a counting sort on
+ * the value ranks of the tag search index so it is linear in the number of
+ * games. Only the rows in view are formatted.
+ */
+#define GAME_LIST_COLUMNS	6
+
+struct game_list_s {
+    int *match;
+    int *row;
+    int total;
+    int top;
+    int selected;
+    int sort;		/* Column or 0 for game order. */
+    int reverse;
+    char filter[255];
+};
+
+static const int game_list_tags[GAME_LIST_COLUMNS] = {
+    -1, TAG_WHITE, TAG_BLACK, TAG_RESULT, TAG_DATE, TAG_EVENT
+};
+
+static void game_list_sort(struct game_list_s *l)
+{
+    int *key, *count;
+    int i, n, sel = (l->total) ? l->row[l->selected] : -1;
+
+    if (!l->sort) {
+	for (i = 0; i < l->total; i++)
+	    l->row[i] = l->match[(l->reverse) ? l->total - 1 - i : i];
+    }
+    else {
+	build_tag_search();
+	key = Malloc((l->total + 1) * sizeof(int));
+	count = Calloc(tag_search.nvalues + 2, sizeof(int));
+
+	/* Games without the tag sort first with a key of 0. */
+	for (i = 0; i < l->total; i++) {
+	    struct tag_index_s *x = &tag_index[l->match[i]];
+	    int t = x->known[game_list_tags[l->sort]];
+
+	    key[i] = (t == -1) ? 0 : tag_search.rank[x->id[t]] + 1;
+	    count[key[i] + 1]++;
+	}
+
+	for (i = 1; i < tag_search.nvalues + 2; i++)
+	    count[i] += count[i - 1];
+
+	for (i = 0; i < l->total; i++) {
+	    n = count[key[i]]++;
+	    l->row[(l->reverse) ? l->total - 1 - n : n] = l->match[i];
+	}
+
+	free(key);
+	free(count);
+    }
+
+    for (i = 0, l->selected = 0; i < l->total; i++) {
+	if (l->row[i] == sel) {
+	    l->selected = i;
+	    break;
+	}
+    }
+}
+
+/*
+ * Keeps the games matching 'str' which is an indexed query, a tag
+ * expression like global_find() takes or empty for every game. An invalid
+ * expression is reported and the previous filter is kept.
+ */
+static void game_list_filter(struct game_list_s *l, const char *str)
+{
+    struct tag_exp_s e;
+    int g;
+
+    if (*str && tag_search_query(str)) {
+	memcpy(l->match, tag_search.match, tag_search.nmatch * sizeof(int));
+	l->total = tag_search.nmatch;
+    }
+    else if (*str) {
+	if (compile_tag_exp(&e, str))
+	    return;
+
+	l->total = 0;
+
+	for (g = 0; g < gtotal; g++) {
+	    if (tag_exp_count(&e, g))
+		l->match[l->total++] = g;
+	}
+
+	free_tag_exp(&e);
+    }
+    else {
+	l->total = 0;
+
+	for (g = 0; g < gtotal; g++)
+	    l->match[l->total++] = g;
+    }
+
+    if (str != l->filter) {
+	strncpy(l->filter, str, sizeof(l->filter)-1);
+	l->filter[sizeof(l->filter)-1] = 0;
+    }
+
+    l->top = l->selected = 0;
+    game_list_sort(l);
+}
+
+static void game_list_field(WINDOW *w, int g, int column, int width)
+{
+    const char *s = NULL;
+    wchar_t *p;
+    char buf[16];
+
+    if (column == 0) {
+	snprintf(buf, sizeof(buf), "%i", g + 1);
+	s = buf;
+    }
+    else
+	s = game_tag_value(g, game_list_tags[column]);
+
+    p = str_etc((s) ? s : "", width, 0);
+    wprintw(w, "%-*ls ", width, p);
+    free(p);
+}
+
+static void game_list_draw(WIN *win)
+{
+    struct game_list_s *l = win->data;
+    static const char *names[GAME_LIST_COLUMNS] = {
+	"#", "White", "Black", "Result", "Date", "Event"
+    };
+    int width[GAME_LIST_COLUMNS];
+    int rows = win->rows - 5;
+    char buf[COLS];
+    int i, c;
+
+    if (win->rows != LINES || win->cols != COLS) {
+	win->rows = LINES;
+	win->cols = COLS;
+	rows = win->rows - 5;
+	wresize(win->w, win->rows, win->cols);
+	replace_panel(win->p, win->w);
+	move_panel(win->p, 0, 0);
+    }
+
+    for (i = gtotal, width[0] = 1; i >= 10; i /= 10, width[0]++);
+    width[3] = 7;
+    width[4] = 10;
+    width[1] = width[2] = width[5] = (win->cols - 2 - width[0] - width[3]
+	    - width[4] - GAME_LIST_COLUMNS) / 3;
+
+    if (l->selected < l->top)
+	l->top = l->selected;
+    else if (l->selected >= l->top + rows)
+	l->top = l->selected - rows + 1;
+
+    wmove(win->w, 0, 0);
+    wclrtobot(win->w);
+    window_draw_title(win->w, win->title, win->cols, CP_INPUT_TITLE,
+	    CP_INPUT_BORDER);
+    wmove(win->w, 2, 1);
+    wattron(win->w, A_BOLD);
+
+    for (c = 0; c < GAME_LIST_COLUMNS; c++) {
+	snprintf(buf, sizeof(buf), "%s%s", (c == 0) ? names[c] : _(names[c]),
+		(c == l->sort) ? (l->reverse) ? " -" : " +" : "");
+	wprintw(win->w, "%-*.*s ", width[c], width[c], buf);
+    }
+
+    wattroff(win->w, A_BOLD);
+
+    for (i = l->top; i < l->total && i < l->top + rows; i++) {
+	wmove(win->w, 3 + i - l->top, 1);
+
+	if (i == l->selected)
+	    wattron(win->w, CP_MENU_SELECTED);
+
+	for (c = 0; c < GAME_LIST_COLUMNS; c++)
+	    game_list_field(win->w, l->row[i], c, width[c]);
+
+	if (i == l->selected)
+	    wattroff(win->w, CP_MENU_SELECTED);
+    }
+
+    if (*l->filter)
+	snprintf(buf, sizeof(buf), _("Game %i of %i matching \"%s\"  Type F1 for help"),
+		(l->total) ? l->selected + 1 : 0, l->total, l->filter);
+    else
+	snprintf(buf, sizeof(buf), _("Game %i of %i  Type F1 for help"),
+		(l->total) ? l->selected + 1 : 0, l->total);
+
+    window_draw_prompt(win->w, win->rows - 2, win->cols, buf, CP_INPUT_PROMPT);
+}
+
+void do_game_list_filter(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    WIN *list = in->moredata;
+
+    if (in->str) {
+	game_list_filter(list->data, in->str);
+	free(in->str);
+    }
+    else
+	game_list_filter(list->data, "");
+
+    game_list_draw(list);
+    free(in);
+}
+
+/*
+ * Deletes every game listed in game list window 'list' and lists what is left
+ * with the same filter.
+ */
+static void game_list_delete(WIN *list)
+{
+    struct game_list_s *l = list->data;
+    struct userdata_s *d;
+    char *del = Calloc(gtotal, 1);
+    int i;
+
+    for (i = 0; i < l->total; i++)
+	del[l->match[i]] = 1;
+
+    gindex = compact_games(del, -1);
+    free(del);
+    gp = use_game(gindex);
+    gp->hp = gp->history;
+    d = gp->data;
+
+    if (d->mode != MODE_EDIT)
+	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+
+    game_list_filter(l, l->filter);
+    game_list_draw(list);
+    update_status_notify(gp, _("%i games deleted"), i);
+}
+
+void do_game_list_delete_confirm(WIN *win)
+{
+    wchar_t str[] = { win->c, 0 };
+
+    if (!wcscmp(str, yes_wchar))
+	game_list_delete(win->data);
+}
+
+static int game_list_display(WIN *win)
+{
+    struct game_list_s *l = win->data;
+    struct input_data_s *in;
+    int rows = win->rows - 5;
+
+    switch (win->c) {
+	case KEY_UP:
+	    l->selected--;
+	    break;
+	case KEY_DOWN:
+	    l->selected++;
+	    break;
+	case KEY_PPAGE:
+	    l->selected -= rows;
+	    break;
+	case KEY_NPAGE:
+	    l->selected += rows;
+	    break;
+	case KEY_HOME:
+	    l->selected = 0;
+	    break;
+	case KEY_END:
+	    l->selected = l->total - 1;
+	    break;
+	case 's':
+	    l->sort = (l->sort + 1) % GAME_LIST_COLUMNS;
+	    game_list_sort(l);
+	    break;
+	case 'r':
+	    l->reverse = !l->reverse;
+	    game_list_sort(l);
+	    break;
+	case 'X':
+	    if (!l->total)
+		break;
+
+	    if (l->total == gtotal) {
+		cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
+		return 1;
+	    }
+
+	    if (config.deleteprompt) {
+		construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL,
+			win, do_game_list_delete_confirm, 0, 0,
+			_("Delete the %i listed games?"), l->total);
+		return 1;
+	    }
+
+	    game_list_delete(win);
+	    return 1;
+	case '/':
+	    in = Calloc(1, sizeof(struct input_data_s));
+	    in->efunc = do_game_list_filter;
+	    in->moredata = win;
+	    construct_input(_("Filter Games by Tag Expression"), l->filter, 1, 0,
+		    _("[name:]value regex, name=value[*] or name=lo..hi"), NULL,
+		    NULL, 0, in, INPUT_HIST_GAME_EXP, -1);
+	    return 1;
+	case '\n':
+	    if (l->total)
+		do_game_jump_finalize(l->row[l->selected] + 1);
+	    /* Fall through. */
+	case KEY_ESCAPE:
+	    return 0;
+	case KEY_F(1):
+	    message(_("Game List Keys"), ANY_KEY_STR, "%s",
+		    _ (
+		       "    UP/DOWN - previous/next game\n"
+		       "   HOME/END - first/last game\n"
+		       "  PGDN/PGUP - next/previous page\n"
+		       "          s - sort by the next column\n"
+		       "          r - reverse the sort order\n"
+		       "          / - filter games by tag expression\n"
+		       "          X - delete every listed game\n"
+		       "      ENTER - select the game\n"
+		       "     ESCAPE - quit"
+		       ));
+	    return 1;
+	default:
+	    break;
+    }
+
+    if (l->selected >= l->total)
+	l->selected = l->total - 1;
+
+    if (l->selected < 0)
+	l->selected = 0;
+
+    game_list_draw(win);
+    return 1;
+}
+
+static void game_list_exit(WIN *win)
+{
+    struct game_list_s *l = win->data;
+
+    free(l->match);
+    free(l->row);
+    free(l);
+}
+
+void do_global_game_list()
+{
+    struct game_list_s *l;
+    WIN *win;
+
+    if (!gtotal)
+	return;
+
+    l = Calloc(1, sizeof(struct game_list_s));
+    l->match = Malloc(gtotal * sizeof(int));
+    l->row = Malloc(gtotal * sizeof(int));
+    game_list_filter(l, "");
+    l->selected = gindex;
+    win = window_create(_("Game List"), LINES, COLS, 0, 0, game_list_display,
+	    l, game_list_exit);
+    wbkgd(win->w, CP_MENU);
+    keypad(win->w, TRUE);
+    win->c = 0;
+    game_list_display(win);
+}
+
+void do_global_toggle_delete()
+{
+    int i;
+
+    pushkey = 0;
+
+    if (gtotal < 2)
+	return;
+
+    if (keycount && delete_count == 0) {
+	markstart = gindex;
+	delete_count = keycount;
+	update_status_notify(gp, "%s (delete)", status.notify);
+	return;
+    }
+
+    if (markstart >= 0 && markend >= 0) {
+	for (i = markstart; i < markend; i++) {
+	    if (toggle_delete_flag(i)) {
+		return;
+	    }
+	}
+
+	gindex = (delete_count < 0) ? markstart : i - 1;
+    }
+    else {
+	if (toggle_delete_flag(gindex))
+	    return;
+    }
+
+    markstart = markend = -1;
+    delete_count = 0;
+    update_status_window(gp);
+}
+
+void do_global_delete_game()
+{
+    do_game_delete();
+}
+
+void do_global_tag_edit()
+{
+    struct userdata_s *d = gp->data;
+
+    edit_tags(gp, d->b, 1);
+    tags_changed(gindex);
+}
+
+void do_global_tag_view()
+{
+    struct userdata_s *d = gp->data;
+
+    edit_tags(gp, d->b, 0);
+}
+
+void do_global_resume_game()
+{
+    struct input_data_s *in;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->efunc = do_load_file;
+    construct_input(_("Load Filename"), NULL, 1, 1, _("Type TAB for file browser"), file_browser,
+	    NULL, '\t', in, INPUT_HIST_FILE, -1);
+}
+
+void do_global_save_game()
+{
+    if (gtotal > 1) {
+	construct_message(NULL, _("What would you like to do?"), 0, 1,
+			  NULL, NULL, NULL, do_game_save_multi_confirm, 0, 0,
+			  _("There is more than one game loaded. Press \"%ls\" to save the current game, \"%ls\" to save all games or any other key to cancel."),
+			  current_wchar, all_wchar);
+	return;
+    }
+
+    do_get_game_save_input(-1);
+}
+
+void do_global_new_game()
+{
+    do_new_game();
+}
+
+/*
+ * Duplicates the history array 'h' along with its comments, NAGs, FEN and
+ * variations. The moves were validated when 'h' was built so nothing is
+ * parsed again.
+ */
+static HISTORY **clone_history(HISTORY **h)
+{
+    int i, n = pgn_history_total(h);
+    HISTORY **c = Malloc((n + 1) * sizeof(HISTORY *));
+
+    for (i = 0; i < n; i++) {
+	c[i] = Malloc(sizeof(HISTORY));
+	*c[i] = *h[i];
+	c[i]->move = h[i]->move ? strdup(h[i]->move) : NULL;
+	c[i]->comment = h[i]->comment ? strdup(h[i]->comment) : NULL;
+	c[i]->fen = h[i]->fen ? strdup(h[i]->fen) : NULL;
+	c[i]->rav = h[i]->rav ? clone_history(h[i]->rav) : NULL;
+    }
+
+    c[n] = NULL;
+    return c;
+}
+
+void do_global_copy_game()
+{
+    int g = gindex;
+    int i, n;
+    struct userdata_s *d;
+
+    do_global_new_game();
+    d = gp->data;
+    n = pgn_tag_total(game[g]->tag);
+
+    for (i = 0; i < n; i++)
+	pgn_tag_add(&gp->tag, game[g]->tag[i]->name,
+		game[g]->tag[i]->value);
+
+    tags_changed(gindex);
+    pgn_board_init_fen (gp, d->b, NULL);
+    pgn_history_free(gp->history, 0);
+    free(gp->history);
+    gp->history = gp->hp = clone_history(game[g]->history);
+    moves_changed(gp);
+    n = gp->hindex = pgn_history_total(gp->hp);
+
+    if (n && game_init_fen(gp, d->b, gp->hp[n - 1]->fen) != E_PGN_OK)
+	SET_FLAG(gp->flags, GF_PERROR);
+}
+
+void do_global_new_all()
+{
+    construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, NULL,
+	    do_new_game_from_scratch, 0, 0, "%s", _("Really start a new game from scratch?"));
+}
+
+void do_quit(WIN *win)
+{
+    wchar_t str[] = { win->c, 0 };
+
+    if (wcscmp (str, yes_wchar))
+	return;
+
+    quit = 1;
+}
+
+void do_global_quit()
+{
+    if (config.exitdialogbox)
+	construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, NULL,
+			  do_quit, 0, 0, _("Want to Quit?"));
+    else
+	quit = 1;
+}
+
+void do_global_toggle_engine_window()
+{
+    if (!enginew) {
+	enginew = newwin(LINES, COLS, 0, 0);
+	enginep = new_panel(enginew);
+	window_draw_title(enginew, _("Engine IO Window"), COLS, CP_MESSAGE_TITLE,
+		CP_MESSAGE_BORDER);
+	hide_panel(enginep);
+    }
+
+    if (panel_hidden(enginep)) {
+	top_panel(enginep);
+	engine_window_redraw = 1;
+	update_engine_window(gp);
+    }
+    else {
+	hide_panel(enginep);
+    }
+}
+
+void do_global_toggle_board_details()
+{
+    do_board_details();
+}
+
+void do_global_toggle_strict_castling()
+{
+    do_toggle_strict_castling();
+}
+
+/*
+ * Scrolls the engine IO window when it is shown. Returns 1 if the key was
+ * handled.
+ */
+static int engine_window_keys()
+{
+    int rows = LINES - 3;
+
+    if (!enginew || panel_hidden(enginep))
+	return 0;
+
+    switch (input_c) {
+	case KEY_PPAGE:
+	    engine_window_offset += rows;
+	    break;
+	case KEY_NPAGE:
+	    engine_window_offset -= rows;
+	    break;
+	case KEY_HOME:
+	    engine_window_offset = engine_scrollback;
+	    break;
+	case KEY_END:
+	    engine_window_offset = 0;
+	    break;
+	default:
+	    return 0;
+    }
+
+    engine_window_redraw = 1;
+    update_engine_window(gp);
+    return 1;
+}
+
+// Global and other keys.
+static int globalkeys()
+{
+    struct userdata_s *d = gp->data;
+    int i;
+
+    if (engine_window_keys())
+	return 1;
+
+    /*
+     * These cannot be modified and other game mode keys cannot conflict with
+     * these.
+     */
+    switch (input_c) {
+	case KEY_ESCAPE:
+	    d->sp.icon = d->sp.srow = d->sp.scol = 0;
+	    markend = markstart = -1;
+
+	    if (keycount) {
+		keycount = 0;
+		update_status_notify(gp, NULL);
+	    }
+
+	    if (config.validmoves)
+		pgn_reset_valid_moves(d->b);
+
+	    return 1;
+	case '0' ... '9':
+	    i = input_c - '0';
+
+	    if (keycount)
+		keycount = keycount * 10 + i;
+	    else
+		keycount = i;
+
+	    update_status_notify(gp, _("Repeat %i"), keycount);
+	    return -1;
+	case KEY_UP:
+	    if (d->mode == MODE_HISTORY)
+		return 0;
+
+	    if (keycount)
+		d->c_row += keycount;
+	    else
+		d->c_row++;
+
+	    if (d->c_row > 8)
+		d->c_row = 1;
+
+	    return 1;
+	case KEY_DOWN:
+	    if (d->mode == MODE_HISTORY)
+		return 0;
+
+	    if (keycount) {
+		d->c_row -= keycount;
+		update_status_notify(gp, NULL);
+	    }
+	    else
+		d->c_row--;
+
+	    if (d->c_row < 1)
+		d->c_row = 8;
+
+	    return 1;
+	case KEY_LEFT:
+	    if (d->mode == MODE_HISTORY)
+		return 0;
+
+	    if (keycount)
+		d->c_col -= keycount;
+	    else
+		d->c_col--;
+
+	    if (d->c_col < 1)
+		d->c_col = 8;
+
+	    return 1;
+	case KEY_RIGHT:
+	    if (d->mode == MODE_HISTORY)
+		return 0;
+
+	    if (keycount)
+		d->c_col += keycount;
+	    else
+		d->c_col++;
+
+	    if (d->c_col > 8)
+		d->c_col = 1;
+
+	    return 1;
+	case KEY_RESIZE:
+	    return 1;
+	case 0:
+	default:
+	    for (i = 0; global_keys[i]; i++) {
+		if (input_c == global_keys[i]->c && global_keys[i]->f) {
+		    (*global_keys[i]->f)();
+		    return 1;
+		}
+	    }
+	    break;
+    }
+
+    return 0;
+}
+
+#ifdef WITH_LIBPERL
+static void perl_error(const char *fmt, ...)
+{
+    va_list ap;
+    char *buf;
+
+    va_start(ap, fmt);
+    vasprintf(&buf, fmt, ap);
+    va_end(ap);
+
+    message(ERROR_STR, ANY_KEY_STR, "%s", buf);
+    free(buf);
+}
+
+static void do_perl_finalize(WIN *win)
+{
+    struct input_data_s *in = win->data;
+    GAME g = in->data;
+    struct userdata_s *d = g->data;
+    char *filename;
+    char *result = NULL;
+    char *arg = NULL;
+    int n;
+
+    asprintf(&filename, "%s/perl.pl", config.datadir);
+
+    if (!in->str)
+	goto done;
+
+    if (perl_init_file(filename, perl_error))
+	goto done;
+
+    arg = pgn_game_to_fen(g, d->b);
+
+    if (perl_call_sub(trim(in->str), arg, &result))
+	goto done;
+
+    d->perlfen = pgn_game_to_fen(g, d->b);
+    d->perlflags = g->flags;
+
+    if (pgn_board_init_fen(g, d->b, result) != E_PGN_OK) {
+	message(ERROR_STR, ANY_KEY_STR, "%s", _("FEN parse error."));
+	pgn_board_init_fen(g, d->b, d->perlfen);
+	g->flags = d->perlflags;
+	free(d->perlfen);
+	d->perlfen = NULL;
+	goto done;
+    }
+
+    SET_FLAG(d->flags, CF_PERL);
+    n = pgn_tag_find(g->tag, "FEN");
+
+    if (n != E_PGN_ERR)
+	d->oldfen = strdup(g->tag[n]->value);
+
+    pgn_tag_add(&g->tag, "FEN", result);
+    tags_changed(gindex);
+    update_status_notify(g, "%s", ANY_KEY_STR);
+    update_all(g);
+
+done:
+    free(result);
+    free(arg);
+    free(in->str);
+    free(in);
+    free(filename);
+}
+
+void do_global_perl()
+{
+    struct input_data_s *in;
+
+    in = Calloc(1, sizeof(struct input_data_s));
+    in->data = gp;
+    in->efunc = do_perl_finalize;
+    construct_input(_("PERL Subroutine Filter"), NULL, 1, 0, NULL, NULL, NULL, 0, in, INPUT_HIST_PERL, -1);
+}
+#endif
+
+/*
+ * A macro may contain a key that belongs to another macro so macro_match will
+ * need to be updated to the new index of the matching macro.
+ */
+static void find_macro(struct userdata_s *d)
+{
+    int i;
+
+    /*
+     * Macros can't contain macros when in a window.
+     */
+    if (wins)
+	return;
+
+again:
+    for (i = 0; macros[i]; i++) {
+	if ((macros[i]->mode == -1 || macros[i]->mode == d->mode) &&
+		input_c == macros[i]->c) {
+	    input_c = macros[i]->keys[macros[i]->n++];
+
+	    if (!macro_depth_n && macro_match > -1) {
+		macro_depth = realloc(macro_depth, (macro_depth_n + 1) * sizeof(int));
+		macro_depth[macro_depth_n++] = macro_match;
+	    }
+
+	    macro_depth = realloc(macro_depth, (macro_depth_n + 1) * sizeof(int));
+	    macro_depth[macro_depth_n++] = i;
+	    macro_match = i;
+	    goto again;
+	}
+    }
+}
+
+/*
+ * Resets the position in each macro to the first key.
+ */
+static void reset_macros()
+{
+    int i;
+    struct userdata_s *d = gp->data;
+
+again:
+    if (macro_depth_n > 0) {
+	macro_depth_n--;
+	macro_match = macro_depth[macro_depth_n];
+
+	if (macros[macro_match]->n >= macros[macro_match]->total)
+	    goto again;
+
+	input_c = macros[macro_match]->keys[macros[macro_match]->n++];
+	find_macro(d);
+	return;
+    }
+
+    for (i = 0; macros[i]; i++)
+	macros[i]->n = 0;
+
+    free(macro_depth);
+    macro_depth = NULL;
+    macro_depth_n = 0;
+    macro_match = -1;
 }
 
-void do_game_delete_finalize(int n)
+/*
+ * Reads engine output directly into the engines fixed size buffer. Lines
+ * are split in place and every complete line is passed to
+ * parse_engine_output() in a single call. Characters past ENGINE_LINE_MAX
+ * are dropped up to the next newline. A trailing partial line is moved to
+ * the start of the buffer for the next read(). Returns the value of read().
+ */
+static int read_engine_output(GAME g)
+{
+    struct userdata_s *d = g->data;
+    struct engine_s *e = d->engine;
+    HISTORY **hp = g->hp;
+    int total = pgn_history_total(g->hp);
+    int len, r, w, col, last = -1;
+    char c;
+
+    if (!e->iobuf) {
+	e->iobuf = Malloc(ENGINE_IOBUF_SIZE + 1);
+	e->len = 0;
+    }
+
+    len = read(e->fd[ENGINE_IN_FD], e->iobuf + e->len,
+	    ENGINE_IOBUF_SIZE - e->len);
+
+    if (len <= 0)
+	return len;
+
+    /*
+     * The pending partial line never contains a newline and is never longer
+     * than ENGINE_LINE_MAX so the write position never passes the read
+     * position.
+     */
+    col = e->len;
+
+    for (r = w = e->len; r < e->len + len; r++) {
+	c = e->iobuf[r];
+
+	if (c == '\n' || c == '\r') {
+	    e->iobuf[w++] = c;
+	    last = w;
+	    col = 0;
+	}
+	else if (col < ENGINE_LINE_MAX) {
+	    e->iobuf[w++] = c;
+	    col++;
+	}
+    }
+
+    if (last == -1) {
+	e->len = w;
+	return len;
+    }
+
+    c = e->iobuf[last];
+    e->iobuf[last] = 0;
+    parse_engine_output(g, e->iobuf);
+    e->iobuf[last] = c;
+
+    /* The engine may have added its move to the current line. */
+    if (g->hp != hp || pgn_history_total(g->hp) != total)
+	moves_changed(g);
+
+    memmove(e->iobuf, e->iobuf + last, w - last);
+    e->len = w - last;
+    return len;
+}
+
+void game_loop()
 {
     struct userdata_s *d;
 
-    delete_game((!n) ? gindex : -1);
+    macro_match = -1;
+    gindex = gtotal - 1;
+    gp = use_game(gindex);
     d = gp->data;
-    if (d->mode != MODE_EDIT)
+
+    if (pgn_history_total(gp->hp))
+	d->mode = MODE_HISTORY;
+    else {
+         d->mode = MODE_PLAY;
+	 d->play_mode = PLAY_HE;
+    }
+
+	d->rotate = FALSE;
+	d->go_move = 0;
+	d->pm_undo = FALSE;
+	d->pm_frfr[0] = '\0';
+
+    if (d->mode == MODE_HISTORY)
 	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
-}
 
-void do_game_delete_confirm(WIN *win)
-{
-    int *n;
-    wchar_t str[] = { win->c, 0 };
+    update_status_notify(gp, "%s", _("Type F1 for help"));
+    movestep = 2;
+    flushinp();
+    update_all(gp);
+    wtimeout(boardw, WINDOW_TIMEOUT);
+
+    while (!quit) {
+	int n = 0, i;
+	int len;
+	struct timeval tv = {0, 0};
+	fd_set rfds, wfds;
+	WIN *win = NULL;
+	WINDOW *wp = NULL;
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	/* Only games with userdata can have an engine. */
+	for (i = 0; i < userdata_total; i++) {
+	    d = userdata_games[i]->data;
+
+	    if (d->engine && d->engine->pid != -1) {
+		if (d->engine->fd[ENGINE_IN_FD] > 2) {
+		    if (d->engine->fd[ENGINE_IN_FD] > n)
+			n = d->engine->fd[ENGINE_IN_FD];
+
+		    FD_SET(d->engine->fd[ENGINE_IN_FD], &rfds);
+		}
+
+		if (d->engine->fd[ENGINE_OUT_FD] > 2) {
+		    if (d->engine->fd[ENGINE_OUT_FD] > n)
+			n = d->engine->fd[ENGINE_OUT_FD];
+
+		    FD_SET(d->engine->fd[ENGINE_OUT_FD], &wfds);
+		}
+	    }
+	}
+
+	if (n) {
+	    if ((n = select(n + 1, &rfds, &wfds, NULL, &tv)) > 0) {
+		for (i = 0; i < userdata_total; i++) {
+		    d = userdata_games[i]->data;
+
+		    if (d->engine && d->engine->pid != -1) {
+			if (FD_ISSET(d->engine->fd[ENGINE_IN_FD], &rfds)) {
+			    len = read_engine_output(userdata_games[i]);
+
+			    if (len == -1) {
+				if (errno != EAGAIN) {
+				    cmessage(ERROR_STR, ANY_KEY_STR, "Engine read(): %s",
+					    strerror(errno));
+				    waitpid(d->engine->pid, &n, 0);
+				    release_engine(userdata_games[i]);
+				    free(d->engine->iobuf);
+				    free_enginebuf(d->engine);
+				    free(d->engine);
+				    d->engine = NULL;
+				    break;
+				}
+			    }
+			}
+
+			if (FD_ISSET(d->engine->fd[ENGINE_OUT_FD], &wfds)) {
+			    if (d->engine->queue)
+				send_engine_command(userdata_games[i]);
+			}
+		    }
+		}
+	    }
+	    else {
+		if (n == -1)
+		    cmessage(ERROR_STR, ANY_KEY_STR, "select(): %s", strerror(errno));
+		/* timeout */
+	    }
+	}
+
+	gp = use_game(gindex);
+	d = gp->data;
+	sync_analysis(gp);
+	flush_frame();
+
+	/*
+	 * This is needed to detect terminal resizing.
+	 */
+	doupdate();
+	if (LINES != LINES_OLD || COLS != COLS_OLD) {
+		COLS_OLD = COLS;
+		LINES_OLD = LINES;
+		do_window_resize();
+	}
+
+	/*
+	 * Finds the top level window in the window stack so we know what
+	 * window the wget_wch()'ed key belongs to.
+	 */
+	if (wins) {
+	    for (i = 0; wins[i]; i++);
+	    win = wins[i-1];
+	    wp = win->w;
+	}
+	else
+	    wp = boardw;
+
+	/* Wake up in time to draw a frame that was held back. */
+	wtimeout(wp, frame_timeout(WINDOW_TIMEOUT));
+
+	if (!i && pushkey)
+	    input_c = pushkey;
+	else {
+	    if (!pushkey) {
+		if (macros && macro_match >= 0) {
+		    if (macros[macro_match]->n >= macros[macro_match]->total)
+			reset_macros();
+		    else {
+			input_c = macros[macro_match]->keys[macros[macro_match]->n++];
+			find_macro(d);
+		    }
+		}
+		else {
+		  if (wget_wch(wp, &input_c) == ERR || input_c == KEY_RESIZE)
+		      continue;
+		}
+	    }
+	    else
+		input_c = pushkey;
+
+	    if (win) {
+		win->c = input_c;
+
+		/*
+		 * Run the function associated with the window. When the
+		 * function returns 0 win->efunc is ran (if not NULL) with
+		 * win as the one and only parameter. Then the window is
+		 * destroyed.
+		 *
+		 * The exit function may create another window which will
+		 * mess up the window stack when window_destroy() is called.
+		 * So don't destory the window until the top window is
+		 * destroyable. See window_destroy().
+		 */
+		if ((*win->func)(win) == 0) {
+		    if (win->efunc)
+			(*win->efunc)(win);
+
+		    win->keep = 1;
+		    window_destroy(win);
+		    update_all(gp);
+		}
+
+		continue;
+	    }
+	}
+
+	if (!keycount && status.notify)
+	    update_status_notify(gp, NULL);
+
+#ifdef WITH_LIBPERL
+	if (TEST_FLAG(d->flags, CF_PERL)) {
+	    CLEAR_FLAG(d->flags, CF_PERL);
+	    pgn_board_init_fen(gp, d->b, d->perlfen);
+	    gp->flags = d->perlflags;
+	    free(d->perlfen);
+	    pgn_tag_add(&gp->tag, "FEN", d->oldfen);
+	    tags_changed(gindex);
+	    free(d->oldfen);
+	    d->perlfen = d->oldfen = NULL;
+	    update_all(gp);
+	    continue;
+	}
+#endif
+
+	if (macros && macro_match < 0)
+	    find_macro(d);
+
+	if ((n = globalkeys()) == 1) {
+	    if (macro_match == -1)
+		keycount = 0;
+
+	    goto refresh;
+	}
+	else if (n == -1)
+	    goto refresh;
+
+	switch (d->mode) {
+	    case MODE_EDIT:
+		for (i = 0; edit_keys[i]; i++) {
+		    if (input_c == edit_keys[i]->c) {
+			(*edit_keys[i]->f)();
+			break;
+		    }
+		}
+		break;
+	    case MODE_PLAY:
+		for (i = 0; play_keys[i]; i++) {
+		    if (input_c == play_keys[i]->c) {
+			(*play_keys[i]->f)();
+			goto done;
+		    }
+		}
+
+		do_play_config_command();
+		break;
+	    case MODE_HISTORY:
+		for (i = 0; history_keys[i]; i++) {
+		    if (input_c == history_keys[i]->c) {
+			(*history_keys[i]->f)();
+			break;
+		    }
+		}
+		break;
+	    default:
+		break;
+	}
+
+done:
+	if (keycount)
+	    update_status_notify(gp, NULL);
+
+	keycount = 0;
 
-    if (wcscmp (str, yes_wchar)) {
-	free(win->data);
-	return;
+refresh:
+	update_all(gp);
     }
-
-    n = (int *)win->data;
-    do_game_delete_finalize(*n);
-    free(win->data);
 }
 
-void do_game_delete()
+/*
+ * An engine used by the batch modes. These run without curses so the
+ * engine.c interface can't be used. The engine process is connected with a
+ * socketpair and always speaks the xboard protocol.
+ */
+struct batch_engine_s {
+    const char *cmd;
+    pid_t pid;
+    int fd;
+    char buf[ENGINE_IOBUF_SIZE + 1];
+    int len;
+    int pos;
+};
+
+static int batch_engine_send(struct batch_engine_s *e, const char *fmt, ...)
 {
-    char *tmp = NULL;
-    int i, n;
-    struct userdata_s *d;
-    int *p;
+    va_list ap;
+    char buf[LINE_MAX];
+    int len, n, i;
 
-    if (gtotal < 2) {
-	cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
-	return;
-    }
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
 
-    tmp = NULL;
+    if (len >= sizeof(buf))
+	len = sizeof(buf) - 1;
 
-    for (i = n = 0; i < gtotal; i++) {
-	d = game[i]->data;
+    for (i = 0; i < len; i += n) {
+	n = write(e->fd, buf + i, len - i);
 
-	if (TEST_FLAG(d->flags, CF_DELETE))
-	    n++;
-    }
+	if (n == -1) {
+	    if (errno != EINTR)
+		return 1;
 
-    if (!n)
-	tmp = _("Delete the current game?");
-    else {
-	if (n == gtotal) {
-	    cmessage(NULL, ANY_KEY_STR, "%s", _("Cannot delete last game."));
-	    return;
+	    n = 0;
 	}
-
-	tmp = _("Delete all games marked for deletion?");
     }
 
-    if (config.deleteprompt) {
-	p = Malloc(sizeof(int));
-	*p = n;
-	construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, p,
-		do_game_delete_confirm, 0, 0, tmp);
-	return;
-    }
-
-    do_game_delete_finalize(n);
+    return 0;
 }
 
-void do_find_game_exp_finalize(int which)
+static int batch_engine_start(struct batch_engine_s *e, const char *cmd)
 {
-    struct userdata_s *d = gp->data;
-    int n;
-
-    if ((n = find_game_exp(gameexp, (which == -1) ? 0 : 1,
-		    (keycount) ? keycount : 1)) == -1) {
-	update_status_notify(gp, "%s", _("No matches found"));
-	return;
-    }
-
-    gindex = n;
-    d = gp->data;
-
-    if (pgn_history_total(gp->hp))
-	d->mode = MODE_HISTORY;
-
-    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
-}
+    int sv[2];
+    char *sh;
 
-void do_find_game_exp(WIN *win)
-{
-    struct input_data_s *in = win->data;
-    int *n = in->data;
-    int c = *n;
+    memset(e, 0, sizeof(struct batch_engine_s));
+    e->cmd = cmd;
+    e->fd = -1;
 
-    if (in->str) {
-	strncpy(gameexp, in->str, sizeof(gameexp));
-	gameexp[sizeof(gameexp)-1] = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+	return 1;
 
-	if (c == '?')
-	    c = '}';
+    sh = Malloc(strlen(cmd) + 6);
+    sprintf(sh, "exec %s", cmd);
 
-	do_find_game_exp_finalize(c);
-	free(in->str);
+    switch ((e->pid = fork())) {
+	case -1:
+	    close(sv[0]);
+	    close(sv[1]);
+	    free(sh);
+	    return 1;
+	case 0:
+	    dup2(sv[1], STDIN_FILENO);
+	    dup2(sv[1], STDOUT_FILENO);
+	    close(sv[0]);
+	    close(sv[1]);
+	    execl("/bin/sh", "sh", "-c", sh, (char *)NULL);
+	    _exit(EXIT_FAILURE);
+	default:
+	    break;
     }
 
-    free(in->data);
-    free(in);
+    free(sh);
+    close(sv[1]);
+    e->fd = sv[0];
+    return batch_engine_send(e, "xboard\nprotover 2\nnew\neasy\npost\n");
 }
 
-void do_game_jump_finalize(int n)
+static void batch_engine_stop(struct batch_engine_s *e)
 {
-    struct userdata_s *d;
+    int i;
 
-    if (--n > gtotal - 1 || n < 0)
+    if (e->pid <= 0)
 	return;
 
-    gindex = n;
-    gp = game[gindex];
-    d = gp->data;
-    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
-    update_status_notify(gp, NULL);
-}
-
-void do_game_jump(WIN *win)
-{
-    struct input_data_s *in = win->data;
+    batch_engine_send(e, "quit\n");
+    close(e->fd);
+    e->fd = -1;
 
-    if (!in->str || !isinteger(in->str)) {
-	if (in->str)
-	    free(in->str);
+    for (i = 0; i < 10 && waitpid(e->pid, NULL, WNOHANG) == 0; i++)
+	usleep(50000);
 
-	free(in);
-	return;
+    if (i == 10) {
+	kill(e->pid, SIGKILL);
+	waitpid(e->pid, NULL, 0);
     }
 
-    do_game_jump_finalize(atoi(in->str));
-    free(in->str);
-    free(in);
+    e->pid = -1;
 }
 
-void do_load_file(WIN *win)
+/*
+ * Reads pending output from engine 'e'. A line that doesn't fit in the
+ * buffer is discarded. Returns the value of read().
+ */
+static int batch_engine_read(struct batch_engine_s *e)
 {
-    struct input_data_s *in = win->data;
-    char *tmp = in->str;
-    struct userdata_s *d;
-    PGN_FILE *pgn = NULL;
     int n;
 
-    if (!in->str) {
-	free(in);
-	return;
-    }
-
-    if ((tmp = pathfix(tmp)) == NULL)
-	goto done;
+    if (e->len == ENGINE_IOBUF_SIZE)
+	e->len = e->pos = 0;
 
-    n = pgn_open(tmp, "r", &pgn);
+    n = read(e->fd, e->buf + e->len, ENGINE_IOBUF_SIZE - e->len);
 
-    if (n == E_PGN_ERR) {
-	cmessage(ERROR_STR, ANY_KEY_STR, "%s\n%s", tmp, strerror(errno));
-	goto done;
-    }
-    else if (n == E_PGN_INVALID) {
-	cmessage(ERROR_STR, ANY_KEY_STR, "%s\n%s", tmp, _("Not a regular file"));
-	goto done;
-    }
+    if (n > 0)
+	e->len += n;
 
-    free_userdata();
+    return n;
+}
 
-    if (pgn_parse(pgn) == E_PGN_ERR) {
-	del_panel(loadingp);
-	delwin(loadingw);
-	loadingw = NULL;
-	loadingp = NULL;
-	init_userdata();
-	goto done;
-    }
+/*
+ * Returns the next complete line of output from engine 'e' or NULL. The
+ * line is only valid until the next call.
+ */
+static char *batch_engine_line(struct batch_engine_s *e)
+{
+    char *p, *nl;
 
-    del_panel(loadingp);
-    delwin(loadingw);
-    loadingw = NULL;
-    loadingp = NULL;
-    init_userdata();
-    strncpy(loadfile, tmp, sizeof(loadfile));
-    loadfile[sizeof(loadfile)-1] = 0;
-    gp = game[gindex];
-    d = gp->data;
+    nl = memchr(e->buf + e->pos, '\n', e->len - e->pos);
 
-    if (pgn_history_total(gp->hp))
-	d->mode = MODE_HISTORY;
+    if (!nl) {
+	memmove(e->buf, e->buf + e->pos, e->len - e->pos);
+	e->len -= e->pos;
+	e->pos = 0;
+	return NULL;
+    }
 
-    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+    *nl = 0;
+    p = e->buf + e->pos;
+    e->pos = nl - e->buf + 1;
 
-    fm_loaded_file = TRUE;
-	d->rotate = FALSE;
+    if (nl > p && *(nl - 1) == '\r')
+	*(nl - 1) = 0;
 
-done:
-    pgn_close(pgn);
+    return p;
+}
 
-    if (in->str)
-	free(in->str);
+static int fen_turn(const char *fen)
+{
+    const char *p = strchr(fen, ' ');
 
-    free(in);
+    return (p && p[1] == 'b') ? BLACK : WHITE;
 }
 
-void do_game_save(WIN *win)
+/*
+ * Converts the principal variation 'pv' from the position 'fen' to SAN and
+ * stores at most 'max' moves in 'dst'. Move numbers in 'pv' are skipped and
+ * conversion stops at the first invalid move. The game state of 'g' is
+ * restored afterwards. Returns the number of moves converted.
+ */
+static int pv_to_san(GAME g, const char *fen, const char *pv, char *dst,
+	size_t size, int max)
 {
-    struct input_data_s *in = win->data;
-    int *x = in->data;
-    int n = *x;
-    char *tmp = in->str;
-    char tfile[FILENAME_MAX];
-    char *p;
-    int i;
-    struct userdata_s *d;
+    struct game_s save = *g;
+    BOARD b;
+    char tok[32], *m, *frfr;
+    char *tmp = strdup(fen);
+    int n, total = 0;
+    size_t len = 0;
 
-    if (!tmp || (tmp = pathfix(tmp)) == NULL)
+    *dst = 0;
+
+    if (pgn_board_init_fen(g, b, tmp) != E_PGN_OK)
 	goto done;
 
-    if (pgn_is_compressed(tmp) == E_PGN_ERR) {
-	p = tmp + strlen(tmp) - 1;
+    while (total < max && sscanf(pv, "%31s%n", tok, &n) == 1) {
+	pv += n;
 
-	if (*p != 'n' || *(p-1) != 'g' || *(p-2) != 'p' ||
-		*(p-3) != '.') {
-	    snprintf(tfile, sizeof(tfile), "%s.pgn", tmp);
-	    tmp = tfile;
-	}
-    }
+	if (isdigit(*tok) || *tok == '.')
+	    continue;
 
-    /*
-     * When in edit mode, update the FEN tag.
-     */
-    if (n == -1) {
-	for (i = 0; i < gtotal; i++) {
-	    d = game[i]->data;
+	if (strlen(tok) > MAX_SAN_MOVE_LEN)
+	    break;
 
-	    if (d->mode == MODE_EDIT) {
-	        char *fen = pgn_game_to_fen(game[i], d->b);
+	m = Malloc(MAX_SAN_MOVE_LEN + 1);
+	strcpy(m, tok);
+	frfr = NULL;
 
-		pgn_tag_add(&game[i]->tag, "FEN", fen);
-		free (fen);
-	    }
+	if (pgn_parse_move(g, b, &m, &frfr) != E_PGN_OK) {
+	    free(m);
+	    break;
 	}
-    }
-    else {
-	d = game[n]->data;
 
-	if (d->mode == MODE_EDIT) {
-	    char *fen = pgn_game_to_fen(game[n], d->b);
+	free(frfr);
+	len += snprintf(dst + len, size - len, "%s%s", total ? " " : "", m);
+	free(m);
+	pgn_switch_turn(g);
+	total++;
 
-	    pgn_tag_add(&game[n]->tag, "FEN", fen);
-	    free (fen);
+	if (len >= size) {
+	    dst[size - 1] = 0;
+	    break;
 	}
     }
 
-    save_pgn(tmp, n);
-
 done:
-    if (in->str)
-	free(in->str);
+    free(tmp);
+    *g = save;
+    return total;
+}
 
-    free(in->data);
-    free(in);
+/*
+ * Centipawn value of 'l' from the side to move's point of view. Mate scores
+ * are clamped to ANNOTATE_MATE_CP.
+ */
+static int analysis_cp(struct analysis_line_s *l)
+{
+    if (l->mate)
+	return (l->mate > 0) ? ANNOTATE_MATE_CP : -ANNOTATE_MATE_CP;
+
+    if (l->score > ANNOTATE_MATE_CP)
+	return ANNOTATE_MATE_CP;
+
+    return (l->score < -ANNOTATE_MATE_CP) ? -ANNOTATE_MATE_CP : l->score;
 }
 
-void do_get_game_save_input(int n)
+/*
+ * Formats the score of 'l' from whites point of view. 'turn' is the side to
+ * move in the analyzed position.
+ */
+static char *analysis_score(struct analysis_line_s *l, int turn, char *buf,
+	size_t size)
 {
-    struct input_data_s *in = Calloc(1, sizeof(struct input_data_s));
-    int *p = Malloc(sizeof(int));
+    int sign = (turn == WHITE) ? 1 : -1;
 
-    in->efunc = do_game_save;
-    *p = n;
-    in->data = p;
+    if (l->mate)
+	snprintf(buf, size, "#%i/%i", l->mate * sign, l->depth);
+    else
+	snprintf(buf, size, "%+.2f/%i", (double)(l->score * sign) / 100,
+		l->depth);
 
-    construct_input(_("Save Game Filename"), loadfile, 1, 1, _("Type TAB for file browser"),
-	file_browser, NULL, '\t', in, INPUT_HIST_FILE, -1);
+    return buf;
 }
 
-void do_game_save_multi_confirm(WIN *win)
+static void add_nag(HISTORY *h, int nag)
 {
     int i;
-    wchar_t str[] = { win->c, 0 };
 
-    if (!wcscmp (str, current_wchar))
-	i = gindex;
-    else if (!wcscmp (str, all_wchar))
-	i = -1;
-    else {
-	update_status_notify(gp, "%s", _("Save game aborted."));
-	return;
+    for (i = 0; i < MAX_PGN_NAG; i++) {
+	/* Don't override an existing move assessment. */
+	if (h->nag[i] >= 1 && h->nag[i] <= 6)
+	    return;
+    }
+
+    for (i = 0; i < MAX_PGN_NAG; i++) {
+	if (!h->nag[i]) {
+	    h->nag[i] = nag;
+	    return;
+	}
     }
-
-    do_get_game_save_input(i);
 }
 
-void do_global_about()
+static void append_comment(HISTORY *h, const char *str)
 {
-    cmessage(_("ABOUT"), ANY_KEY_STR,
-	     _("%s\nUsing %s with %i colors and %i color pairs\n%s"),
-	     PACKAGE_STRING, curses_version(), COLORS, COLOR_PAIRS,
-	     COPYRIGHT);
+    if (h->comment && *h->comment) {
+	h->comment = Realloc(h->comment, strlen(h->comment) +
+		strlen(str) + 2);
+	strcat(h->comment, " ");
+	strcat(h->comment, str);
+    }
+    else {
+	free(h->comment);
+	h->comment = strdup(str);
+    }
 }
 
-void global_game_next_prev(int which)
+/*
+ * Compares two SAN moves ignoring any check or mate suffix.
+ */
+static int san_equal(const char *a, const char *b)
 {
-    struct userdata_s *d;
+    size_t la = strcspn(a, "+# ");
+    size_t lb = strcspn(b, "+# ");
 
-    game_next_prev(gp, (which == 1) ? 1 : 0,
-	    (keycount) ? keycount : 1);
-    d = gp->data;
+    return la == lb && !strncmp(a, b, la);
+}
 
-    if (delete_count) {
-	if (which == 1) {
-	    markend = markstart + delete_count;
-	    delete_count = 0;
+/*
+ * Writes the engine evaluations in 'pos' (one per position of the mainline,
+ * 'total' being the number of moves) to the move comments of game 'n'. Moves
+ * that lose enough compared to the position before get a NAG and the
+ * engines preferred variation.
+ */
+static void annotate_game(int n, struct analysis_line_s *pos, int total)
+{
+    GAME g = game[n];
+    HISTORY **h = g->history;
+    const char *fen = game_start_fen(n);
+    char buf[MAX_PGN_LINE_LEN + 1], pv[MAX_PGN_LINE_LEN + 1];
+    char score[32], bscore[32];
+    int i, turn, before, after, nag;
+
+    for (i = 0; i < total; fen = h[i++]->fen) {
+	turn = fen_turn(fen);
+	*buf = 0;
+
+	if (pos[i + 1].depth) {
+	    analysis_score(&pos[i + 1], !turn, score, sizeof(score));
+	    snprintf(buf, sizeof(buf), "%s", score);
+	    after = -analysis_cp(&pos[i + 1]);
 	}
-	else {
-	    markend = markstart - delete_count + 1;
-	    delete_count = -1; // to fix gindex in the other direction
+	else if (strchr(h[i]->move, '#'))
+	    after = ANNOTATE_MATE_CP;
+	else
+	    continue;
+
+	if (pos[i].depth) {
+	    before = analysis_cp(&pos[i]);
+	    nag = (before - after >= ANNOTATE_BLUNDER) ? 4 :
+		(before - after >= ANNOTATE_MISTAKE) ? 2 :
+		(before - after >= ANNOTATE_DUBIOUS) ? 6 : 0;
+
+	    if (nag && pv_to_san(g, fen, pos[i].pv, pv, sizeof(pv),
+			ANNOTATE_PV_MOVES) && !san_equal(pv, h[i]->move)) {
+		add_nag(h[i], nag);
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+			"%sbest: %s %s", *buf ? "; " : "", pv,
+			analysis_score(&pos[i], turn, bscore,
+			    sizeof(bscore)));
+	    }
 	}
 
-	fix_marks(&markstart, &markend);
-	do_global_toggle_delete();
+	if (*buf)
+	    append_comment(h[i], buf);
     }
-
-    if (d->mode == MODE_HISTORY)
-	pgn_board_update(gp, d->b, gp->hindex);
-    else if (d->mode == MODE_PLAY)
-	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
 }
 
-void do_global_next_game()
-{
-    global_game_next_prev(1);
-}
+/*
+ * A game being annotated by a pooled engine. 'n' is the position being
+ * searched: 0 is the starting position and 'total' the final one.
+ */
+struct annotate_job_s {
+    struct batch_engine_s e;
+    int g;
+    int n;
+    int total;
+    long start;		/* When position 'n' was sent. */
+    struct analysis_line_s *pos;
+};
 
-void do_global_prev_game()
+/*
+ * Sends the next position of the job to the engine. Returns 1 when the game
+ * has been fully searched.
+ */
+static int annotate_next_position(struct annotate_job_s *j)
 {
-    global_game_next_prev(0);
+    GAME g = game[j->g];
+
+    /* There is nothing to search after checkmate. */
+    if (j->n == j->total && j->total
+	    && strchr(g->history[j->total - 1]->move, '#'))
+	j->n++;
+
+    if (j->n > j->total)
+	return 1;
+
+    j->start = monotonic_ms();
+    batch_engine_send(&j->e, "force\nsetboard %s\ngo\n",
+	    j->n ? g->history[j->n - 1]->fen : game_start_fen(j->g));
+    return 0;
 }
 
-void global_find(int which)
+/*
+ * Handles a line of engine output. Thinking output updates the evaluation
+ * of the current position and the engines move (or a result or an illegal
+ * position) finishes it. Returns 1 when the game has been fully searched.
+ */
+static int annotate_parse_line(struct annotate_job_s *j, char *line)
 {
-    struct input_data_s *in;
-    int *p;
-
-    if (gtotal < 2)
-	return;
+    struct analysis_line_s l = {0};
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    p = Malloc(sizeof(int));
-    *p = which;
-    in->data = p;
-    in->efunc = do_find_game_exp;
+    while (isspace(*line))
+	line++;
 
-    if (!*gameexp || which == 0) {
-	construct_input(_("Find Game by Tag Expression"), NULL, 1, 0,
-		_("[name expression:]value expression"), NULL, NULL, 0, in,
-		INPUT_HIST_GAME_EXP, -1);
-	return;
+    if (!parse_xboard_thinking(line, &l)) {
+	j->pos[j->n] = l;
+	return 0;
     }
 
-    free(p);
-    free(in);
-    do_find_game_exp_finalize(which);
-}
+    if (strncmp(line, "move ", 5) && strncmp(line, "My move is", 10)
+	    && strncmp(line, "1-0", 3) && strncmp(line, "0-1", 3)
+	    && strncmp(line, "1/2-1/2", 7) && strncmp(line, "resign", 6)
+	    && strncmp(line, "Illegal move", 12)
+	    && strncmp(line, "tellusererror", 13))
+	return 0;
 
-void do_global_find_new()
-{
-    global_find(0);
+    j->n++;
+    return annotate_next_position(j);
 }
 
-void do_global_find_next()
+static void annotate_job_finish(struct annotate_job_s *j, int annotate)
 {
-    global_find(1);
-}
+    if (annotate)
+	annotate_game(j->g, j->pos, j->total);
 
-void do_global_find_prev()
-{
-    global_find(-1);
+    free(j->pos);
+    j->pos = NULL;
+    j->g = -1;
 }
 
-void do_global_game_jump()
+static int annotate_engine_start(struct annotate_job_s *j, const char *cmd,
+	int depth, int secs)
 {
-    if (gtotal < 2)
-	return;
+    if (batch_engine_start(&j->e, cmd)) {
+	warn("%s", cmd);
+	j->e.pid = -1;
+	return 1;
+    }
 
-    if (!keycount) {
-        struct input_data_s *in;
+    if (depth)
+	batch_engine_send(&j->e, "sd %i\n", depth);
 
-	in = Calloc(1, sizeof(struct input_data_s));
-	in->efunc = do_game_jump;
-	construct_input(_("Jump to Game Number"), NULL, 1, 1, NULL, NULL, NULL, 0, in,
-		-1, 0);
-	return;
-    }
+    if (secs || !depth)
+	batch_engine_send(&j->e, "st %i\n", secs ? secs : 1);
 
-    do_game_jump_finalize(keycount);
+    return 0;
 }
 
-void do_global_toggle_delete()
+/*
+ * Runs 'jobs' instances of engine 'cmd' over every position of every game
+ * and annotates the games with the results. Each engine searches a whole
+ * game at a time. 'depth' and 'secs' are the search limits per position.
+ * Returns 0 on success or 1 if an engine failed or timed out or the run was
+ * interrupted.
+ */
+static int annotate_games(const char *cmd, int jobs, int depth, int secs)
 {
-    int i;
+    struct annotate_job_s *j;
+    int i, n, next = 0, busy, ret = 0;
+    long timeout = (secs ? secs : depth ? ANNOTATE_DEPTH_SECS : 1) * 1000L
+	+ ANNOTATE_MARGIN_MS;
+    fd_set rfds;
+    char *line;
 
-    pushkey = 0;
+    if (jobs > gtotal)
+	jobs = gtotal;
 
-    if (gtotal < 2)
-	return;
+    if (jobs < 1)
+	jobs = 1;
 
-    if (keycount && delete_count == 0) {
-	markstart = gindex;
-	delete_count = keycount;
-	update_status_notify(gp, "%s (delete)", status.notify);
-	return;
-    }
+    signal(SIGPIPE, SIG_IGN);
+    j = Calloc(jobs, sizeof(struct annotate_job_s));
 
-    if (markstart >= 0 && markend >= 0) {
-	for (i = markstart; i < markend; i++) {
-	    if (toggle_delete_flag(i)) {
-		return;
-	    }
-	}
+    for (i = 0; i < jobs; i++) {
+	j[i].g = -1;
 
-	gindex = (delete_count < 0) ? markstart : i - 1;
-    }
-    else {
-	if (toggle_delete_flag(gindex))
-	    return;
+	if (annotate_engine_start(&j[i], cmd, depth, secs))
+	    ret = 1;
     }
 
-    markstart = markend = -1;
-    delete_count = 0;
-    update_status_window(gp);
-}
+    for (;;) {
+	long now = monotonic_ms(), wait = -1, r;
+	struct timeval tv;
 
-void do_global_delete_game()
-{
-    do_game_delete();
-}
+	FD_ZERO(&rfds);
+	busy = n = 0;
 
-void do_global_tag_edit()
-{
-    struct userdata_s *d = gp->data;
+	for (i = 0; i < jobs; i++) {
+	    if (j[i].e.pid <= 0)
+		continue;
 
-    edit_tags(gp, d->b, 1);
-}
+	    while (j[i].g == -1 && next < gtotal) {
+		j[i].g = next++;
+		j[i].n = 0;
+		j[i].total = pgn_history_total(game[j[i].g]->history);
+		j[i].pos = Calloc(j[i].total + 2,
+			sizeof(struct analysis_line_s));
 
-void do_global_tag_view()
-{
-    struct userdata_s *d = gp->data;
+		if (!j[i].total || annotate_next_position(&j[i]))
+		    annotate_job_finish(&j[i], 0);
+	    }
 
-    edit_tags(gp, d->b, 0);
-}
+	    if (j[i].g == -1)
+		continue;
 
-void do_global_resume_game()
-{
-    struct input_data_s *in;
+	    busy++;
+	    FD_SET(j[i].e.fd, &rfds);
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->efunc = do_load_file;
-    construct_input(_("Load Filename"), NULL, 1, 1, _("Type TAB for file browser"), file_browser,
-	    NULL, '\t', in, INPUT_HIST_FILE, -1);
-}
+	    if (j[i].e.fd > n)
+		n = j[i].e.fd;
 
-void do_global_save_game()
-{
-    if (gtotal > 1) {
-	construct_message(NULL, _("What would you like to do?"), 0, 1,
-			  NULL, NULL, NULL, do_game_save_multi_confirm, 0, 0,
-			  _("There is more than one game loaded. Press \"%ls\" to save the current game, \"%ls\" to save all games or any other key to cancel."),
-			  current_wchar, all_wchar);
-	return;
-    }
+	    r = j[i].start + timeout - now;
 
-    do_get_game_save_input(-1);
-}
+	    if (wait == -1 || r < wait)
+		wait = (r < 0) ? 0 : r;
+	}
 
-void do_global_new_game()
-{
-    do_new_game();
-}
+	/* Interrupted. Games still being searched are not annotated. */
+	if (!busy || quit)
+	    break;
 
-void do_global_copy_game()
-{
-    int g = gindex;
-    int i, n;
-    struct userdata_s *d;
+	tv.tv_sec = wait / 1000;
+	tv.tv_usec = (wait % 1000) * 1000 + 1000;
 
-    do_global_new_game();
-    d = gp->data;
-    n = pgn_tag_total(game[g]->tag);
+	if (select(n + 1, &rfds, NULL, NULL, &tv) == -1) {
+	    if (errno == EINTR)
+		continue;
 
-    for (i = 0; i < n; i++)
-	pgn_tag_add(&gp->tag, game[g]->tag[i]->name,
-		game[g]->tag[i]->value);
+	    err(EXIT_FAILURE, "select()");
+	}
 
-    pgn_board_init_fen (gp, d->b, NULL);
-    n = pgn_history_total(game[g]->history);
+	for (i = 0; i < jobs; i++) {
+	    if (j[i].g == -1 || !FD_ISSET(j[i].e.fd, &rfds))
+		continue;
 
-    // FIXME RAV
-    for (i = 0; i < n; i++) {
-	char *frfr = NULL;
-	char *move = strdup (game[g]->history[i]->move);
+	    n = batch_engine_read(&j[i].e);
 
-	if (pgn_parse_move(gp, d->b, &move, &frfr) != E_PGN_OK) {
-	    free (move);
-	    SET_FLAG(gp->flags, GF_PERROR);
-	    return;
-	}
+	    if (n <= 0) {
+		if (n == -1 && (errno == EINTR || errno == EAGAIN))
+		    continue;
 
-	pgn_history_add(gp, d->b, move);
-	free (move);
-	free(frfr);
-	pgn_switch_turn(gp);
-    }
+		warnx("%s: %s", cmd, _("engine exited"));
+		annotate_job_finish(&j[i], 0);
+		batch_engine_stop(&j[i].e);
+		ret = 1;
+		continue;
+	    }
 
-    pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
-}
+	    while ((line = batch_engine_line(&j[i].e))) {
+		if (annotate_parse_line(&j[i], line)) {
+		    annotate_job_finish(&j[i], 1);
 
-void do_global_new_all()
-{
-    construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, NULL,
-	    do_new_game_from_scratch, 0, 0, "%s", _("Really start a new game from scratch?"));
-}
+		    while (batch_engine_line(&j[i].e));
+		    break;
+		}
+	    }
+	}
 
-void do_quit(WIN *win)
-{
-    wchar_t str[] = { win->c, 0 };
+	/*
+	 * A stalled engine is replaced and the game continues from the
+	 * following position.
+	 */
+	for (i = 0; i < jobs; i++) {
+	    if (j[i].g == -1 || monotonic_ms() - j[i].start <= timeout)
+		continue;
 
-    if (wcscmp (str, yes_wchar))
-	return;
+	    warnx("%s: %s", cmd, _("engine timed out"));
+	    ret = 1;
+	    memset(&j[i].pos[j[i].n], 0, sizeof(struct analysis_line_s));
+	    batch_engine_stop(&j[i].e);
 
-    quit = 1;
-}
+	    if (annotate_engine_start(&j[i], cmd, depth, secs)) {
+		annotate_job_finish(&j[i], 0);
+		continue;
+	    }
 
-void do_global_quit()
-{
-    if (config.exitdialogbox)
-	construct_message(NULL, _("[ Yes or No ]"), 1, 1, NULL, NULL, NULL,
-			  do_quit, 0, 0, _("Want to Quit?"));
-    else
-	quit = 1;
-}
+	    j[i].n++;
 
-void do_global_toggle_engine_window()
-{
-    if (!enginew) {
-	enginew = newwin(LINES, COLS, 0, 0);
-	enginep = new_panel(enginew);
-	window_draw_title(enginew, _("Engine IO Window"), COLS, CP_MESSAGE_TITLE,
-		CP_MESSAGE_BORDER);
-	hide_panel(enginep);
+	    if (annotate_next_position(&j[i]))
+		annotate_job_finish(&j[i], 1);
+	}
     }
 
-    if (panel_hidden(enginep)) {
-	update_engine_window(gp);
-	top_panel(enginep);
-    }
-    else {
-	hide_panel(enginep);
+    for (i = 0, n = gtotal - next; i < jobs; i++) {
+	if (j[i].g != -1) {
+	    annotate_job_finish(&j[i], 0);
+	    n++;
+	}
     }
-}
 
-void do_global_toggle_board_details()
-{
-    do_board_details();
-}
+    if (n) {
+	warnx(_("%i games were not annotated"), n);
+	ret = 1;
+    }
 
-void do_global_toggle_strict_castling()
-{
-    do_toggle_strict_castling();
+    for (i = 0; i < jobs; i++)
+	batch_engine_stop(&j[i].e);
+
+    free(j);
+    return ret;
 }
 
-// Global and other keys.
-static int globalkeys()
-{
-    struct userdata_s *d = gp->data;
-    int i;
+/*
+ * Tournament mode (-T). Every game is played by two batch engines which are
+ * kept in force mode and told to "go" when it is their turn. Moves are
+ * validated with libchess and clocks are kept with a monotonic timer.
+ */
+struct tourney_engine_s {
+    const char *cmd;
+    int games;
+    int wins;
+    int draws;
+    int losses;
+    int *points;	/* Half points against each opponent. */
+    int *played;	/* Games against each opponent. */
+};
 
-    /*
-     * These cannot be modified and other game mode keys cannot conflict with
-     * these.
-     */
-    switch (input_c) {
-	case KEY_ESCAPE:
-	    d->sp.icon = d->sp.srow = d->sp.scol = 0;
-	    markend = markstart = 0;
+struct tourney_clock_s {
+    long remaining;	/* Milliseconds. */
+    int period;
+    int moves;
+};
 
-	    if (keycount) {
-		keycount = 0;
-		update_status_notify(gp, NULL);
-	    }
+struct tourney_game_s {
+    GAME g;
+    BOARD b;
+    int engine[2];	/* Index of the WHITE and BLACK engines. */
+    struct batch_engine_s e[2];
+    struct tourney_clock_s clk[2];
+    long start;		/* When the side to move was told to go. */
+    int score[2];	/* Last score of each engine from its own view. */
+    int adjudicate;
+    int plies;		/* Length of the game history. */
+    int active;
+};
 
-	    if (config.validmoves)
-		pgn_reset_valid_moves(d->b);
+static struct clock_s tourney_tc;
 
-	    return 1;
-	case '0' ... '9':
-	    i = input_c - '0';
+/*
+ * Updates clock 'c' after a move which took 'ms' milliseconds. Returns 1 if
+ * the flag fell.
+ */
+static int tourney_clock_move(struct tourney_clock_s *c, long ms)
+{
+    c->remaining -= ms;
 
-	    if (keycount)
-		keycount = keycount * 10 + i;
-	    else
-		keycount = i;
+    if (c->remaining < 0)
+	return 1;
 
-	    update_status_notify(gp, _("Repeat %i"), keycount);
-	    return -1;
-	case KEY_UP:
-	    if (d->mode == MODE_HISTORY)
-		return 0;
+    c->remaining += tourney_tc.incr * 1000L;
 
-	    if (keycount)
-		d->c_row += keycount;
-	    else
-		d->c_row++;
+    if (tourney_tc.tc[c->period][0] && ++c->moves == tourney_tc.tc[c->period][0]) {
+	/* Repeat the last time control when there are no more. */
+	if (c->period + 1 < MAX_TC && tourney_tc.tc[c->period + 1][1])
+	    c->period++;
 
-	    if (d->c_row > 8)
-		d->c_row = 1;
+	c->moves = 0;
+	c->remaining += tourney_tc.tc[c->period][1] * 1000L;
+    }
 
-	    return 1;
-	case KEY_DOWN:
-	    if (d->mode == MODE_HISTORY)
-		return 0;
+    return 0;
+}
 
-	    if (keycount) {
-		d->c_row -= keycount;
-		update_status_notify(gp, NULL);
-	    }
-	    else
-		d->c_row--;
+/*
+ * Returns the Elo difference from the average opponent for a score of 'p'
+ * (0 to 1). Uses a series for the natural logarithm so libm isn't needed.
+ */
+static double elo_from_score(double p)
+{
+    double x, y, y2, t, ln = 0;
+    int k;
 
-	    if (d->c_row < 1)
-		d->c_row = 8;
+    if (p < 0.01)
+	p = 0.01;
+    else if (p > 0.99)
+	p = 0.99;
 
-	    return 1;
-	case KEY_LEFT:
-	    if (d->mode == MODE_HISTORY)
-		return 0;
+    x = 1 / p - 1;
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
 
-	    if (keycount)
-		d->c_col -= keycount;
-	    else
-		d->c_col--;
+    for (k = 0, t = y; k < 500; k++, t *= y2)
+	ln += t / (2 * k + 1);
 
-	    if (d->c_col < 1)
-		d->c_col = 8;
+    return ln ? -400 * 2 * ln / 2.302585092994046 : 0;
+}
 
-	    return 1;
-	case KEY_RIGHT:
-	    if (d->mode == MODE_HISTORY)
-		return 0;
+static void tourney_finish(struct tourney_game_s *t, struct tourney_engine_s *te,
+	PGN_FILE *pgn, const char *result, const char *termination)
+{
+    struct tourney_engine_s *w = &te[t->engine[WHITE]];
+    struct tourney_engine_s *b = &te[t->engine[BLACK]];
+    int wp = (*result == '1' && result[1] == '-') ? 2 :
+	(*result == '0') ? 0 : 1;
 
-	    if (keycount)
-		d->c_col += keycount;
-	    else
-		d->c_col++;
+    pgn_tag_add(&t->g->tag, "Result", (char *)result);
+    pgn_tag_add(&t->g->tag, "Termination", (char *)termination);
+    batch_engine_stop(&t->e[WHITE]);
+    batch_engine_stop(&t->e[BLACK]);
+    t->active = 0;
 
-	    if (d->c_col > 8)
-		d->c_col = 1;
+    w->games++;
+    b->games++;
+    w->points[t->engine[BLACK]] += wp;
+    b->points[t->engine[WHITE]] += 2 - wp;
+    w->played[t->engine[BLACK]]++;
+    b->played[t->engine[WHITE]]++;
 
-	    return 1;
-	case KEY_RESIZE:
-	    return 1;
-	case 0:
-	default:
-	    for (i = 0; global_keys[i]; i++) {
-		if (input_c == global_keys[i]->c && global_keys[i]->f) {
-		    (*global_keys[i]->f)();
-		    return 1;
-		}
-	    }
-	    break;
+    if (wp == 1) {
+	w->draws++;
+	b->draws++;
+    }
+    else {
+	(wp ? w : b)->wins++;
+	(wp ? b : w)->losses++;
     }
 
-    return 0;
+    if (pgn_write(pgn, t->g) != E_PGN_OK)
+	warnx("%s", _("Error writing game."));
+
+    fprintf(stderr, "%s - %s: %s {%s}\n", w->cmd, b->cmd, result,
+	    termination);
 }
 
-#ifdef WITH_LIBPERL
-static void perl_error(const char *fmt, ...)
+static void tourney_go(struct tourney_game_s *t)
 {
-    va_list ap;
-    char *buf;
-
-    va_start(ap, fmt);
-    vasprintf(&buf, fmt, ap);
-    va_end(ap);
+    int turn = t->g->turn;
 
-    message(ERROR_STR, ANY_KEY_STR, "%s", buf);
-    free(buf);
+    batch_engine_send(&t->e[turn], "time %li\notim %li\ngo\n",
+	    t->clk[turn].remaining / 10, t->clk[!turn].remaining / 10);
+    t->start = monotonic_ms();
 }
 
-static void do_perl_finalize(WIN *win)
+/*
+ * Handles a line of output from the engine playing 'side'.
+ */
+static void tourney_parse_line(struct tourney_game_s *t,
+	struct tourney_engine_s *te, PGN_FILE *pgn, int side, char *line)
 {
-    struct input_data_s *in = win->data;
-    GAME g = in->data;
-    struct userdata_s *d = g->data;
-    char *filename;
-    char *result = NULL;
-    char *arg = NULL;
+    struct analysis_line_s l = {0};
+    GAME g = t->g;
+    char *m, *frfr = NULL;
+    long ms;
     int n;
 
-    asprintf(&filename, "%s/perl.pl", config.datadir);
+    while (isspace(*line))
+	line++;
 
-    if (!in->str)
-	goto done;
+    if (!parse_xboard_thinking(line, &l)) {
+	t->score[side] = analysis_cp(&l);
+	return;
+    }
 
-    if (perl_init_file(filename, perl_error))
-	goto done;
+    if (!strncmp(line, "resign", 6)) {
+	tourney_finish(t, te, pgn, side == WHITE ? "0-1" : "1-0",
+		"normal");
+	return;
+    }
 
-    arg = pgn_game_to_fen(g, d->b);
+    if (!strncmp(line, "1/2-1/2", 7)) {
+	tourney_finish(t, te, pgn, "1/2-1/2", "normal");
+	return;
+    }
 
-    if (perl_call_sub(trim(in->str), arg, &result))
-	goto done;
+    if (!strncmp(line, "Illegal move", 12)) {
+	tourney_finish(t, te, pgn, side == WHITE ? "0-1" : "1-0",
+		"rules infraction");
+	return;
+    }
 
-    d->perlfen = pgn_game_to_fen(g, d->b);
-    d->perlflags = g->flags;
+    if (strncmp(line, "move ", 5) || side != g->turn)
+	return;
 
-    if (pgn_board_init_fen(g, d->b, result) != E_PGN_OK) {
-	message(ERROR_STR, ANY_KEY_STR, "%s", _("FEN parse error."));
-	pgn_board_init_fen(g, d->b, d->perlfen);
-	g->flags = d->perlflags;
-	free(d->perlfen);
-	d->perlfen = NULL;
-	goto done;
-    }
+    ms = monotonic_ms() - t->start;
 
-    SET_FLAG(d->flags, CF_PERL);
-    n = pgn_tag_find(g->tag, "FEN");
+    if (tourney_clock_move(&t->clk[side], ms)) {
+	tourney_finish(t, te, pgn, side == WHITE ? "0-1" : "1-0",
+		"time forfeit");
+	return;
+    }
 
-    if (n != E_PGN_ERR)
-	d->oldfen = strdup(g->tag[n]->value);
+    m = Malloc(MAX_SAN_MOVE_LEN + 1);
+    snprintf(m, MAX_SAN_MOVE_LEN + 1, "%s", line + 5);
 
-    pgn_tag_add(&g->tag, "FEN", result);
-    update_status_notify(g, "%s", ANY_KEY_STR);
-    update_all(g);
+    if (strlen(line + 5) > MAX_SAN_MOVE_LEN
+	    || pgn_parse_move(g, t->b, &m, &frfr) != E_PGN_OK) {
+	free(m);
+	tourney_finish(t, te, pgn, side == WHITE ? "0-1" : "1-0",
+		"rules infraction");
+	return;
+    }
 
-done:
-    free(result);
-    free(arg);
-    free(in->str);
-    free(in);
-    free(filename);
-}
+    pgn_history_add(g, t->b, m);
+    t->plies++;
+    pgn_switch_turn(g);
+    free(m);
+    batch_engine_send(&t->e[side], "force\n");
+    batch_engine_send(&t->e[!side], "%s\n", frfr);
+    free(frfr);
 
-void do_global_perl()
-{
-    struct input_data_s *in;
+    if (TEST_FLAG(g->flags, GF_GAMEOVER)) {
+	char result[8] = "1/2-1/2";
 
-    in = Calloc(1, sizeof(struct input_data_s));
-    in->data = gp;
-    in->efunc = do_perl_finalize;
-    construct_input(_("PERL Subroutine Filter"), NULL, 1, 0, NULL, NULL, NULL, 0, in, INPUT_HIST_PERL, -1);
-}
-#endif
+	if ((n = pgn_tag_find(g->tag, "Result")) != E_PGN_ERR)
+	    snprintf(result, sizeof(result), "%s", g->tag[n]->value);
 
-/*
- * A macro may contain a key that belongs to another macro so macro_match will
- * need to be updated to the new index of the matching macro.
- */
-static void find_macro(struct userdata_s *d)
-{
-    int i;
+	tourney_finish(t, te, pgn, result, "normal");
+	return;
+    }
 
     /*
-     * Macros can't contain macros when in a window.
+     * Both engines agree that one side is winning for long enough.
      */
-    if (wins)
+    n = (t->score[WHITE] >= TOURNEY_ADJUDICATE_CP
+	    && -t->score[BLACK] >= TOURNEY_ADJUDICATE_CP) ? 1 :
+	(t->score[WHITE] <= -TOURNEY_ADJUDICATE_CP
+	 && -t->score[BLACK] <= -TOURNEY_ADJUDICATE_CP) ? -1 : 0;
+    t->adjudicate = (n && (n > 0) == (t->adjudicate > 0)) ?
+	t->adjudicate + n : n;
+
+    if (abs(t->adjudicate) >= TOURNEY_ADJUDICATE_PLIES) {
+	tourney_finish(t, te, pgn, t->adjudicate > 0 ? "1-0" : "0-1",
+		"adjudication");
 	return;
+    }
 
-again:
-    for (i = 0; macros[i]; i++) {
-	if ((macros[i]->mode == -1 || macros[i]->mode == d->mode) &&
-		input_c == macros[i]->c) {
-	    input_c = macros[i]->keys[macros[i]->n++];
+    if (t->plies >= TOURNEY_MAX_PLIES) {
+	tourney_finish(t, te, pgn, "1/2-1/2", "adjudication");
+	return;
+    }
 
-	    if (!macro_depth_n && macro_match > -1) {
-		macro_depth = realloc(macro_depth, (macro_depth_n + 1) * sizeof(int));
-		macro_depth[macro_depth_n++] = macro_match;
-	    }
+    tourney_go(t);
+}
 
-	    macro_depth = realloc(macro_depth, (macro_depth_n + 1) * sizeof(int));
-	    macro_depth[macro_depth_n++] = i;
-	    macro_match = i;
-	    goto again;
+static int tourney_start_game(struct tourney_game_s *t,
+	struct tourney_engine_s *te, int white, int black, int round)
+{
+    char buf[16];
+    int i;
+
+    memset(t, 0, sizeof(struct tourney_game_s));
+
+    if (pgn_new_game() != E_PGN_OK)
+	return 1;
+
+    t->g = game[gindex];
+    t->engine[WHITE] = white;
+    t->engine[BLACK] = black;
+    pgn_board_init(t->b);
+    pgn_tag_add(&t->g->tag, "Event", _("cboard tournament"));
+    snprintf(buf, sizeof(buf), "%i", round);
+    pgn_tag_add(&t->g->tag, "Round", buf);
+    pgn_tag_add(&t->g->tag, "White", (char *)te[white].cmd);
+    pgn_tag_add(&t->g->tag, "Black", (char *)te[black].cmd);
+
+    for (i = WHITE; i <= BLACK; i++) {
+	t->clk[i].remaining = tourney_tc.tc[0][1] * 1000L;
+
+	if (batch_engine_start(&t->e[i], te[t->engine[i]].cmd)) {
+	    warn("%s", te[t->engine[i]].cmd);
+	    return 1;
 	}
+
+	batch_engine_send(&t->e[i], "level %i %i:%02i %i\nforce\n",
+		tourney_tc.tc[0][0], tourney_tc.tc[0][1] / 60,
+		tourney_tc.tc[0][1] % 60, tourney_tc.incr);
     }
+
+    t->active = 1;
+    tourney_go(t);
+    return 0;
 }
 
-/*
- * Resets the position in each macro to the first key.
- */
-static void reset_macros()
+static void tourney_report(struct tourney_engine_s *te, int total)
 {
-    int i;
-    struct userdata_s *d = gp->data;
+    int *order = Malloc(total * sizeof(int));
+    int i, n, x;
 
-again:
-    if (macro_depth_n > 0) {
-	macro_depth_n--;
-	macro_match = macro_depth[macro_depth_n];
+    for (i = 0; i < total; i++)
+	order[i] = i;
 
-	if (macros[macro_match]->n >= macros[macro_match]->total)
-	    goto again;
+    /* Few engines. Insertion sort on points. */
+    for (i = 1; i < total; i++) {
+	int pi, pn;
 
-	input_c = macros[macro_match]->keys[macros[macro_match]->n++];
-	find_macro(d);
-	return;
+	for (n = i; n > 0; n--) {
+	    for (x = pi = pn = 0; x < total; x++) {
+		pi += te[order[n]].points[x];
+		pn += te[order[n - 1]].points[x];
+	    }
+
+	    if (pi <= pn)
+		break;
+
+	    x = order[n];
+	    order[n] = order[n - 1];
+	    order[n - 1] = x;
+	}
     }
 
-    for (i = 0; macros[i]; i++)
-	macros[i]->n = 0;
+    printf("%4s %-30s %5s %4s %4s %4s %6s %6s %5s\n", _("Rank"), _("Engine"),
+	    _("Games"), "W", "D", "L", _("Points"), _("Score"), _("Elo"));
 
-    free(macro_depth);
-    macro_depth = NULL;
-    macro_depth_n = 0;
-    macro_match = -1;
-}
+    for (i = 0; i < total; i++) {
+	struct tourney_engine_s *e = &te[order[i]];
+	double p = e->games ? (e->wins + e->draws / 2.0) / e->games : 0.5;
 
-void game_loop()
-{
-    struct userdata_s *d;
+	printf("%4i %-30.30s %5i %4i %4i %4i %6.1f %5.1f%% %+5.0f\n", i + 1,
+		e->cmd, e->games, e->wins, e->draws, e->losses,
+		e->wins + e->draws / 2.0, p * 100, elo_from_score(p));
+    }
+
+    printf("\n%-30s", "");
+
+    for (i = 0; i < total; i++)
+	printf(" %9i", i + 1);
+
+    putchar('\n');
+
+    for (i = 0; i < total; i++) {
+	struct tourney_engine_s *e = &te[order[i]];
+
+	printf("%2i %-27.27s", i + 1, e->cmd);
 
-    macro_match = -1;
-    gindex = gtotal - 1;
-    gp = game[gindex];
-    d = gp->data;
+	for (n = 0; n < total; n++) {
+	    if (n == i || !e->played[order[n]])
+		printf(" %9s", "-");
+	    else
+		printf(" %5.1f/%-3i", e->points[order[n]] / 2.0,
+			e->played[order[n]]);
+	}
 
-    if (pgn_history_total(gp->hp))
-	d->mode = MODE_HISTORY;
-    else {
-         d->mode = MODE_PLAY;
-	 d->play_mode = PLAY_HE;
+	putchar('\n');
     }
 
-	d->rotate = FALSE;
-	d->go_move = 0;
-	d->pm_undo = FALSE;
-	d->pm_frfr[0] = '\0';
+    free(order);
+}
 
-    if (d->mode == MODE_HISTORY)
-	pgn_board_update(gp, d->b, pgn_history_total(gp->hp));
+/*
+ * Plays a round robin (or a gauntlet of the first engine against the rest)
+ * between the 'total' engines 'cmds'. Each pairing plays 'rounds' games with
+ * each color and 'jobs' games are played at the same time. Games are written
+ * to 'filename' and a score table is printed. Returns 0 when every game was
+ * played or 1 when an engine failed to start or the run was interrupted.
+ */
+static int run_tournament(char **cmds, int total, const char *filename,
+	char *tc, int gauntlet, int rounds, int jobs)
+{
+    struct tourney_engine_s *te;
+    struct tourney_game_s *t;
+    int (*pairs)[2];
+    int npairs = 0, next = 0, active, i, n, r;
+    PGN_FILE *pgn;
+    fd_set rfds;
+    char *line;
+    int incr = 0, ret = 0;
 
-    update_status_notify(gp, "%s", _("Type F1 for help"));
-    movestep = 2;
-    flushinp();
-    update_all(gp);
-    wtimeout(boardw, WINDOW_TIMEOUT);
+    if (total < 2) {
+	warnx("%s", _("A tournament needs at least two engines."));
+	return 1;
+    }
 
-    while (!quit) {
-	int n = 0, i;
-	char fdbuf[8192] = {0};
-	int len;
-	struct timeval tv = {0, 0};
-	fd_set rfds, wfds;
-	WIN *win = NULL;
-	WINDOW *wp = NULL;
+    if (parse_clock_input(&tourney_tc, tc, &incr) || !tourney_tc.tc[0][1]) {
+	warnx("%s: %s", tc, _("Invalid time control."));
+	return 1;
+    }
 
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
+    if (pgn_open(filename, "w", &pgn) != E_PGN_OK) {
+	warn("%s", filename);
+	return 1;
+    }
 
-	for (i = 0; i < gtotal; i++) {
-	    d = game[i]->data;
+    signal(SIGPIPE, SIG_IGN);
+    te = Calloc(total, sizeof(struct tourney_engine_s));
 
-	    if (d->engine && d->engine->pid != -1) {
-		if (d->engine->fd[ENGINE_IN_FD] > 2) {
-		    if (d->engine->fd[ENGINE_IN_FD] > n)
-			n = d->engine->fd[ENGINE_IN_FD];
+    for (i = 0; i < total; i++) {
+	te[i].cmd = cmds[i];
+	te[i].points = Calloc(total, sizeof(int));
+	te[i].played = Calloc(total, sizeof(int));
+    }
 
-		    FD_SET(d->engine->fd[ENGINE_IN_FD], &rfds);
-		}
+    pairs = Malloc(rounds * total * total * sizeof(*pairs));
 
-		if (d->engine->fd[ENGINE_OUT_FD] > 2) {
-		    if (d->engine->fd[ENGINE_OUT_FD] > n)
-			n = d->engine->fd[ENGINE_OUT_FD];
+    for (r = 0; r < rounds; r++) {
+	for (i = 0; i < total; i++) {
+	    for (n = i + 1; n < total; n++) {
+		if (gauntlet && i)
+		    break;
 
-		    FD_SET(d->engine->fd[ENGINE_OUT_FD], &wfds);
-		}
+		pairs[npairs][0] = i;
+		pairs[npairs++][1] = n;
+		pairs[npairs][0] = n;
+		pairs[npairs++][1] = i;
 	    }
 	}
+    }
 
-	if (n) {
-	    if ((n = select(n + 1, &rfds, &wfds, NULL, &tv)) > 0) {
-		for (i = 0; i < gtotal; i++) {
-		    d = game[i]->data;
+    if (jobs > npairs)
+	jobs = npairs;
 
-		    if (d->engine && d->engine->pid != -1) {
-			if (FD_ISSET(d->engine->fd[ENGINE_IN_FD], &rfds)) {
-			    len = read(d->engine->fd[ENGINE_IN_FD], fdbuf,
-				    sizeof(fdbuf));
-
-			    if (len > 0) {
-				if (d->engine->iobuf)
-				    d->engine->iobuf = Realloc(d->engine->iobuf, d->engine->len + len + 1);
-				else
-				    d->engine->iobuf = Calloc(1, len + 1);
-
-				memcpy(&(d->engine->iobuf[d->engine->len]), &fdbuf, len);
-				d->engine->len += len;
-				d->engine->iobuf[d->engine->len] = 0;
-
-				/*
-				 * The fdbuf is full or no newline
-				 * was found. So we'll append the next
-				 * read() to this games buffer.
-				 */
-				if (d->engine->iobuf[d->engine->len - 1] != '\n')
-				    continue;
-
-				parse_engine_output(game[i], d->engine->iobuf);
-				free(d->engine->iobuf);
-				d->engine->iobuf = NULL;
-				d->engine->len = 0;
-			    }
-			    else if (len == -1) {
-				if (errno != EAGAIN) {
-				    cmessage(ERROR_STR, ANY_KEY_STR, "Engine read(): %s",
-					    strerror(errno));
-				    waitpid(d->engine->pid, &n, 0);
-				    free(d->engine);
-				    d->engine = NULL;
-				    break;
-				}
-			    }
-			}
+    t = Calloc(jobs, sizeof(struct tourney_game_s));
 
-			if (FD_ISSET(d->engine->fd[ENGINE_OUT_FD], &wfds)) {
-			    if (d->engine->queue)
-				send_engine_command(game[i]);
-			}
-		    }
+    for (;;) {
+	long now = monotonic_ms(), wait = -1;
+	struct timeval tv;
+
+	FD_ZERO(&rfds);
+	active = n = 0;
+
+	for (i = 0; i < jobs; i++) {
+	    while (!t[i].active && next < npairs) {
+		if (tourney_start_game(&t[i], te, pairs[next][0],
+			    pairs[next][1], next + 1)) {
+		    batch_engine_stop(&t[i].e[WHITE]);
+		    batch_engine_stop(&t[i].e[BLACK]);
+		    ret = 1;
 		}
+
+		next++;
 	    }
-	    else {
-		if (n == -1)
-		    cmessage(ERROR_STR, ANY_KEY_STR, "select(): %s", strerror(errno));
-		/* timeout */
-	    }
-	}
 
-	gp = game[gindex];
-	d = gp->data;
+	    if (!t[i].active)
+		continue;
 
-	/*
-	 * This is needed to detect terminal resizing.
-	 */
-	doupdate();
-	if (LINES != LINES_OLD || COLS != COLS_OLD) {
-		COLS_OLD = COLS;
-		LINES_OLD = LINES;
-		do_window_resize();
-	}
+	    active++;
 
-	/*
-	 * Finds the top level window in the window stack so we know what
-	 * window the wget_wch()'ed key belongs to.
-	 */
-	if (wins) {
-	    for (i = 0; wins[i]; i++);
-	    win = wins[i-1];
-	    wp = win->w;
-	    wtimeout(wp, WINDOW_TIMEOUT);
-	}
-	else
-	    wp = boardw;
+	    for (r = WHITE; r <= BLACK; r++) {
+		FD_SET(t[i].e[r].fd, &rfds);
 
-	if (!i && pushkey)
-	    input_c = pushkey;
-	else {
-	    if (!pushkey) {
-		if (macros && macro_match >= 0) {
-		    if (macros[macro_match]->n >= macros[macro_match]->total)
-			reset_macros();
-		    else {
-			input_c = macros[macro_match]->keys[macros[macro_match]->n++];
-			find_macro(d);
-		    }
-		}
-		else {
-		  if (wget_wch(wp, &input_c) == ERR || input_c == KEY_RESIZE)
-		      continue;
-		}
+		if (t[i].e[r].fd > n)
+		    n = t[i].e[r].fd;
 	    }
-	    else
-		input_c = pushkey;
 
-	    if (win) {
-		win->c = input_c;
+	    r = t[i].clk[t[i].g->turn].remaining - (now - t[i].start);
 
-		/*
-		 * Run the function associated with the window. When the
-		 * function returns 0 win->efunc is ran (if not NULL) with
-		 * win as the one and only parameter. Then the window is
-		 * destroyed.
-		 *
-		 * The exit function may create another window which will
-		 * mess up the window stack when window_destroy() is called.
-		 * So don't destory the window until the top window is
-		 * destroyable. See window_destroy().
-		 */
-		if ((*win->func)(win) == 0) {
-		    if (win->efunc)
-			(*win->efunc)(win);
+	    if (wait == -1 || r < wait)
+		wait = (r < 0) ? 0 : r;
+	}
 
-		    win->keep = 1;
-		    window_destroy(win);
-		    update_all(gp);
-		}
+	if (!active)
+	    break;
 
-		continue;
-	    }
+	/* Interrupted. Unfinished games are not scored. */
+	if (quit) {
+	    ret = 1;
+	    break;
 	}
 
-	if (!keycount && status.notify)
-	    update_status_notify(gp, NULL);
+	tv.tv_sec = wait / 1000;
+	tv.tv_usec = (wait % 1000) * 1000 + 1000;
 
-#ifdef WITH_LIBPERL
-	if (TEST_FLAG(d->flags, CF_PERL)) {
-	    CLEAR_FLAG(d->flags, CF_PERL);
-	    pgn_board_init_fen(gp, d->b, d->perlfen);
-	    gp->flags = d->perlflags;
-	    free(d->perlfen);
-	    pgn_tag_add(&gp->tag, "FEN", d->oldfen);
-	    free(d->oldfen);
-	    d->perlfen = d->oldfen = NULL;
-	    update_all(gp);
-	    continue;
+	if (select(n + 1, &rfds, NULL, NULL, &tv) == -1) {
+	    if (errno == EINTR)
+		continue;
+
+	    err(EXIT_FAILURE, "select()");
 	}
-#endif
 
-	if (macros && macro_match < 0)
-	    find_macro(d);
+	for (i = 0; i < jobs; i++) {
+	    for (r = WHITE; t[i].active && r <= BLACK; r++) {
+		if (!FD_ISSET(t[i].e[r].fd, &rfds))
+		    continue;
 
-	if ((n = globalkeys()) == 1) {
-	    if (macro_match == -1)
-		keycount = 0;
+		n = batch_engine_read(&t[i].e[r]);
 
-	    goto refresh;
-	}
-	else if (n == -1)
-	    goto refresh;
+		if (n <= 0) {
+		    if (n == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
 
-	switch (d->mode) {
-	    case MODE_EDIT:
-		for (i = 0; edit_keys[i]; i++) {
-		    if (input_c == edit_keys[i]->c) {
-			(*edit_keys[i]->f)();
-			break;
-		    }
-		}
-		break;
-	    case MODE_PLAY:
-		for (i = 0; play_keys[i]; i++) {
-		    if (input_c == play_keys[i]->c) {
-			(*play_keys[i]->f)();
-			goto done;
-		    }
+		    tourney_finish(&t[i], te, pgn, r == WHITE ? "0-1" : "1-0",
+			    "abandoned");
+		    break;
 		}
 
-		do_play_config_command();
-		break;
-	    case MODE_HISTORY:
-		for (i = 0; history_keys[i]; i++) {
-		    if (input_c == history_keys[i]->c) {
-			(*history_keys[i]->f)();
-			break;
-		    }
-		}
-		break;
-	    default:
-		break;
+		while (t[i].active && (line = batch_engine_line(&t[i].e[r])))
+		    tourney_parse_line(&t[i], te, pgn, r, line);
+	    }
+
+	    if (t[i].active && monotonic_ms() - t[i].start >
+		    t[i].clk[t[i].g->turn].remaining)
+		tourney_finish(&t[i], te, pgn,
+			t[i].g->turn == WHITE ? "0-1" : "1-0",
+			"time forfeit");
 	}
+    }
 
-done:
-	if (keycount)
-	    update_status_notify(gp, NULL);
+    for (i = 0; i < jobs; i++) {
+	if (t[i].active) {
+	    batch_engine_stop(&t[i].e[WHITE]);
+	    batch_engine_stop(&t[i].e[BLACK]);
+	}
+    }
 
-	keycount = 0;
+    pgn_close(pgn);
+    tourney_report(te, total);
 
-refresh:
-	update_all(gp);
+    for (i = 0; i < total; i++) {
+	free(te[i].points);
+	free(te[i].played);
     }
+
+    free(te);
+    free(t);
+    free(pairs);
+    return ret;
 }
 
 void usage(const char *pn, int ret)
@@ -5072,11 +9572,15 @@ void usage(const char *pn, int ret)
     fprintf((ret) ? stderr : stdout, "%s%s",
 #ifdef DEBUG
     _(
-    "Usage: cboard [-hvCD] [-u [N]] [-p [-VtRSE] <file>]\n"
+    "Usage: cboard [-hvCD] [-u [N]] [-l N] [-P N] [-F N] [-p [-VtRSE] <file>]\n"
+    "       cboard -A [-e <cmd>] [-j N] [-d N] [-s N] -p <file>\n"
+    "       cboard -T <file> -e <cmd> -e <cmd> [-e ...] [-g] [-c <tc>] [-r N] [-j N]\n"
     "  -D  Dump libchess debugging info to \"libchess.debug\" (stderr)\n"),
 #else
 	_(
-    "Usage: cboard [-hvC] [-u [N]] [-p [-VtRSE] <file>]\n"),
+    "Usage: cboard [-hvC] [-u [N]] [-l N] [-P N] [-F N] [-p [-VtRSE] <file>]\n"
+    "       cboard -A [-e <cmd>] [-j N] [-d N] [-s N] -p <file>\n"
+    "       cboard -T <file> -e <cmd> -e <cmd> [-e ...] [-g] [-c <tc>] [-r N] [-j N]\n"),
 #endif
     _(
     "  -p  Load PGN file.\n"
@@ -5084,9 +9588,23 @@ void usage(const char *pn, int ret)
     "  -S  Validate and output a PGN formatted game.\n"
     "  -R  Like -S but write a reduced PGN formatted game.\n"
     "  -t  Also write custom PGN tags from config file.\n"
+    "  -A  Like -S but annotate each move with engine evaluations.\n"
+    "  -e  Engine command for -A (overrides config). Repeat for each -T engine.\n"
+    "  -j  Number of engines (games with -T) to run in parallel (default: number\n"
+    "      of CPUs).\n"
+    "  -d  Search depth per position.\n"
+    "  -s  Search time per position in seconds (default 1 without -d).\n"
+    "  -T  Play an engine tournament and write the games to <file>.\n"
+    "  -g  Gauntlet of the first engine against the others (default: round robin).\n"
+    "  -c  Tournament time control in clock syntax (default: 1m+1s).\n"
+    "  -r  Number of rounds. Each pairing plays both colors once a round.\n"
     "  -E  Stop processing on file parsing error (overrides config).\n"
     "  -C  Enable strict castling (overrides config).\n"
     "  -u  Enable/disable UTF-8 pieces (1=enable, 0=disable, overrides config).\n"
+    "  -l  Number of lines kept in the engine IO window (default 256). Scroll\n"
+    "      the window with PageUp, PageDown, Home and End.\n"
+    "  -P  Number of engine processes shared by all games (default 2).\n"
+    "  -F  Maximum number of screen updates per second (default 30).\n"
     "  -v  Version information.\n"
     "  -h  This help text.\n"));
 
@@ -5099,6 +9617,15 @@ void cleanup_all()
 
     stop_clock();
     free_userdata();
+    free(engine_pool);
+    free(board_geom.grid);
+    free_tag_cache();
+    free_tag_search();
+    free_tag_index();
+    reset_explorer();
+    reset_position_cache();
+    free_move_index();
+    free(move_results);
     pgn_free_all();
     free(config.engine_cmd);
     free(config.pattern);
@@ -5142,6 +9669,11 @@ void cleanup_all()
 	    delwin(enginew);
 	}
 
+	if (analysisw) {
+	    del_panel(analysisp);
+	    delwin(analysisw);
+	}
+
 	endwin();
     }
 
@@ -5203,10 +9735,29 @@ void catch_signal(int which)
     }
 }
 
+/*
+ * libchess calls this every PGN_PROGRESS bytes read. The loading window and
+ * the stderr line are only redrawn when the percentage changes so a large
+ * database isn't repainted thousands of times while it is parsed.
+ */
 void loading_progress(long total, long offset)
 {
+    static int last = -1;
+    static long last_total, last_offset;
     int n = (100 * (offset / 100) / (total / 100));
 
+    /* Another file is being loaded. */
+    if (total != last_total || offset < last_offset)
+	last = -1;
+
+    last_total = total;
+    last_offset = offset;
+
+    if (n == last)
+	return;
+
+    last = n;
+
     if (curses_initialized)
 	update_loading_window(n);
     else {
@@ -5219,6 +9770,16 @@ static void set_defaults()
 {
     set_config_defaults();
     set_default_keys();
+    add_key_binding(&history_keys, do_history_analyze, 'a',
+	    _("toggle engine analysis of the current position"), 0);
+    add_key_binding(&history_keys, do_history_explorer, 'o',
+	    _("opening explorer for the current position"), 0);
+    add_key_binding(&global_keys, do_global_game_list, 'L',
+	    _("list, sort and filter the games"), 0);
+    add_key_binding(&global_keys, do_global_find_moves, 'F',
+	    _("find moves in all games"), 0);
+    add_key_binding(&global_keys, do_global_move_results, 'f',
+	    _("show the results of the last move search"), 0);
     filetype = FILE_NONE;
     pgn_config_set(PGN_PROGRESS, 1024);
     pgn_config_set(PGN_PROGRESS_FUNC, loading_progress);
@@ -5233,6 +9794,10 @@ int main(int argc, char *argv[])
     int ret = EXIT_SUCCESS;
     int validate_only = 0, validate_and_write = 0;
     int write_custom_tags = 0;
+    int annotate = 0, jobs = 0, depth = 0, secs = 0;
+    int gauntlet = 0, rounds = 1, nengines = 0;
+    char **engines = NULL;
+    char *tourney_file = NULL, *tourney_clock = "1m+1s";
     int i = 0;
     PGN_FILE *pgn;
     int utf8_pieces = -1;
@@ -5275,9 +9840,9 @@ int main(int argc, char *argv[])
     set_defaults();
 
 #ifdef DEBUG
-    while ((opt = getopt(argc, argv, "DCEVtSRhp:vu::")) != -1) {
+    while ((opt = getopt(argc, argv, "DCEVtSRAhp:vu::l:e:j:d:s:P:T:c:gr:F:")) != -1) {
 #else
-    while ((opt = getopt(argc, argv, "ECVtSRhp:vu::")) != -1) {
+    while ((opt = getopt(argc, argv, "ECVtSRAhp:vu::l:e:j:d:s:P:T:c:gr:F:")) != -1) {
 #endif
 	switch (opt) {
 #ifdef DEBUG
@@ -5295,6 +9860,38 @@ int main(int argc, char *argv[])
 	    case 'E':
 		i = 1;
 		break;
+	    case 'A':
+		annotate = 1;
+		validate_and_write = validate_only = 1;
+		break;
+	    case 'e':
+		engines = Realloc(engines, (nengines + 1) * sizeof(char *));
+		engines[nengines++] = optarg;
+		break;
+	    case 'T':
+		tourney_file = optarg;
+		break;
+	    case 'c':
+		tourney_clock = optarg;
+		break;
+	    case 'g':
+		gauntlet = 1;
+		break;
+	    case 'r':
+		rounds = atoi(optarg);
+
+		if (rounds < 1)
+		    usage(argv[0], EXIT_FAILURE);
+		break;
+	    case 'j':
+		jobs = atoi(optarg);
+		break;
+	    case 'd':
+		depth = atoi(optarg);
+		break;
+	    case 's':
+		secs = atoi(optarg);
+		break;
 	    case 'R':
 		pgn_config_set(PGN_REDUCED, 1);
 	    case 'S':
@@ -5314,6 +9911,24 @@ int main(int argc, char *argv[])
 	    case 'u':
 	        utf8_pieces = optarg ? atoi (optarg): 1;
 		break;
+	    case 'P':
+		engine_pool_size = atoi(optarg);
+
+		if (engine_pool_size < 1)
+		    usage(argv[0], EXIT_FAILURE);
+		break;
+	    case 'F':
+		frame_rate = atoi(optarg);
+
+		if (frame_rate < 1)
+		    usage(argv[0], EXIT_FAILURE);
+		break;
+	    case 'l':
+		engine_scrollback = atoi(optarg);
+
+		if (engine_scrollback < 1)
+		    usage(argv[0], EXIT_FAILURE);
+		break;
 	    case 'h':
 	    default:
 		usage(argv[0], EXIT_SUCCESS);
@@ -5338,6 +9953,28 @@ int main(int argc, char *argv[])
 
     srandom(getpid());
 
+    if (jobs <= 0)
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (tourney_file) {
+	if (run_tournament(engines, nengines, tourney_file, tourney_clock,
+		    gauntlet, rounds, jobs))
+	    ret = EXIT_FAILURE;
+
+	free(engines);
+	cleanup_all();
+	exit(ret);
+    }
+
+    /*
+     * With a progress function set libchess asks for the file offset after
+     * every character it reads. Nobody sees the progress of this parse when
+     * stderr is redirected so don't pay for it. Loading from the curses UI
+     * shows the loading window again.
+     */
+    if (!isatty(STDERR_FILENO))
+	pgn_config_set(PGN_PROGRESS, 0L);
+
     switch (filetype) {
 	case FILE_PGN:
 	    if (pgn_open(loadfile, "r", &pgn) != E_PGN_OK)
@@ -5359,7 +9996,15 @@ int main(int argc, char *argv[])
 	    break;
     }
 
+    pgn_config_set(PGN_PROGRESS, 1024);
+
     if (validate_only || validate_and_write) {
+	if (annotate) {
+	    if (annotate_games(engines ? engines[0] : config.engine_cmd,
+			jobs, depth, secs))
+		ret = EXIT_FAILURE;
+	}
+
 	if (validate_and_write) {
 	    if (pgn_open("-", "r", &pgn) != E_PGN_OK)
 		err(EXIT_FAILURE, "pgn_open()");